@@ -9,9 +9,59 @@
 #include <cmath>
 #include <cstdio>
 #include <cstdarg>
+#include <cstdlib>
+#include <cctype>
+#include <limits>
+#include <cstring>
+#include <cstddef>
+#include <cerrno>
 #include <vector>
 #include <string>
 #include <algorithm>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <deque>
+#include <memory>
+#include <atomic>
+#include <chrono>
+#include <typeinfo>
+#include <new>
+
+#ifdef _WIN32
+#include <io.h>
+#include <process.h>
+#include <sys/stat.h>
+#else
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#if defined(__linux__)
+#include <sys/syscall.h>
+#endif
+
+#if defined(_WIN32)
+#include <malloc.h>
+#endif
+
+#if defined(__GNUG__)
+#include <cxxabi.h>
+#endif
+
+// Hardware float16 conversion; MSVC has no F16C macro, but every AVX2 CPU has it.
+#if defined(__F16C__) || (defined(_MSC_VER) && defined(__AVX2__))
+#define JZQ_F16C
+#endif
+
+#if defined(JZQ_F16C) || defined(__AVX512F__)
+#include <immintrin.h>
+#endif
 
 template<typename T> struct zero { static T value(); };
 
@@ -19,1919 +69,7328 @@ template<typename T> inline T clamp(const T& x,const T& xmin,const T& xmax);
 template<typename T> inline T lerp(const T& a,const T& b,const T& t);
 
 inline std::string spf(const std::string fmt,...);
+inline const std::string& spf(std::string* out,const char* fmt,...);
+inline const char* spfv(const char* fmt,...);
 
 inline FILE* jzq_fopen(const char* filename,const char* mode);
 
-template<int N,typename T>
-struct Vec
-{
-  T v[N];
+inline std::vector<std::string> jzq_listdir(const std::string& dirName);
 
-  Vec<N,T>();
-  template<typename T2> explicit Vec<N,T>(const Vec<N,T2>& u);
-  explicit Vec<N,T>(T v0);
+template<typename F> void parallelFor(int n,F fun);
 
-  Vec<N,T>(T v0,T v1);
-  Vec<N,T>(T v0,T v1,T v2);
-  Vec<N,T>(T v0,T v1,T v2,T v3);
-  Vec<N,T>(T v0,T v1,T v2,T v3,T v4);
-  Vec<N,T>(T v0,T v1,T v2,T v3,T v4,T v5);
+// Scoped profiling. With JZQ_PROFILE defined, JZQ_PROFILE_SCOPE(name) records
+// the time spent in the enclosing scope into a per-thread ring buffer of
+// JZQ_PROFILE_CAPACITY events, and jzq_profile_write dumps every thread's
+// events as Chrome/Perfetto trace JSON. The heavy operations of this header
+// are instrumented. Without JZQ_PROFILE the macro expands to nothing.
+#ifdef JZQ_PROFILE
 
-  T&       operator()(int i);
-  const T& operator()(int i) const;
-  T&       operator[](int i);
-  const T& operator[](int i) const;
+#ifndef JZQ_PROFILE_CAPACITY
+#define JZQ_PROFILE_CAPACITY 65536
+#endif
 
-  Vec<N,T> operator*=(const Vec<N,T>& u);
-  Vec<N,T> operator+=(const Vec<N,T>& u);
+namespace jzq_detail
+{
+  struct ProfileEvent
+  {
+    const char* name;
+    long long   start;
+    long long   duration;
+  };
+
+  // The fields are atomics so that jzq_profile_write can read them while the
+  // owner writes; every access is relaxed and costs the same as a plain one.
+  struct ProfileSlot
+  {
+    std::atomic<const char*> name;
+    std::atomic<long long>   start;
+    std::atomic<long long>   duration;
+  };
+
+  // Only the owning thread writes events, so recording never takes a lock.
+  // It works like a seqlock: claimed is advanced before a slot is rewritten
+  // and head after the event is complete. A reader copies the slots below
+  // head and then keeps only those that claimed shows were not rewritten
+  // meanwhile. When the buffer is full the oldest events are overwritten.
+  struct ProfileBuffer
+  {
+    explicit ProfileBuffer(int tid) : tid(tid),events(JZQ_PROFILE_CAPACITY),head(0),claimed(0) { }
 
-  Vec<N,T> operator*=(T s);
-  Vec<N,T> operator+=(T s);
-};
+    int                      tid;
+    std::vector<ProfileSlot> events;
+    std::atomic<long long>   head;
+    std::atomic<long long>   claimed;
 
-template<int N,typename T> Vec<N,T> operator-(const Vec<N,T>& u);
-template<int N,typename T> Vec<N,T> operator+(const Vec<N,T>& u,const Vec<N,T>& v);
-template<int N,typename T> Vec<N,T> operator-(const Vec<N,T>& u,const Vec<N,T>& v);
-template<int N,typename T> Vec<N,T> operator-(const Vec<N,T>& u,const T v);
-template<int N,typename T> Vec<N,T> operator*(const Vec<N,T>& u,const Vec<N,T>& v);
-template<int N,typename T> Vec<N,T> operator/(const Vec<N,T>& u,const Vec<N,T>& v);
-template<int N,typename T> Vec<N,T> operator*(const T s,const Vec<N,T>& u);
-template<int N,typename T> Vec<N,T> operator*(const Vec<N,T>& u,const T s);
-template<int N,typename T> Vec<N,T> operator/(const Vec<N,T>& u,const T s);
+    void record(const char* name,long long start,long long duration)
+    {
+      const long long h = head.load(std::memory_order_relaxed);
+      claimed.store(h+1,std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_release);
 
-template<int N,typename T> Vec<N,bool> operator<(const Vec<N,T>& u,const Vec<N,T>& v);
-template<int N,typename T> Vec<N,bool> operator>(const Vec<N,T>& u,const Vec<N,T>& v);
-template<int N,typename T> Vec<N,bool> operator<=(const Vec<N,T>& u,const Vec<N,T>& v);
-template<int N,typename T> Vec<N,bool> operator>=(const Vec<N,T>& u,const Vec<N,T>& v);
-template<int N,typename T> Vec<N,bool> operator==(const Vec<N,T>& u,const Vec<N,T>& v);
-template<int N,typename T> Vec<N,bool> operator!=(const Vec<N,T>& u,const Vec<N,T>& v);
+      ProfileSlot& slot = events[size_t(h%JZQ_PROFILE_CAPACITY)];
+      slot.name.store(name,std::memory_order_relaxed);
+      slot.start.store(start,std::memory_order_relaxed);
+      slot.duration.store(duration,std::memory_order_relaxed);
 
-template<int N,typename T> inline Vec<N,T> lerp(const Vec<N,T>& a,const Vec<N,T>& b,const T& t);
-template<int N,typename T> inline T        dot(const Vec<N,T>& u,const Vec<N,T>& v);
-template<typename T>       inline T        cross(const Vec<2,T> &a,const Vec<2,T> &b);
-template<typename T>       inline Vec<3,T> cross(const Vec<3,T> &a,const Vec<3,T> &b);
-template<int N,typename T> inline T        norm(const Vec<N,T>& u);
-template<int N,typename T> inline Vec<N,T> normalize(const Vec<N,T>& u);
-template<int N,typename T> inline T        min(const Vec<N,T>& u);
-template<int N,typename T> inline T        max(const Vec<N,T>& u);
-template<int N,typename T> inline T        sum(const Vec<N,T>& u);
-namespace std
-{
-template<int N,typename T> inline Vec<N,T> min(const Vec<N,T>& u,const Vec<N,T>& v);
-template<int N,typename T> inline Vec<N,T> max(const Vec<N,T>& u,const Vec<N,T>& v);
-template<int N,typename T> inline Vec<N,T> abs(const Vec<N,T>& x);
-}
+      head.store(h+1,std::memory_order_release);
+    }
 
-template<int N>            inline bool     any(const Vec<N,bool>& u);
-template<int N>            inline bool     all(const Vec<N,bool>& u);
+    // Consistent copy of the events currently in the buffer, oldest first.
+    std::vector<ProfileEvent> snapshot() const
+    {
+      const long long h = head.load(std::memory_order_acquire);
+      const long long first = std::max(h-JZQ_PROFILE_CAPACITY,0LL);
 
-template<int M,int N,typename T>
-struct Mat
-{
-  T m[M][N];
+      std::vector<ProfileEvent> out(size_t(h-first));
+      for(long long j=first;j<h;j++)
+      {
+        const ProfileSlot& slot = events[size_t(j%JZQ_PROFILE_CAPACITY)];
+        ProfileEvent& event = out[size_t(j-first)];
+        event.name = slot.name.load(std::memory_order_relaxed);
+        event.start = slot.start.load(std::memory_order_relaxed);
+        event.duration = slot.duration.load(std::memory_order_relaxed);
+      }
 
-  Mat<M,N,T>();
+      // event j is intact unless the slot was claimed again for event j+capacity
+      std::atomic_thread_fence(std::memory_order_acquire);
+      const long long c = claimed.load(std::memory_order_relaxed);
+      const long long valid = std::min(std::max(c-JZQ_PROFILE_CAPACITY,first),h);
+      out.erase(out.begin(),out.begin()+ptrdiff_t(valid-first));
+      return out;
+    }
+  };
 
-  Mat<M,N,T>(T a00,T a01,
-             T a10,T a11);
+  // Buffers are shared with the registry so they outlive their threads.
+  struct ProfileRegistry
+  {
+    ProfileRegistry() : epoch(std::chrono::steady_clock::now()) { }
 
-  Mat<M,N,T>(T a00,T a01,T a02,
-             T a10,T a11,T a12,
-             T a20,T a21,T a22);
+    std::mutex                                  mutex;
+    std::vector<std::shared_ptr<ProfileBuffer>> buffers;
+    std::chrono::steady_clock::time_point       epoch;
+  };
 
-  Mat<M,N,T>(T a00,T a01,T a02,T a03,
-             T a10,T a11,T a12,T a13,
-             T a20,T a21,T a22,T a23,
-             T a30,T a31,T a32,T a33);
+  inline ProfileRegistry& profileRegistry()
+  {
+    static ProfileRegistry registry;
+    return registry;
+  }
 
-  T&       operator()(int i,int j);
-  const T& operator()(int i,int j) const;
+  inline ProfileBuffer& profileBuffer()
+  {
+    thread_local std::shared_ptr<ProfileBuffer> buffer;
+    if (!buffer)
+    {
+      ProfileRegistry& registry = profileRegistry();
+      std::lock_guard<std::mutex> lock(registry.mutex);
+      buffer = std::make_shared<ProfileBuffer>(int(registry.buffers.size()));
+      registry.buffers.push_back(buffer);
+    }
+    return *buffer;
+  }
 
-  T*       data();
-  const T* data() const;
-};
+  inline long long profileNow()
+  {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now()-profileRegistry().epoch).count();
+  }
 
-template<int M1,int N1,int M2,int N2,typename T> Mat<M1,N2,T> operator*(const Mat<M1,N1,T>& A,const Mat<M2,N2,T>& B);
+  class ProfileScope
+  {
+  public:
+    explicit ProfileScope(const char* name) : name(name),start(profileNow()) { }
 
-template<int M,int N,typename T> Vec<M,T> operator*(const Mat<M,N,T>& A,const Vec<N,T>& u);
-template<int M,int N,typename T> Vec<N,T> operator*(const Vec<M,T>& u,const Mat<M,N,T>& A);
+    ~ProfileScope()
+    {
+      const long long end = profileNow();
+      profileBuffer().record(name,start,end-start);
+    }
 
-template<int M,int N,typename T> Mat<N,M,T> transpose(const Mat<M,N,T>& A);
+  private:
+    ProfileScope(const ProfileScope&);
+    ProfileScope& operator=(const ProfileScope&);
 
-template<typename T>
-class Array2
+    const char* name;
+    long long   start;
+  };
+}
+
+#define JZQ_PROFILE_CONCAT_(a,b) a##b
+#define JZQ_PROFILE_CONCAT(a,b) JZQ_PROFILE_CONCAT_(a,b)
+#define JZQ_PROFILE_SCOPE(name) jzq_detail::ProfileScope JZQ_PROFILE_CONCAT(jzq_profile_scope_,__LINE__)(name)
+
+// Writes the recorded events of all threads as a Chrome trace (open it in
+// chrome://tracing or ui.perfetto.dev). Threads may keep recording while
+// this runs; their events are copied consistently, but events that are
+// overwritten during the copy are left out.
+inline bool jzq_profile_write(const std::string& fileName)
 {
-public:
-  Array2();
-  Array2(int width,int height);
-  explicit Array2(const Vec<2,int>& size);
-  Array2(const Array2<T>& a);
-  ~Array2();
+  jzq_detail::ProfileRegistry& registry = jzq_detail::profileRegistry();
+  std::lock_guard<std::mutex> lock(registry.mutex);
 
-  Array2&  operator=(const Array2<T>& a);
+  FILE* f = jzq_fopen(fileName.c_str(),"w");
+  if (!f) { return false; }
 
-  inline T&       operator[](int i);
-  inline const T& operator[](int i) const;
-  inline T&       operator()(int i,int j);
-  inline const T& operator()(int i,int j) const;
-  inline T&       operator()(const Vec<2,int>& ij);
-  inline const T& operator()(const Vec<2,int>& ij) const;
+  fprintf(f,"{\"traceEvents\":[\n");
+  bool first = true;
+  for(int i=0;i<int(registry.buffers.size());i++)
+  {
+    const jzq_detail::ProfileBuffer& buffer = *registry.buffers[i];
+    const std::vector<jzq_detail::ProfileEvent> events = buffer.snapshot();
+    for(int j=0;j<int(events.size());j++)
+    {
+      const jzq_detail::ProfileEvent& event = events[j];
+      std::string name;
+      for(const char* c=event.name;*c;c++) { if (*c=='"' || *c=='\\') { name += '\\'; } name += *c; }
+      fprintf(f,"%s{\"name\":\"%s\",\"cat\":\"jzq\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":0,\"tid\":%d}",
+              first ? "" : ",\n",name.c_str(),double(event.start)/1000.0,double(event.duration)/1000.0,buffer.tid);
+      first = false;
+    }
+  }
+  fprintf(f,"\n]}\n");
 
-  Vec<2,int> size() const;
-  int        size(int dim) const;
-  int        width() const;
-  int        height() const;
-  int        numel() const;
-  bool       empty() const;
-  T*         data();
-  const T*   data() const;
-  void       clear();
-  void       swap(Array2<T>& b);
+  return fclose(f)==0;
+}
 
-private:
-  Vec<2,int> s;
-  T* d;
-};
+// Drops all recorded events; call it while no instrumented code is running.
+inline void jzq_profile_clear()
+{
+  jzq_detail::ProfileRegistry& registry = jzq_detail::profileRegistry();
+  std::lock_guard<std::mutex> lock(registry.mutex);
+  for(int i=0;i<int(registry.buffers.size());i++)
+  {
+    registry.buffers[i]->head.store(0,std::memory_order_release);
+    registry.buffers[i]->claimed.store(0,std::memory_order_release);
+  }
+}
 
-template<typename T> Vec<2,int> size(const Array2<T>& a);
-template<typename T> int        size(const Array2<T>& a,int dim);
-template<typename T> int        numel(const Array2<T>& a);
-template<typename T> bool       empty(const Array2<T>& a);
-template<typename T> void       clear(Array2<T>* a);
-template<typename T> void       swap(Array2<T>& a,Array2<T>& b);
-template<typename T> T          min(const Array2<T>& a);
-template<typename T> T          max(const Array2<T>& a);
-template<typename T> Vec<2,T>   minmax(const Array2<T>& a);
-template<typename T> Vec<2,int> argmin(const Array2<T>& a);
-template<typename T> Vec<2,int> argmax(const Array2<T>& a);
-template<typename T> T          sum(const Array2<T>& a);
-template<typename T> void       fill(Array2<T>* a,const T& value);
-
-template<typename T,typename F> Array2<T> apply(const Array2<T>& a,F fun);
+#else
 
-template<typename T> Array2<T>  a2read(const std::string& fileName);
-template<typename T> bool       a2read(Array2<T>* out_A,const std::string& fileName);
-template<typename T> bool       a2write(const Array2<T>& A,const std::string& fileName);
+#define JZQ_PROFILE_SCOPE(name)
 
-template<typename T>
-class Array3
+#endif
+
+// Allocation and copy accounting. With JZQ_COUNTERS defined, every Array2 and
+// Array3 allocation, release and deep copy is counted, both globally and per
+// element type. arrayCounters() returns a snapshot and ArrayCountersScope
+// gives the change over a scope, e.g. to assert that a pipeline stage neither
+// allocates nor copies. Without JZQ_COUNTERS none of this is compiled.
+#ifdef JZQ_COUNTERS
+
+struct ArrayCounters
 {
-public:
-  Array3();
-  explicit Array3(const Vec<3,int>& size);
-  Array3(int width,int height,int depth);
-  Array3(const Array3<T>& a);
-  ~Array3();
+  long long liveBytes;      // currently allocated
+  long long peakBytes;      // highest liveBytes seen
+  long long numAllocations;
+  long long numCopies;      // deep copies by copy construction or assignment
+  long long copiedBytes;
+};
 
-  Array3& operator=(const Array3<T>& a);
+inline ArrayCounters arrayCounters();
+template<typename T> ArrayCounters arrayCounters();
+inline std::vector<std::pair<std::string,ArrayCounters>> arrayCountersByType();
 
-  inline T&       operator[](int i);
-  inline const T& operator[](int i) const;
-  inline T&       operator()(int i,int j,int k);
-  inline const T& operator()(int i,int j,int k) const;
-  inline T&       operator()(const Vec<3,int>& ijk);
-  inline const T& operator()(const Vec<3,int>& ijk) const;
+class ArrayCountersScope
+{
+public:
+  // With a non-empty name the deltas are printed to stderr when the scope ends.
+  explicit ArrayCountersScope(const std::string& name="");
+  ~ArrayCountersScope();
 
-  Vec<3,int> size() const;
-  int        size(int dim) const;
-  int        width() const;
-  int        height() const;
-  int        depth() const;
-  int        numel() const;
-  bool       empty() const;
-  T*         data();
-  const T*   data() const;
-  void       clear();
-  void       swap(Array3<T>& b);
+  // Change since the scope began; peakBytes is how far the peak rose.
+  ArrayCounters delta() const;
 
 private:
-  Vec<3,int> s;
-  T* d;
+  ArrayCountersScope(const ArrayCountersScope&);
+  ArrayCountersScope& operator=(const ArrayCountersScope&);
+
+  std::string   name;
+  ArrayCounters start;
 };
 
-template<typename T> Vec<3,int> size(const Array3<T>& a);
-template<typename T> int        size(const Array3<T>& a,int dim);
-template<typename T> int        numel(const Array3<T>& a);
-template<typename T> bool       empty(const Array3<T>& a);
-template<typename T> void       clear(Array3<T>* a);
-template<typename T> void       swap(Array3<T>& a,Array3<T>& b);
+namespace jzq_detail
+{
+  struct AtomicCounters
+  {
+    AtomicCounters() : liveBytes(0),peakBytes(0),numAllocations(0),numCopies(0),copiedBytes(0) { }
 
-template<typename T> Array3<T>  a3read(const std::string& fileName);
-template<typename T> bool       a3read(Array2<T>* out_A,const std::string& fileName);
-template<typename T> bool       a3write(const Array2<T>& A,const std::string& fileName);
+    std::atomic<long long> liveBytes;
+    std::atomic<long long> peakBytes;
+    std::atomic<long long> numAllocations;
+    std::atomic<long long> numCopies;
+    std::atomic<long long> copiedBytes;
 
-typedef Vec<2,double>         Vec2d;
-typedef Vec<2,float>          Vec2f;
-typedef Vec<2,int>            Vec2i;
-typedef Vec<2,unsigned int>   Vec2ui;
-typedef Vec<2,short>          Vec2s;
-typedef Vec<2,unsigned short> Vec2us;
-typedef Vec<2,char>           Vec2c;
-typedef Vec<2,unsigned char>  Vec2uc;
+    void allocated(long long bytes)
+    {
+      const long long live = liveBytes.fetch_add(bytes,std::memory_order_relaxed)+bytes;
+      long long peak = peakBytes.load(std::memory_order_relaxed);
+      while(live>peak && !peakBytes.compare_exchange_weak(peak,live,std::memory_order_relaxed)) { }
+      numAllocations.fetch_add(1,std::memory_order_relaxed);
+    }
 
-typedef Vec<3,double>         Vec3d;
-typedef Vec<3,float>          Vec3f;
-typedef Vec<3,int>            Vec3i;
-typedef Vec<3,unsigned int>   Vec3ui;
-typedef Vec<3,short>          Vec3s;
-typedef Vec<3,unsigned short> Vec3us;
-typedef Vec<3,char>           Vec3c;
-typedef Vec<3,unsigned char>  Vec3uc;
+    void released(long long bytes) { liveBytes.fetch_sub(bytes,std::memory_order_relaxed); }
 
-typedef Vec<4,double>         Vec4d;
-typedef Vec<4,float>          Vec4f;
-typedef Vec<4,int>            Vec4i;
-typedef Vec<4,unsigned int>   Vec4ui;
-typedef Vec<4,short>          Vec4s;
-typedef Vec<4,unsigned short> Vec4us;
-typedef Vec<4,char>           Vec4c;
-typedef Vec<4,unsigned char>  Vec4uc;
+    void copied(long long bytes)
+    {
+      numCopies.fetch_add(1,std::memory_order_relaxed);
+      copiedBytes.fetch_add(bytes,std::memory_order_relaxed);
+    }
 
-typedef Vec<5,double>         Vec5d;
-typedef Vec<5,float>          Vec5f;
-typedef Vec<5,int>            Vec5i;
-typedef Vec<5,unsigned int>   Vec5ui;
-typedef Vec<5,short>          Vec5s;
-typedef Vec<5,unsigned short> Vec5us;
-typedef Vec<5,char>           Vec5c;
-typedef Vec<5,unsigned char>  Vec5uc;
+    ArrayCounters snapshot() const
+    {
+      ArrayCounters c;
+      c.liveBytes = liveBytes.load(std::memory_order_relaxed);
+      c.peakBytes = peakBytes.load(std::memory_order_relaxed);
+      c.numAllocations = numAllocations.load(std::memory_order_relaxed);
+      c.numCopies = numCopies.load(std::memory_order_relaxed);
+      c.copiedBytes = copiedBytes.load(std::memory_order_relaxed);
+      return c;
+    }
+  };
 
-typedef Vec<6,double>         Vec6d;
-typedef Vec<6,float>          Vec6f;
-typedef Vec<6,int>            Vec6i;
-typedef Vec<6,unsigned int>   Vec6ui;
-typedef Vec<6,short>          Vec6s;
-typedef Vec<6,unsigned short> Vec6us;
-typedef Vec<6,char>           Vec6c;
-typedef Vec<6,unsigned char>  Vec6uc;
+  struct CountersRegistry
+  {
+    std::mutex                                            mutex;
+    AtomicCounters                                        global;
+    std::vector<std::pair<std::string,AtomicCounters*>>   types;
+  };
 
-typedef Vec<2,double>         V2d;
-typedef Vec<2,float>          V2f;
-typedef Vec<2,int>            V2i;
-typedef Vec<2,unsigned int>   V2ui;
-typedef Vec<2,short>          V2s;
-typedef Vec<2,unsigned short> V2us;
-typedef Vec<2,char>           V2c;
-typedef Vec<2,unsigned char>  V2uc;
+  inline CountersRegistry& countersRegistry()
+  {
+    static CountersRegistry registry;
+    return registry;
+  }
 
-typedef Vec<3,double>         V3d;
-typedef Vec<3,float>          V3f;
-typedef Vec<3,int>            V3i;
-typedef Vec<3,unsigned int>   V3ui;
-typedef Vec<3,short>          V3s;
-typedef Vec<3,unsigned short> V3us;
-typedef Vec<3,char>           V3c;
-typedef Vec<3,unsigned char>  V3uc;
+  // Readable name of a type: typeid names are mangled ("f", "i") with gcc and clang.
+  inline std::string typeName(const std::type_info& type)
+  {
+#if defined(__GNUG__)
+    int status = 0;
+    char* demangled = abi::__cxa_demangle(type.name(),0,0,&status);
+    if (status==0 && demangled!=0)
+    {
+      const std::string name(demangled);
+      free(demangled);
+      return name;
+    }
+#endif
+    return type.name();
+  }
 
-typedef Vec<4,double>         V4d;
-typedef Vec<4,float>          V4f;
-typedef Vec<4,int>            V4i;
-typedef Vec<4,unsigned int>   V4ui;
-typedef Vec<4,short>          V4s;
-typedef Vec<4,unsigned short> V4us;
-typedef Vec<4,char>           V4c;
-typedef Vec<4,unsigned char>  V4uc;
+  // The per-type counters register themselves on first use.
+  template<typename T>
+  AtomicCounters& typeCounters()
+  {
+    static AtomicCounters* counters = []()
+    {
+      AtomicCounters* c = new AtomicCounters();
+      CountersRegistry& registry = countersRegistry();
+      std::lock_guard<std::mutex> lock(registry.mutex);
+      registry.types.push_back(std::make_pair(typeName(typeid(T)),c));
+      return c;
+    }();
+    return *counters;
+  }
+}
 
-typedef Vec<5,double>         V5d;
-typedef Vec<5,float>          V5f;
-typedef Vec<5,int>            V5i;
-typedef Vec<5,unsigned int>   V5ui;
-typedef Vec<5,short>          V5s;
-typedef Vec<5,unsigned short> V5us;
+inline ArrayCounters arrayCounters()
+{
+  return jzq_detail::countersRegistry().global.snapshot();
+}
+
+template<typename T>
+ArrayCounters arrayCounters()
+{
+  return jzq_detail::typeCounters<T>().snapshot();
+}
+
+// Per element type, named by the demangled typeid(T) where the compiler supports it.
+inline std::vector<std::pair<std::string,ArrayCounters>> arrayCountersByType()
+{
+  jzq_detail::CountersRegistry& registry = jzq_detail::countersRegistry();
+  std::lock_guard<std::mutex> lock(registry.mutex);
+
+  std::vector<std::pair<std::string,ArrayCounters>> out;
+  for(int i=0;i<int(registry.types.size());i++) { out.push_back(std::make_pair(registry.types[i].first,registry.types[i].second->snapshot())); }
+  return out;
+}
+
+inline ArrayCountersScope::ArrayCountersScope(const std::string& name) : name(name),start(arrayCounters()) { }
+
+inline ArrayCountersScope::~ArrayCountersScope()
+{
+  if (name.empty()) { return; }
+
+  const ArrayCounters d = delta();
+  fprintf(stderr,"%s: %lld allocations, %lld live bytes, peak +%lld bytes, %lld copies, %lld bytes copied\n",
+          name.c_str(),d.numAllocations,d.liveBytes,d.peakBytes,d.numCopies,d.copiedBytes);
+}
+
+inline ArrayCounters ArrayCountersScope::delta() const
+{
+  const ArrayCounters now = arrayCounters();
+  ArrayCounters d;
+  d.liveBytes = now.liveBytes-start.liveBytes;
+  d.peakBytes = now.peakBytes-start.peakBytes;
+  d.numAllocations = now.numAllocations-start.numAllocations;
+  d.numCopies = now.numCopies-start.numCopies;
+  d.copiedBytes = now.copiedBytes-start.copiedBytes;
+  return d;
+}
+
+#endif
+
+// Placement of large Array2/Array3 buffers. By default every buffer comes
+// from new[]. With setArrayAllocation(flags,minBytes), buffers of at least
+// minBytes are mapped directly from the OS instead and get the JZQ_ALLOC_*
+// treatment; smaller ones are unaffected. Only allocations made after the
+// call are affected.
+enum
+{
+  JZQ_ALLOC_FIRST_TOUCH = 1, // fault the pages in from parallel threads, split the way parallelFor splits work
+  JZQ_ALLOC_INTERLEAVE  = 2, // spread the pages round-robin over all NUMA nodes (Linux)
+  JZQ_ALLOC_HUGE_PAGES  = 4  // align to 2 MB and ask for transparent huge pages (Linux)
+};
+
+inline void setArrayAllocation(int flags,size_t minBytes=size_t(64)<<20);
+
+namespace jzq_detail
+{
+  template<typename F> void parallelForRange(int n,F fun);
+
+  struct AllocPolicy
+  {
+    AllocPolicy() : flags(0),minBytes(0) { }
+
+    std::atomic<int>    flags;
+    std::atomic<size_t> minBytes;
+  };
+
+  inline AllocPolicy& allocPolicy()
+  {
+    static AllocPolicy policy;
+    return policy;
+  }
+
+  // Live page-mapped buffers, so arrayFree knows how to release a pointer no
+  // matter how the policy changed since it was allocated.
+  struct PageBuffers
+  {
+    PageBuffers() : count(0) { }
+
+    std::mutex mutex;
+    std::vector< std::pair<void*,size_t> > buffers;
+    std::atomic<int> count;
+  };
+
+  inline PageBuffers& pageBuffers()
+  {
+    static PageBuffers buffers;
+    return buffers;
+  }
+
+#if defined(__linux__)
+  // Mask of the online NUMA nodes, parsed from e.g. "0-1" or "0,2-3".
+  inline unsigned long numaNodeMask()
+  {
+    const int maxNodes = int(sizeof(unsigned long))*8;
+    unsigned long mask = 0;
+    FILE* f = fopen("/sys/devices/system/node/online","r");
+    if (!f) { return 0; }
+    int first,last;
+    char separator;
+    while(fscanf(f,"%d",&first)==1)
+    {
+      last = first;
+      if (fscanf(f,"%c",&separator)==1 && separator=='-')
+      {
+        if (fscanf(f,"%d",&last)!=1) { break; }
+        if (fscanf(f,"%c",&separator)!=1) { separator = 0; }
+      }
+      for(int node=first;node<=last && node<maxNodes;node++) { mask |= 1ul<<node; }
+      if (separator!=',') { break; }
+    }
+    fclose(f);
+    return mask;
+  }
+#endif
+
+  inline void* pageAlloc(size_t bytes,int flags)
+  {
+#if defined(_WIN32)
+    (void)flags;
+    void* p = _aligned_malloc(bytes,4096);
+    if (!p) { throw std::bad_alloc(); }
+#else
+    const size_t hugePage = size_t(2)<<20;
+    const size_t alignment = (flags & JZQ_ALLOC_HUGE_PAGES) ? hugePage : size_t(sysconf(_SC_PAGESIZE));
+    bytes = (bytes+alignment-1)/alignment*alignment;
+
+    char* base = (char*)mmap(0,bytes+alignment,PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANONYMOUS,-1,0);
+    if (base==(char*)MAP_FAILED) { throw std::bad_alloc(); }
+
+    // trim the mapping down to an aligned run of the requested length
+    char* p = (char*)(((size_t)base+alignment-1)/alignment*alignment);
+    if (p>base) { munmap(base,p-base); }
+    munmap(p+bytes,(base+bytes+alignment)-(p+bytes));
+
+#if defined(MADV_HUGEPAGE)
+    if (flags & JZQ_ALLOC_HUGE_PAGES) { madvise(p,bytes,MADV_HUGEPAGE); }
+#endif
+#if defined(__linux__)
+    if (flags & JZQ_ALLOC_INTERLEAVE)
+    {
+      // mbind from <numaif.h> without linking libnuma; 3 is MPOL_INTERLEAVE
+      static const unsigned long nodes = numaNodeMask();
+      if (nodes & (nodes-1)) { syscall(SYS_mbind,p,bytes,3,&nodes,sizeof(nodes)*8+1,0); }
+    }
+#endif
+#endif
+
+    PageBuffers& registry = pageBuffers();
+    std::lock_guard<std::mutex> lock(registry.mutex);
+    registry.buffers.push_back(std::make_pair((void*)p,bytes));
+    registry.count.fetch_add(1,std::memory_order_relaxed);
+
+    return p;
+  }
+
+  // Removes p from the live buffers and returns its mapped size, or returns
+  // 0 if pageAlloc did not give it out. new[] never returns page-aligned
+  // pointers in practice, so the lock is only taken for mapped buffers.
+  inline size_t pageUnregister(void* p)
+  {
+    PageBuffers& registry = pageBuffers();
+    if (registry.count.load(std::memory_order_relaxed)==0 || ((size_t)p)%4096!=0) { return 0; }
+
+    std::lock_guard<std::mutex> lock(registry.mutex);
+    std::vector< std::pair<void*,size_t> >& buffers = registry.buffers;
+    for(int i=0;i<int(buffers.size());i++)
+    {
+      if (buffers[i].first==p)
+      {
+        const size_t bytes = buffers[i].second;
+        buffers[i] = buffers.back();
+        buffers.pop_back();
+        registry.count.fetch_sub(1,std::memory_order_relaxed);
+        return bytes;
+      }
+    }
+    return 0;
+  }
+
+  inline void pageRelease(void* p,size_t bytes)
+  {
+#if defined(_WIN32)
+    (void)bytes;
+    _aligned_free(p);
+#else
+    munmap(p,bytes);
+#endif
+  }
+
+  // Storage of Array2 and Array3 goes through these, so it can be accounted
+  // and placed according to the allocation policy.
+  template<typename T>
+  T* arrayAlloc(size_t n)
+  {
+#ifdef JZQ_COUNTERS
+    countersRegistry().global.allocated((long long)(n*sizeof(T)));
+    typeCounters<T>().allocated((long long)(n*sizeof(T)));
+#endif
+    const int flags = allocPolicy().flags.load(std::memory_order_relaxed);
+    if (flags==0 || n*sizeof(T)<allocPolicy().minBytes.load(std::memory_order_relaxed)) { return new T[n]; }
+
+    T* d = (T*)pageAlloc(n*sizeof(T),flags);
+
+    if (flags & JZQ_ALLOC_FIRST_TOUCH)
+    {
+      // Thread t touches the t-th fraction of the buffer, which is the part
+      // that parallelFor over its rows or slices later hands to thread t.
+      const size_t numChunks = std::min(n,size_t(4096));
+      parallelForRange(int(numChunks),[&](int begin,int end)
+      {
+        const size_t first = n*size_t(begin)/numChunks;
+        const size_t last = n*size_t(end)/numChunks;
+        std::memset((void*)(d+first),0,(last-first)*sizeof(T));
+        for(size_t i=first;i<last;i++) { new(d+i) T; }
+      });
+    }
+    else
+    {
+      for(size_t i=0;i<n;i++) { new(d+i) T; }
+    }
+
+    return d;
+  }
+
+  template<typename T>
+  void arrayFree(T* d,size_t n)
+  {
+    if (!d) { return; }
+#ifdef JZQ_COUNTERS
+    countersRegistry().global.released((long long)(n*sizeof(T)));
+    typeCounters<T>().released((long long)(n*sizeof(T)));
+#endif
+    const size_t mapped = pageUnregister(d);
+    if (mapped==0) { delete[] d; return; }
+
+    for(size_t i=0;i<n;i++) { d[i].~T(); }
+    pageRelease(d,mapped);
+  }
+
+  template<typename T>
+  void countCopy(size_t n)
+  {
+#ifdef JZQ_COUNTERS
+    if (n==0) { return; }
+    countersRegistry().global.copied((long long)(n*sizeof(T)));
+    typeCounters<T>().copied((long long)(n*sizeof(T)));
+#else
+    (void)n;
+#endif
+  }
+}
+
+enum
+{
+  JZQ_IO_DIRECT = 1, // bypass the page cache (O_DIRECT) where the platform supports it
+  JZQ_IO_ATOMIC = 2, // write to a temporary file and rename it over the destination
+  JZQ_IO_FSYNC  = 4  // flush the file (and with JZQ_IO_ATOMIC its directory) to disk before returning
+};
+
+enum
+{
+  JZQ_BORDER_CLAMP  = 0, // repeat the edge element: aaa|abcd|ddd
+  JZQ_BORDER_MIRROR = 1, // reflect about the edge element: dcb|abcd|cba
+  JZQ_BORDER_ZERO   = 2  // treat everything outside as zero
+};
+
+enum
+{
+  JZQ_FILTER_NEAREST  = 0,
+  JZQ_FILTER_BOX      = 1,
+  JZQ_FILTER_BILINEAR = 2,
+  JZQ_FILTER_BICUBIC  = 3, // Keys cubic, a=-0.5
+  JZQ_FILTER_LANCZOS  = 4  // Lanczos-3
+};
+
+enum
+{
+  JZQ_PIXEL_SRGB          = 1, // the integer pixels hold sRGB encoded color, the float ones linear color
+  JZQ_PIXEL_PREMULTIPLIED = 2  // the float pixels hold premultiplied color, the integer ones straight color
+};
+
+// IEEE 754 binary16. Converts implicitly to and from float, so arithmetic on
+// it, and on Vecs of it, is carried out in float.
+struct half
+{
+  half() = default;
+  half(float f) : bits(fromFloat(f)) { }
+  operator float() const { return toFloat(bits); }
+
+  half& operator+=(float f) { return *this = half(float(*this)+f); }
+  half& operator-=(float f) { return *this = half(float(*this)-f); }
+  half& operator*=(float f) { return *this = half(float(*this)*f); }
+  half& operator/=(float f) { return *this = half(float(*this)/f); }
+
+  static half fromBits(unsigned short bits) { half h; h.bits = bits; return h; }
+
+  // Round to nearest even; overflow gives infinity and NaNs stay NaN.
+  static unsigned short fromFloat(float f)
+  {
+    unsigned int x;
+    std::memcpy(&x,&f,sizeof(x));
+    const unsigned int sign = (x>>16)&0x8000u;
+    x &= 0x7fffffffu;
+
+    unsigned int h;
+    if (x>=0x47800000u) { h = x>0x7f800000u ? 0x7e00u : 0x7c00u; }
+    else if (x<0x38800000u)
+    {
+      // subnormal: adding 0.5 lines the mantissa up with the half's and rounds
+      float g;
+      std::memcpy(&g,&x,sizeof(g));
+      g += 0.5f;
+      std::memcpy(&h,&g,sizeof(h));
+      h -= 0x3f000000u;
+    }
+    else
+    {
+      const unsigned int odd = (x>>13)&1u;
+      h = (x+0xc8000fffu+odd)>>13;
+    }
+
+    return (unsigned short)(h|sign);
+  }
+
+  static float toFloat(unsigned short h)
+  {
+    unsigned int x = (unsigned int)(h&0x7fffu)<<13;
+    const unsigned int exponent = x&0x0f800000u;
+    x += 0x38000000u;
+
+    if (exponent==0x0f800000u) { x += 0x38000000u; }
+    else if (exponent==0)
+    {
+      x += 0x00800000u;
+      float f;
+      std::memcpy(&f,&x,sizeof(f));
+      f -= 6.10351562e-05f;
+      std::memcpy(&x,&f,sizeof(x));
+    }
+
+    x |= (unsigned int)(h&0x8000u)<<16;
+    float f;
+    std::memcpy(&f,&x,sizeof(f));
+    return f;
+  }
+
+  unsigned short bits;
+};
+
+// The upper half of a float: same range, 8 bits of precision.
+struct bfloat16
+{
+  bfloat16() = default;
+  bfloat16(float f) : bits(fromFloat(f)) { }
+  operator float() const { return toFloat(bits); }
+
+  bfloat16& operator+=(float f) { return *this = bfloat16(float(*this)+f); }
+  bfloat16& operator-=(float f) { return *this = bfloat16(float(*this)-f); }
+  bfloat16& operator*=(float f) { return *this = bfloat16(float(*this)*f); }
+  bfloat16& operator/=(float f) { return *this = bfloat16(float(*this)/f); }
+
+  static bfloat16 fromBits(unsigned short bits) { bfloat16 b; b.bits = bits; return b; }
+
+  // Round to nearest even; NaNs are kept quiet rather than rounded to infinity.
+  static unsigned short fromFloat(float f)
+  {
+    unsigned int x;
+    std::memcpy(&x,&f,sizeof(x));
+    if ((x&0x7fffffffu)>0x7f800000u) { return (unsigned short)((x>>16)|0x40u); }
+    return (unsigned short)((x+0x7fffu+((x>>16)&1u))>>16);
+  }
+
+  static float toFloat(unsigned short b)
+  {
+    const unsigned int x = (unsigned int)b<<16;
+    float f;
+    std::memcpy(&f,&x,sizeof(f));
+    return f;
+  }
+
+  unsigned short bits;
+};
+
+namespace std
+{
+  template<> class numeric_limits<half>
+  {
+  public:
+    static const bool is_specialized = true;
+    static const bool is_signed = true;
+    static const bool is_integer = false;
+    static const bool is_exact = false;
+    static const bool has_infinity = true;
+    static const bool has_quiet_NaN = true;
+    static const bool has_signaling_NaN = true;
+    static const float_denorm_style has_denorm = denorm_present;
+    static const bool has_denorm_loss = false;
+    static const float_round_style round_style = round_to_nearest;
+    static const bool is_iec559 = true;
+    static const bool is_bounded = true;
+    static const bool is_modulo = false;
+    static const int digits = 11;
+    static const int digits10 = 3;
+    static const int max_digits10 = 5;
+    static const int radix = 2;
+    static const int min_exponent = -13;
+    static const int min_exponent10 = -4;
+    static const int max_exponent = 16;
+    static const int max_exponent10 = 4;
+    static const bool traps = false;
+    static const bool tinyness_before = false;
+
+    static half min()           { return half::fromBits(0x0400); }
+    static half lowest()        { return half::fromBits(0xfbff); }
+    static half max()           { return half::fromBits(0x7bff); }
+    static half epsilon()       { return half::fromBits(0x1400); }
+    static half round_error()   { return half::fromBits(0x3800); }
+    static half infinity()      { return half::fromBits(0x7c00); }
+    static half quiet_NaN()     { return half::fromBits(0x7e00); }
+    static half signaling_NaN() { return half::fromBits(0x7d00); }
+    static half denorm_min()    { return half::fromBits(0x0001); }
+  };
+
+  template<> class numeric_limits<bfloat16>
+  {
+  public:
+    static const bool is_specialized = true;
+    static const bool is_signed = true;
+    static const bool is_integer = false;
+    static const bool is_exact = false;
+    static const bool has_infinity = true;
+    static const bool has_quiet_NaN = true;
+    static const bool has_signaling_NaN = true;
+    static const float_denorm_style has_denorm = denorm_present;
+    static const bool has_denorm_loss = false;
+    static const float_round_style round_style = round_to_nearest;
+    static const bool is_iec559 = false;
+    static const bool is_bounded = true;
+    static const bool is_modulo = false;
+    static const int digits = 8;
+    static const int digits10 = 2;
+    static const int max_digits10 = 4;
+    static const int radix = 2;
+    static const int min_exponent = -125;
+    static const int min_exponent10 = -37;
+    static const int max_exponent = 128;
+    static const int max_exponent10 = 38;
+    static const bool traps = false;
+    static const bool tinyness_before = false;
+
+    static bfloat16 min()           { return bfloat16::fromBits(0x0080); }
+    static bfloat16 lowest()        { return bfloat16::fromBits(0xff7f); }
+    static bfloat16 max()           { return bfloat16::fromBits(0x7f7f); }
+    static bfloat16 epsilon()       { return bfloat16::fromBits(0x3c00); }
+    static bfloat16 round_error()   { return bfloat16::fromBits(0x3f00); }
+    static bfloat16 infinity()      { return bfloat16::fromBits(0x7f80); }
+    static bfloat16 quiet_NaN()     { return bfloat16::fromBits(0x7fc0); }
+    static bfloat16 signaling_NaN() { return bfloat16::fromBits(0x7fa0); }
+    static bfloat16 denorm_min()    { return bfloat16::fromBits(0x0001); }
+  };
+}
+
+template<int N,typename T>
+struct Vec
+{
+  T v[N];
+
+  Vec<N,T>();
+  template<typename T2> explicit Vec<N,T>(const Vec<N,T2>& u);
+  explicit Vec<N,T>(T v0);
+
+  Vec<N,T>(T v0,T v1);
+  Vec<N,T>(T v0,T v1,T v2);
+  Vec<N,T>(T v0,T v1,T v2,T v3);
+  Vec<N,T>(T v0,T v1,T v2,T v3,T v4);
+  Vec<N,T>(T v0,T v1,T v2,T v3,T v4,T v5);
+
+  T&       operator()(int i);
+  const T& operator()(int i) const;
+  T&       operator[](int i);
+  const T& operator[](int i) const;
+
+  Vec<N,T> operator*=(const Vec<N,T>& u);
+  Vec<N,T> operator+=(const Vec<N,T>& u);
+
+  Vec<N,T> operator*=(T s);
+  Vec<N,T> operator+=(T s);
+};
+
+template<int N,typename T> Vec<N,T> operator-(const Vec<N,T>& u);
+template<int N,typename T> Vec<N,T> operator+(const Vec<N,T>& u,const Vec<N,T>& v);
+template<int N,typename T> Vec<N,T> operator-(const Vec<N,T>& u,const Vec<N,T>& v);
+template<int N,typename T> Vec<N,T> operator-(const Vec<N,T>& u,const T v);
+template<int N,typename T> Vec<N,T> operator*(const Vec<N,T>& u,const Vec<N,T>& v);
+template<int N,typename T> Vec<N,T> operator/(const Vec<N,T>& u,const Vec<N,T>& v);
+template<int N,typename T> Vec<N,T> operator*(const T s,const Vec<N,T>& u);
+template<int N,typename T> Vec<N,T> operator*(const Vec<N,T>& u,const T s);
+template<int N,typename T> Vec<N,T> operator/(const Vec<N,T>& u,const T s);
+
+template<int N,typename T> Vec<N,bool> operator<(const Vec<N,T>& u,const Vec<N,T>& v);
+template<int N,typename T> Vec<N,bool> operator>(const Vec<N,T>& u,const Vec<N,T>& v);
+template<int N,typename T> Vec<N,bool> operator<=(const Vec<N,T>& u,const Vec<N,T>& v);
+template<int N,typename T> Vec<N,bool> operator>=(const Vec<N,T>& u,const Vec<N,T>& v);
+template<int N,typename T> Vec<N,bool> operator==(const Vec<N,T>& u,const Vec<N,T>& v);
+template<int N,typename T> Vec<N,bool> operator!=(const Vec<N,T>& u,const Vec<N,T>& v);
+
+template<int N,typename T> inline Vec<N,T> lerp(const Vec<N,T>& a,const Vec<N,T>& b,const T& t);
+template<int N,typename T> inline T        dot(const Vec<N,T>& u,const Vec<N,T>& v);
+template<typename T>       inline T        cross(const Vec<2,T> &a,const Vec<2,T> &b);
+template<typename T>       inline Vec<3,T> cross(const Vec<3,T> &a,const Vec<3,T> &b);
+template<int N,typename T> inline T        norm(const Vec<N,T>& u);
+template<int N,typename T> inline Vec<N,T> normalize(const Vec<N,T>& u);
+template<int N,typename T> inline T        min(const Vec<N,T>& u);
+template<int N,typename T> inline T        max(const Vec<N,T>& u);
+template<int N,typename T> inline T        sum(const Vec<N,T>& u);
+namespace std
+{
+template<int N,typename T> inline Vec<N,T> min(const Vec<N,T>& u,const Vec<N,T>& v);
+template<int N,typename T> inline Vec<N,T> max(const Vec<N,T>& u,const Vec<N,T>& v);
+template<int N,typename T> inline Vec<N,T> abs(const Vec<N,T>& x);
+}
+
+template<int N>            inline bool     any(const Vec<N,bool>& u);
+template<int N>            inline bool     all(const Vec<N,bool>& u);
+
+template<int M,int N,typename T>
+struct Mat
+{
+  T m[M][N];
+
+  Mat<M,N,T>();
+
+  Mat<M,N,T>(T a00,T a01,
+             T a10,T a11);
+
+  Mat<M,N,T>(T a00,T a01,T a02,
+             T a10,T a11,T a12,
+             T a20,T a21,T a22);
+
+  Mat<M,N,T>(T a00,T a01,T a02,T a03,
+             T a10,T a11,T a12,T a13,
+             T a20,T a21,T a22,T a23,
+             T a30,T a31,T a32,T a33);
+
+  T&       operator()(int i,int j);
+  const T& operator()(int i,int j) const;
+
+  T*       data();
+  const T* data() const;
+};
+
+template<int M1,int N1,int M2,int N2,typename T> Mat<M1,N2,T> operator*(const Mat<M1,N1,T>& A,const Mat<M2,N2,T>& B);
+
+template<int M,int N,typename T> Vec<M,T> operator*(const Mat<M,N,T>& A,const Vec<N,T>& u);
+template<int M,int N,typename T> Vec<N,T> operator*(const Vec<M,T>& u,const Mat<M,N,T>& A);
+
+template<int M,int N,typename T> Mat<N,M,T> transpose(const Mat<M,N,T>& A);
+
+namespace jzq_detail
+{
+  // Accumulator used for sums over many elements: wide integers for integer
+  // types and double for floating point, so long running sums do not drift.
+  template<typename T> struct Accum                { typedef long long type; };
+  template<>           struct Accum<float>         { typedef double    type; };
+  template<>           struct Accum<double>        { typedef double    type; };
+  template<>           struct Accum<half>          { typedef double    type; };
+  template<>           struct Accum<bfloat16>      { typedef double    type; };
+  template<int N,typename T> struct Accum<Vec<N,T>> { typedef Vec<N,typename Accum<T>::type> type; };
+
+  // T with its scalar type replaced by S.
+  template<typename T,typename S> struct Rebind                 { typedef S type; };
+  template<int N,typename T,typename S> struct Rebind<Vec<N,T>,S> { typedef Vec<N,S> type; };
+
+  template<typename T> struct Scalar                { typedef T type; };
+  template<int N,typename T> struct Scalar<Vec<N,T>> { typedef T type; };
+
+  // Uniform per-component access to scalars and Vecs.
+  template<typename T> struct Channels
+  {
+    static const int count = 1;
+    static T&       at(T& x,int)       { return x; }
+    static const T& at(const T& x,int) { return x; }
+  };
+
+  template<int N,typename T> struct Channels<Vec<N,T>>
+  {
+    static const int count = N;
+    static T&       at(Vec<N,T>& x,int c)       { return x.v[c]; }
+    static const T& at(const Vec<N,T>& x,int c) { return x.v[c]; }
+  };
+}
+
+// Contiguous run of elements, e.g. one row of an array. Element access is
+// unchecked: the bounds are checked once when the span is obtained.
+template<typename T>
+struct ArraySpan
+{
+  ArraySpan(T* b,T* e) : b(b),e(e) { }
+
+  T*       begin() const           { return b; }
+  T*       end() const             { return e; }
+  T*       data() const            { return b; }
+  int      size() const            { return int(e-b); }
+  T&       operator[](int i) const { return b[i]; }
+
+  T* b;
+  T* e;
+};
+
+// Range of consecutive equally long spans, e.g. all rows of an array;
+// dereferencing its iterator yields an ArraySpan.
+template<typename T>
+struct ArraySpans
+{
+  struct iterator
+  {
+    iterator(T* p,ptrdiff_t stride) : p(p),stride(stride) { }
+
+    ArraySpan<T> operator*() const               { return ArraySpan<T>(p,p+stride); }
+    iterator&    operator++()                    { p += stride; return *this; }
+    bool         operator==(const iterator& i) const { return p==i.p; }
+    bool         operator!=(const iterator& i) const { return p!=i.p; }
+
+    T*        p;
+    ptrdiff_t stride;
+  };
+
+  ArraySpans(T* b,ptrdiff_t stride,int count) : b(b),stride(stride),count(count) { }
+
+  iterator     begin() const           { return iterator(b,stride); }
+  iterator     end() const             { return iterator(b+stride*count,stride); }
+  int          size() const            { return count; }
+  ArraySpan<T> operator[](int i) const { return ArraySpan<T>(b+stride*i,b+stride*(i+1)); }
+
+  T*        b;
+  ptrdiff_t stride;
+  int       count;
+};
+
+namespace jzq_detail
+{
+  // Offset of element (i,rest...) with the first index varying fastest; the
+  // recursion is resolved at compile time, so it unrolls to the same
+  // arithmetic a hand-written i+(j+k*s1)*s0 would.
+  inline int arrayOffset(const int*) { return 0; }
+
+  template<typename... I>
+  inline int arrayOffset(const int* s,int i,I... rest) { return i+s[0]*arrayOffset(s+1,rest...); }
+
+  inline bool arrayInside(const int*) { return true; }
+
+  template<typename... I>
+  inline bool arrayInside(const int* s,int i,I... rest) { return i>=0 && i<s[0] && arrayInside(s+1,rest...); }
+
+  inline const char* arrayCopyName(int D)
+  {
+    static const char* names[] = { "ArrayN::copy","Array1::copy","Array2::copy","Array3::copy","Array4::copy" };
+    return D<=4 ? names[D] : names[0];
+  }
+}
+
+// Dense D-dimensional array with the first index varying fastest. Array1 to
+// Array4 are aliases of it; the constructors and accessors that take one int
+// per dimension only compile for the matching D.
+template<int D,typename T>
+class ArrayN
+{
+public:
+  ArrayN();
+  explicit ArrayN(int width);
+  ArrayN(int width,int height);
+  ArrayN(int width,int height,int depth);
+  ArrayN(int width,int height,int depth,int count);
+  explicit ArrayN(const Vec<D,int>& size);
+  ArrayN(const ArrayN<D,T>& a);
+  ArrayN(ArrayN<D,T>&& a) noexcept;
+  ~ArrayN();
+
+  ArrayN&  operator=(const ArrayN<D,T>& a);
+  ArrayN&  operator=(ArrayN<D,T>&& a) noexcept;
+
+  inline T&       operator[](int i);
+  inline const T& operator[](int i) const;
+  template<typename... I> inline T&       operator()(int i,I... rest);
+  template<typename... I> inline const T& operator()(int i,I... rest) const;
+  inline T&       operator()(const Vec<D,int>& idx);
+  inline const T& operator()(const Vec<D,int>& idx) const;
+
+  Vec<D,int> size() const;
+  int        size(int dim) const;
+  int        width() const;
+  int        height() const;
+  int        depth() const;
+  int        numel() const;
+  bool       empty() const;
+  T*         data();
+  const T*   data() const;
+  void       clear();
+  void       swap(ArrayN<D,T>& b) noexcept;
+
+  T*         begin();
+  const T*   begin() const;
+  T*         end();
+  const T*   end() const;
+
+  // row(j,k,...) takes the D-1 indices after the first; a slice is all
+  // elements with the same last index, e.g. a plane of an Array3.
+  template<typename... I> ArraySpan<T>       row(I... rest);
+  template<typename... I> ArraySpan<const T> row(I... rest) const;
+  ArraySpans<T>       rows();
+  ArraySpans<const T> rows() const;
+  ArraySpan<T>        slice(int k);
+  ArraySpan<const T>  slice(int k) const;
+  ArraySpans<T>       slices();
+  ArraySpans<const T> slices() const;
+
+private:
+  void allocate(const Vec<D,int>& size);
+
+  Vec<D,int> s;
+  T* d;
+};
+
+template<typename T> using Array1 = ArrayN<1,T>;
+template<typename T> using Array2 = ArrayN<2,T>;
+template<typename T> using Array3 = ArrayN<3,T>;
+template<typename T> using Array4 = ArrayN<4,T>;
+
+template<int D,typename T> Vec<D,int> size(const ArrayN<D,T>& a);
+template<int D,typename T> int        size(const ArrayN<D,T>& a,int dim);
+template<int D,typename T> int        numel(const ArrayN<D,T>& a);
+template<int D,typename T> bool       empty(const ArrayN<D,T>& a);
+template<int D,typename T> void       clear(ArrayN<D,T>* a);
+template<int D,typename T> void       swap(ArrayN<D,T>& a,ArrayN<D,T>& b);
+template<int D,typename T> T          min(const ArrayN<D,T>& a);
+template<int D,typename T> T          max(const ArrayN<D,T>& a);
+template<int D,typename T> Vec<2,T>   minmax(const ArrayN<D,T>& a);
+template<int D,typename T> Vec<D,int> argmin(const ArrayN<D,T>& a);
+template<int D,typename T> Vec<D,int> argmax(const ArrayN<D,T>& a);
+template<int D,typename T> T          sum(const ArrayN<D,T>& a);
+template<int D,typename T> void       fill(ArrayN<D,T>* a,const T& value);
+
+template<int D,typename T,typename F> ArrayN<D,T> apply(const ArrayN<D,T>& a,F fun);
+
+// Arrays of any dimension in the a2/a3 file format: D ints of size, the
+// element size, then the payload. anread<2,T> reads .a2 files and anread<3,T>
+// reads .a3 files; the in-place and failure semantics are those of a2read.
+template<int D,typename T> ArrayN<D,T> anread(const std::string& fileName);
+template<int D,typename T> bool        anread(ArrayN<D,T>* out_A,const std::string& fileName,int flags=0);
+template<int D,typename T> bool        anwrite(const ArrayN<D,T>& A,const std::string& fileName,int flags=0);
+
+template<typename S,typename T> Array2<S> integral(const Array2<T>& a);
+template<typename T> Array2<typename jzq_detail::Accum<T>::type> integral(const Array2<T>& a);
+template<typename S> S          boxSum(const Array2<S>& I,const Vec<2,int>& p0,const Vec<2,int>& p1);
+template<typename S> S          boxMean(const Array2<S>& I,const Vec<2,int>& p0,const Vec<2,int>& p1);
+
+template<typename T> Array2<T>  convolve(const Array2<T>& a,const Array2<float>& kernel,int border=JZQ_BORDER_CLAMP);
+template<typename T> Array2<T>  convolve(const Array2<T>& a,const std::vector<float>& kernelX,const std::vector<float>& kernelY,int border=JZQ_BORDER_CLAMP);
+template<typename T> Array2<T>  boxFilter(const Array2<T>& a,int radius,int border=JZQ_BORDER_CLAMP);
+template<typename T> Array2<T>  gaussianBlur(const Array2<T>& a,float sigma,int border=JZQ_BORDER_CLAMP);
+template<typename T> Array2<T>  erode(const Array2<T>& a,int radius);
+template<typename T> Array2<T>  dilate(const Array2<T>& a,int radius);
+template<typename T> Array2<T>  medianFilter(const Array2<T>& a,int radius,int border=JZQ_BORDER_CLAMP);
+template<typename T> Array2<T>  rankFilter(const Array2<T>& a,int radius,float p,int border=JZQ_BORDER_CLAMP);
+template<typename T> Array2<T>  bilateralFilter(const Array2<T>& a,float sigmaSpatial,float sigmaRange);
+template<typename T> Array2<T>  bilateralFilter(const Array2<T>& a,const Array2<float>& edge,float sigmaSpatial,float sigmaRange);
+template<typename T> Array2<T>  guidedFilter(const Array2<T>& a,const Array2<float>& guide,int radius,float eps);
+
+template<typename T> Array2<T>  transpose(const Array2<T>& a);
+template<typename T> void       transpose(Array2<T>* a);
+template<typename T> Array2<T>  flipX(const Array2<T>& a);
+template<typename T> void       flipX(Array2<T>* a);
+template<typename T> Array2<T>  flipY(const Array2<T>& a);
+template<typename T> void       flipY(Array2<T>* a);
+template<typename T> Array2<T>  rot90(const Array2<T>& a,int k=1);
+template<typename T> void       rot90(Array2<T>* a,int k=1);
+
+template<typename T> Array2<T>  downsample2x(const Array2<T>& a);
+template<typename T> Array2<T>  resize(const Array2<T>& a,const Vec<2,int>& size,int filter=JZQ_FILTER_BILINEAR);
+
+// Coordinates that are NaN, infinite or beyond +-2^22 lie outside the array,
+// here and in remap, warp and warpPerspective.
+template<typename T> T          sample(const Array2<T>& a,const Vec<2,float>& xy,int filter=JZQ_FILTER_BILINEAR,int border=JZQ_BORDER_CLAMP);
+template<typename T> Array2<T>  remap(const Array2<T>& a,const Array2< Vec<2,float> >& coords,int filter=JZQ_FILTER_BILINEAR,int border=JZQ_BORDER_CLAMP);
+template<typename T> Array2<T>  warp(const Array2<T>& a,const Array2< Vec<2,float> >& flow,int filter=JZQ_FILTER_BILINEAR,int border=JZQ_BORDER_CLAMP);
+template<typename T> Array2<T>  warpPerspective(const Array2<T>& a,const Mat<3,3,float>& H,const Vec<2,int>& size,int filter=JZQ_FILTER_BILINEAR,int border=JZQ_BORDER_CLAMP);
+
+template<typename T> Array2<float> distanceTransform(const Array2<T>& mask,Array2< Vec<2,int> >* out_nearest=0);
+
+// Connected component of a mask: [p0,p1) is its bounding box.
+struct Region2
+{
+  int          area;
+  Vec<2,int>   p0;
+  Vec<2,int>   p1;
+  Vec<2,float> centroid;
+};
+
+template<typename T> Array2<int>   connectedComponents(const Array2<T>& mask,int connectivity=8,std::vector<Region2>* out_regions=0);
+
+template<int D,typename T> ArrayN<D,typename jzq_detail::Rebind<T,half>::type>     toHalf(const ArrayN<D,T>& a);
+template<int D,typename T> ArrayN<D,typename jzq_detail::Rebind<T,bfloat16>::type> toBfloat16(const ArrayN<D,T>& a);
+template<int D,typename T> ArrayN<D,typename jzq_detail::Rebind<T,float>::type>    toFloat(const ArrayN<D,T>& a);
+
+// Normalized pixel conversions: 0..255 and 0..65535 map to 0..1. The flags are
+// JZQ_PIXEL_*; alpha is always linear and straight on the integer side.
+inline Array2< Vec<4,float> >          toFloat(const Array2< Vec<4,unsigned char> >& a,int flags=0);
+inline Array2< Vec<4,float> >          toFloat(const Array2< Vec<4,unsigned short> >& a,int flags=0);
+inline Array2< Vec<4,unsigned char> >  toUchar(const Array2< Vec<4,float> >& a,int flags=0);
+inline Array2< Vec<4,unsigned char> >  toUchar(const Array2< Vec<4,unsigned short> >& a);
+inline Array2< Vec<4,unsigned short> > toUshort(const Array2< Vec<4,float> >& a,int flags=0);
+inline Array2< Vec<4,unsigned short> > toUshort(const Array2< Vec<4,unsigned char> >& a);
+
+template<typename T> Array2<int>   histogram(const Array2<T>& a,int bins,const Vec<2,float>& range);
+inline               Array2<float> cdf(const Array2<int>& histogram);
+template<typename T> T             percentile(const Array2<T>& a,float p);
+template<typename T> T             median(const Array2<T>& a);
+
+template<typename T> Array2<T>  a2read(const std::string& fileName);
+// Reads into *out_A in place when it already has the file's size; a failed
+// read then leaves its contents unspecified. Otherwise *out_A is replaced
+// only after the whole file was read, and left untouched on failure.
+template<typename T> bool       a2read(Array2<T>* out_A,const std::string& fileName,int flags=0);
+template<typename T> bool       a2read(T* out_data,const Vec<2,int>& size,const std::string& fileName,int flags=0);
+template<typename T> bool       a2write(const Array2<T>& A,const std::string& fileName,int flags=0);
+
+struct A2Info
+{
+  std::string fileName;
+  Vec<2,int>  size;
+  int         elemSize;
+  bool        valid;
+};
+
+inline A2Info              a2info(const std::string& fileName);
+inline bool                a2info(A2Info* out_info,const std::string& fileName);
+inline std::vector<A2Info> a2info(const std::vector<std::string>& fileNames);
+inline std::vector<A2Info> a2scan(const std::string& dirName,const std::string& extension=".a2");
+
+// pfm, ppm and pgm reads follow the in-place and failure semantics of a2read.
+template<typename T> Array2<T>  pfmread(const std::string& fileName);
+template<typename T> bool       pfmread(Array2<T>* out_A,const std::string& fileName);
+template<typename T> bool       pfmwrite(const Array2<T>& A,const std::string& fileName);
+
+// 8-bit files (maxval<256) read into unsigned char samples and 16-bit files
+// (maxval up to 65535) into unsigned short. Samples are returned as stored,
+// relative to the file's maxval, and are not rescaled to the full type range.
+template<typename T> Array2<T>  ppmread(const std::string& fileName);
+template<typename T> bool       ppmread(Array2<T>* out_A,const std::string& fileName);
+template<typename T> bool       ppmwrite(const Array2<T>& A,const std::string& fileName);
+
+template<typename T> Array2<T>  pgmread(const std::string& fileName);
+template<typename T> bool       pgmread(Array2<T>* out_A,const std::string& fileName);
+template<typename T> bool       pgmwrite(const Array2<T>& A,const std::string& fileName);
+
+template<typename S,typename T> Array3<S> integral(const Array3<T>& a);
+template<typename T> Array3<typename jzq_detail::Accum<T>::type> integral(const Array3<T>& a);
+template<typename S> S          boxSum(const Array3<S>& I,const Vec<3,int>& p0,const Vec<3,int>& p1);
+template<typename S> S          boxMean(const Array3<S>& I,const Vec<3,int>& p0,const Vec<3,int>& p1);
+
+template<typename T> Array3<T>  convolve(const Array3<T>& a,const Array3<float>& kernel,int border=JZQ_BORDER_CLAMP);
+template<typename T> Array3<T>  convolve(const Array3<T>& a,const std::vector<float>& kernelX,const std::vector<float>& kernelY,const std::vector<float>& kernelZ,int border=JZQ_BORDER_CLAMP);
+template<typename T> Array3<T>  boxFilter(const Array3<T>& a,int radius,int border=JZQ_BORDER_CLAMP);
+template<typename T> Array3<T>  gaussianBlur(const Array3<T>& a,float sigma,int border=JZQ_BORDER_CLAMP);
+template<typename T> Array3<T>  erode(const Array3<T>& a,int radius);
+template<typename T> Array3<T>  dilate(const Array3<T>& a,int radius);
+
+template<typename T> Array3<float> distanceTransform(const Array3<T>& mask,Array3< Vec<3,int> >* out_nearest=0);
+
+struct Region3
+{
+  int          area;
+  Vec<3,int>   p0;
+  Vec<3,int>   p1;
+  Vec<3,float> centroid;
+};
+
+template<typename T> Array3<int>   connectedComponents(const Array3<T>& mask,int connectivity=26,std::vector<Region3>* out_regions=0);
+
+template<typename T> Array3<T>  a3read(const std::string& fileName);
+// Same in-place and failure semantics as a2read(Array2<T>*,...).
+template<typename T> bool       a3read(Array3<T>* out_A,const std::string& fileName,int flags=0);
+template<typename T> bool       a3read(T* out_data,const Vec<3,int>& size,const std::string& fileName,int flags=0);
+template<typename T> bool       a3write(const Array3<T>& A,const std::string& fileName,int flags=0);
+
+struct A3Info
+{
+  std::string fileName;
+  Vec<3,int>  size;
+  int         elemSize;
+  bool        valid;
+};
+
+inline A3Info              a3info(const std::string& fileName);
+inline bool                a3info(A3Info* out_info,const std::string& fileName);
+inline std::vector<A3Info> a3info(const std::vector<std::string>& fileNames);
+inline std::vector<A3Info> a3scan(const std::string& dirName,const std::string& extension=".a3");
+
+template<int D,typename T> class SharedArrayN;
+
+// Scoped write access to a SharedArrayN, returned by its write(). While a
+// writer lives the array is unshareable: copies taken from it are deep, so
+// nothing written through the writer can show up in them. References
+// obtained through a writer are valid only while the writer lives, and the
+// array must not be moved or destroyed before its writers.
+template<int D,typename T>
+class SharedArrayWriter
+{
+public:
+  SharedArrayWriter(SharedArrayWriter<D,T>&& w) noexcept;
+  ~SharedArrayWriter();
+
+  inline ArrayN<D,T>& operator*() const;
+  inline ArrayN<D,T>* operator->() const;
+
+  inline T& operator[](int i) const;
+  template<typename... I> inline T& operator()(int i,I... rest) const;
+  inline T& operator()(const Vec<D,int>& idx) const;
+
+private:
+  explicit SharedArrayWriter(SharedArrayN<D,T>* owner);
+  SharedArrayWriter(const SharedArrayWriter<D,T>&);
+  SharedArrayWriter<D,T>& operator=(const SharedArrayWriter<D,T>&);
+
+  friend class SharedArrayN<D,T>;
+
+  SharedArrayN<D,T>* owner;
+  ArrayN<D,T>*       a;
+};
+
+// Shared read-only array with copy-on-write. Copies share one buffer through
+// an atomic reference count and cost O(1); write() makes the buffer private,
+// copying it first if anyone else still holds it, and returns a scoped
+// SharedArrayWriter. A default-constructed or moved-from array is empty and
+// holds no buffer. Free functions take *a.
+template<int D,typename T>
+class SharedArrayN
+{
+public:
+  SharedArrayN();
+  template<typename... I> explicit SharedArrayN(int width,I... rest);
+  explicit SharedArrayN(const Vec<D,int>& size);
+  explicit SharedArrayN(const ArrayN<D,T>& a);
+  explicit SharedArrayN(ArrayN<D,T>&& a);
+  SharedArrayN(const SharedArrayN<D,T>& a);
+  SharedArrayN(SharedArrayN<D,T>&& a) noexcept;
+  ~SharedArrayN();
+
+  SharedArrayN<D,T>& operator=(const SharedArrayN<D,T>& a);
+  SharedArrayN<D,T>& operator=(SharedArrayN<D,T>&& a) noexcept;
+
+  inline const ArrayN<D,T>& operator*() const;
+  inline const ArrayN<D,T>* operator->() const;
+
+  inline const T& operator[](int i) const;
+  template<typename... I> inline const T& operator()(int i,I... rest) const;
+  inline const T& operator()(const Vec<D,int>& idx) const;
+
+  Vec<D,int> size() const;
+  int        width() const;
+  int        height() const;
+  int        depth() const;
+  int        numel() const;
+  bool       empty() const;
+  const T*   data() const;
+  bool       unique() const;
+
+  SharedArrayWriter<D,T> write();
+
+private:
+  const ArrayN<D,T>& get() const;
+  std::shared_ptr< ArrayN<D,T> > shareOrCopy() const;
+
+  friend class SharedArrayWriter<D,T>;
+
+  std::shared_ptr< ArrayN<D,T> > p;
+  int                            numWriters;
+};
+
+template<typename T> using SharedArray1 = SharedArrayN<1,T>;
+template<typename T> using SharedArray2 = SharedArrayN<2,T>;
+template<typename T> using SharedArray3 = SharedArrayN<3,T>;
+template<typename T> using SharedArray4 = SharedArrayN<4,T>;
+
+// All levels of the pyramid live back to back in a single allocation;
+// level 0 is the input and each next level is downsample2x of the previous.
+template<typename T>
+class Pyramid
+{
+public:
+  Pyramid();
+  explicit Pyramid(const Array2<T>& a,int numLevels=0);
+
+  int        numLevels() const;
+  Vec<2,int> size(int level) const;
+  int        width(int level) const;
+  int        height(int level) const;
+  T*         data(int level);
+  const T*   data(int level) const;
+  Array2<T>  level(int level) const;
+
+  inline T&       operator()(int level,int i,int j);
+  inline const T& operator()(int level,int i,int j) const;
+
+private:
+  std::vector<T> d;
+  std::vector<Vec<2,int>> sizes;
+  std::vector<size_t> offsets;
+};
+
+class ArrayWriter
+{
+public:
+  struct Stats
+  {
+    int       queueDepth;
+    size_t    queuedBytes;
+    long long filesWritten;
+    long long bytesWritten;
+    long long failures;
+    double    bytesPerSecond;
+  };
+
+  explicit ArrayWriter(int numThreads=0,size_t maxQueuedBytes=size_t(1)<<30,int flags=JZQ_IO_ATOMIC);
+  ~ArrayWriter();
+
+  ArrayWriter(const ArrayWriter& w) = delete;
+  ArrayWriter& operator=(const ArrayWriter& w) = delete;
+
+  template<typename T> void write(Array2<T>&& A,const std::string& fileName);
+  template<typename T> void write(Array3<T>&& A,const std::string& fileName);
+
+  void  wait();
+  Stats stats();
+
+private:
+  struct Job
+  {
+    std::string fileName;
+    size_t bytes;
+    virtual ~Job() {}
+    virtual bool run(int flags) = 0;
+  };
+
+  template<typename A> struct ArrayJob;
+
+  void push(Job* job);
+  void work();
+
+  std::vector<std::thread> threads;
+  std::deque<std::unique_ptr<Job>> queue;
+  std::mutex mutex;
+  std::condition_variable queueChanged;
+  size_t maxQueuedBytes;
+  int flags;
+  int busy;
+  bool stopping;
+  Stats counters;
+  std::chrono::steady_clock::time_point start;
+};
+
+typedef Vec<2,double>         Vec2d;
+typedef Vec<2,float>          Vec2f;
+typedef Vec<2,int>            Vec2i;
+typedef Vec<2,unsigned int>   Vec2ui;
+typedef Vec<2,short>          Vec2s;
+typedef Vec<2,unsigned short> Vec2us;
+typedef Vec<2,char>           Vec2c;
+typedef Vec<2,unsigned char>  Vec2uc;
+
+typedef Vec<3,double>         Vec3d;
+typedef Vec<3,float>          Vec3f;
+typedef Vec<3,int>            Vec3i;
+typedef Vec<3,unsigned int>   Vec3ui;
+typedef Vec<3,short>          Vec3s;
+typedef Vec<3,unsigned short> Vec3us;
+typedef Vec<3,char>           Vec3c;
+typedef Vec<3,unsigned char>  Vec3uc;
+
+typedef Vec<4,double>         Vec4d;
+typedef Vec<4,float>          Vec4f;
+typedef Vec<4,int>            Vec4i;
+typedef Vec<4,unsigned int>   Vec4ui;
+typedef Vec<4,short>          Vec4s;
+typedef Vec<4,unsigned short> Vec4us;
+typedef Vec<4,char>           Vec4c;
+typedef Vec<4,unsigned char>  Vec4uc;
+
+typedef Vec<5,double>         Vec5d;
+typedef Vec<5,float>          Vec5f;
+typedef Vec<5,int>            Vec5i;
+typedef Vec<5,unsigned int>   Vec5ui;
+typedef Vec<5,short>          Vec5s;
+typedef Vec<5,unsigned short> Vec5us;
+typedef Vec<5,char>           Vec5c;
+typedef Vec<5,unsigned char>  Vec5uc;
+
+typedef Vec<6,double>         Vec6d;
+typedef Vec<6,float>          Vec6f;
+typedef Vec<6,int>            Vec6i;
+typedef Vec<6,unsigned int>   Vec6ui;
+typedef Vec<6,short>          Vec6s;
+typedef Vec<6,unsigned short> Vec6us;
+typedef Vec<6,char>           Vec6c;
+typedef Vec<6,unsigned char>  Vec6uc;
+
+typedef Vec<2,double>         V2d;
+typedef Vec<2,float>          V2f;
+typedef Vec<2,int>            V2i;
+typedef Vec<2,unsigned int>   V2ui;
+typedef Vec<2,short>          V2s;
+typedef Vec<2,unsigned short> V2us;
+typedef Vec<2,char>           V2c;
+typedef Vec<2,unsigned char>  V2uc;
+
+typedef Vec<3,double>         V3d;
+typedef Vec<3,float>          V3f;
+typedef Vec<3,int>            V3i;
+typedef Vec<3,unsigned int>   V3ui;
+typedef Vec<3,short>          V3s;
+typedef Vec<3,unsigned short> V3us;
+typedef Vec<3,char>           V3c;
+typedef Vec<3,unsigned char>  V3uc;
+
+typedef Vec<4,double>         V4d;
+typedef Vec<4,float>          V4f;
+typedef Vec<4,int>            V4i;
+typedef Vec<4,unsigned int>   V4ui;
+typedef Vec<4,short>          V4s;
+typedef Vec<4,unsigned short> V4us;
+typedef Vec<4,char>           V4c;
+typedef Vec<4,unsigned char>  V4uc;
+
+typedef Vec<5,double>         V5d;
+typedef Vec<5,float>          V5f;
+typedef Vec<5,int>            V5i;
+typedef Vec<5,unsigned int>   V5ui;
+typedef Vec<5,short>          V5s;
+typedef Vec<5,unsigned short> V5us;
 typedef Vec<5,char>           V5c;
 typedef Vec<5,unsigned char>  V5uc;
 
-typedef Vec<6,double>         V6d;
-typedef Vec<6,float>          V6f;
-typedef Vec<6,int>            V6i;
-typedef Vec<6,unsigned int>   V6ui;
-typedef Vec<6,short>          V6s;
-typedef Vec<6,unsigned short> V6us;
-typedef Vec<6,char>           V6c;
-typedef Vec<6,unsigned char>  V6uc;
+typedef Vec<6,double>         V6d;
+typedef Vec<6,float>          V6f;
+typedef Vec<6,int>            V6i;
+typedef Vec<6,unsigned int>   V6ui;
+typedef Vec<6,short>          V6s;
+typedef Vec<6,unsigned short> V6us;
+typedef Vec<6,char>           V6c;
+typedef Vec<6,unsigned char>  V6uc;
+
+typedef Mat<2,2,float> Mat2x2f;
+typedef Mat<2,3,float> Mat2x3f;
+typedef Mat<2,4,float> Mat2x4f;
+typedef Mat<2,5,float> Mat2x5f;
+typedef Mat<2,6,float> Mat2x6f;
+typedef Mat<2,7,float> Mat2x7f;
+typedef Mat<2,8,float> Mat2x8f;
+typedef Mat<3,2,float> Mat3x2f;
+typedef Mat<3,3,float> Mat3x3f;
+typedef Mat<3,4,float> Mat3x4f;
+typedef Mat<3,5,float> Mat3x5f;
+typedef Mat<3,6,float> Mat3x6f;
+typedef Mat<3,7,float> Mat3x7f;
+typedef Mat<3,8,float> Mat3x8f;
+typedef Mat<4,2,float> Mat4x2f;
+typedef Mat<4,3,float> Mat4x3f;
+typedef Mat<4,4,float> Mat4x4f;
+typedef Mat<4,5,float> Mat4x5f;
+typedef Mat<4,6,float> Mat4x6f;
+typedef Mat<4,7,float> Mat4x7f;
+typedef Mat<4,8,float> Mat4x8f;
+typedef Mat<5,2,float> Mat5x2f;
+typedef Mat<5,3,float> Mat5x3f;
+typedef Mat<5,4,float> Mat5x4f;
+typedef Mat<5,5,float> Mat5x5f;
+typedef Mat<5,6,float> Mat5x6f;
+typedef Mat<5,7,float> Mat5x7f;
+typedef Mat<5,8,float> Mat5x8f;
+typedef Mat<6,2,float> Mat6x2f;
+typedef Mat<6,3,float> Mat6x3f;
+typedef Mat<6,4,float> Mat6x4f;
+typedef Mat<6,5,float> Mat6x5f;
+typedef Mat<6,6,float> Mat6x6f;
+typedef Mat<6,7,float> Mat6x7f;
+typedef Mat<6,8,float> Mat6x8f;
+typedef Mat<7,2,float> Mat7x2f;
+typedef Mat<7,3,float> Mat7x3f;
+typedef Mat<7,4,float> Mat7x4f;
+typedef Mat<7,5,float> Mat7x5f;
+typedef Mat<7,6,float> Mat7x6f;
+typedef Mat<7,7,float> Mat7x7f;
+typedef Mat<7,8,float> Mat7x8f;
+typedef Mat<8,2,float> Mat8x2f;
+typedef Mat<8,3,float> Mat8x3f;
+typedef Mat<8,4,float> Mat8x4f;
+typedef Mat<8,5,float> Mat8x5f;
+typedef Mat<8,6,float> Mat8x6f;
+typedef Mat<8,7,float> Mat8x7f;
+typedef Mat<8,8,float> Mat8x8f;
+
+typedef Mat<2,2,double> Mat2x2d;
+typedef Mat<2,3,double> Mat2x3d;
+typedef Mat<2,4,double> Mat2x4d;
+typedef Mat<2,5,double> Mat2x5d;
+typedef Mat<2,6,double> Mat2x6d;
+typedef Mat<2,7,double> Mat2x7d;
+typedef Mat<2,8,double> Mat2x8d;
+typedef Mat<3,2,double> Mat3x2d;
+typedef Mat<3,3,double> Mat3x3d;
+typedef Mat<3,4,double> Mat3x4d;
+typedef Mat<3,5,double> Mat3x5d;
+typedef Mat<3,6,double> Mat3x6d;
+typedef Mat<3,7,double> Mat3x7d;
+typedef Mat<3,8,double> Mat3x8d;
+typedef Mat<4,2,double> Mat4x2d;
+typedef Mat<4,3,double> Mat4x3d;
+typedef Mat<4,4,double> Mat4x4d;
+typedef Mat<4,5,double> Mat4x5d;
+typedef Mat<4,6,double> Mat4x6d;
+typedef Mat<4,7,double> Mat4x7d;
+typedef Mat<4,8,double> Mat4x8d;
+typedef Mat<5,2,double> Mat5x2d;
+typedef Mat<5,3,double> Mat5x3d;
+typedef Mat<5,4,double> Mat5x4d;
+typedef Mat<5,5,double> Mat5x5d;
+typedef Mat<5,6,double> Mat5x6d;
+typedef Mat<5,7,double> Mat5x7d;
+typedef Mat<5,8,double> Mat5x8d;
+typedef Mat<6,2,double> Mat6x2d;
+typedef Mat<6,3,double> Mat6x3d;
+typedef Mat<6,4,double> Mat6x4d;
+typedef Mat<6,5,double> Mat6x5d;
+typedef Mat<6,6,double> Mat6x6d;
+typedef Mat<6,7,double> Mat6x7d;
+typedef Mat<6,8,double> Mat6x8d;
+typedef Mat<7,2,double> Mat7x2d;
+typedef Mat<7,3,double> Mat7x3d;
+typedef Mat<7,4,double> Mat7x4d;
+typedef Mat<7,5,double> Mat7x5d;
+typedef Mat<7,6,double> Mat7x6d;
+typedef Mat<7,7,double> Mat7x7d;
+typedef Mat<7,8,double> Mat7x8d;
+typedef Mat<8,2,double> Mat8x2d;
+typedef Mat<8,3,double> Mat8x3d;
+typedef Mat<8,4,double> Mat8x4d;
+typedef Mat<8,5,double> Mat8x5d;
+typedef Mat<8,6,double> Mat8x6d;
+typedef Mat<8,7,double> Mat8x7d;
+typedef Mat<8,8,double> Mat8x8d;
+
+typedef Array2<double>                  Array2d;
+typedef Array2<float>                   Array2f;
+typedef Array2<int>                     Array2i;
+typedef Array2<unsigned int>            Array2ui;
+typedef Array2<short>                   Array2s;
+typedef Array2<unsigned short>          Array2us;
+typedef Array2<char>                    Array2c;
+typedef Array2<unsigned char>           Array2uc;
+
+typedef Array2< Vec<2,double> >         Array2V2d;
+typedef Array2< Vec<2,float> >          Array2V2f;
+typedef Array2< Vec<2,int> >            Array2V2i;
+typedef Array2< Vec<2,unsigned int> >   Array2V2ui;
+typedef Array2< Vec<2,short> >          Array2V2s;
+typedef Array2< Vec<2,unsigned short> > Array2V2us;
+typedef Array2< Vec<2,char> >           Array2V2c;
+typedef Array2< Vec<2,unsigned char> >  Array2V2uc;
+
+typedef Array2< Vec<3,double> >         Array2V3d;
+typedef Array2< Vec<3,float> >          Array2V3f;
+typedef Array2< Vec<3,int> >            Array2V3i;
+typedef Array2< Vec<3,unsigned int> >   Array2V3ui;
+typedef Array2< Vec<3,short> >          Array2V3s;
+typedef Array2< Vec<3,unsigned short> > Array2V3us;
+typedef Array2< Vec<3,char> >           Array2V3c;
+typedef Array2< Vec<3,unsigned char> >  Array2V3uc;
+
+typedef Array2< Vec<4,double> >         Array2V4d;
+typedef Array2< Vec<4,float> >          Array2V4f;
+typedef Array2< Vec<4,int> >            Array2V4i;
+typedef Array2< Vec<4,unsigned int> >   Array2V4ui;
+typedef Array2< Vec<4,short> >          Array2V4s;
+typedef Array2< Vec<4,unsigned short> > Array2V4us;
+typedef Array2< Vec<4,char> >           Array2V4c;
+typedef Array2< Vec<4,unsigned char> >  Array2V4uc;
+
+typedef Array2<double>                  A2d;
+typedef Array2<float>                   A2f;
+typedef Array2<int>                     A2i;
+typedef Array2<unsigned int>            A2ui;
+typedef Array2<short>                   A2s;
+typedef Array2<unsigned short>          A2us;
+typedef Array2<char>                    A2c;
+typedef Array2<unsigned char>           A2uc;
+
+typedef Array2< Vec<2,double> >         A2V2d;
+typedef Array2< Vec<2,float> >          A2V2f;
+typedef Array2< Vec<2,int> >            A2V2i;
+typedef Array2< Vec<2,unsigned int> >   A2V2ui;
+typedef Array2< Vec<2,short> >          A2V2s;
+typedef Array2< Vec<2,unsigned short> > A2V2us;
+typedef Array2< Vec<2,char> >           A2V2c;
+typedef Array2< Vec<2,unsigned char> >  A2V2uc;
+
+typedef Array2< Vec<3,double> >         A2V3d;
+typedef Array2< Vec<3,float> >          A2V3f;
+typedef Array2< Vec<3,int> >            A2V3i;
+typedef Array2< Vec<3,unsigned int> >   A2V3ui;
+typedef Array2< Vec<3,short> >          A2V3s;
+typedef Array2< Vec<3,unsigned short> > A2V3us;
+typedef Array2< Vec<3,char> >           A2V3c;
+typedef Array2< Vec<3,unsigned char> >  A2V3uc;
+
+typedef Array2< Vec<4,double> >         A2V4d;
+typedef Array2< Vec<4,float> >          A2V4f;
+typedef Array2< Vec<4,int> >            A2V4i;
+typedef Array2< Vec<4,unsigned int> >   A2V4ui;
+typedef Array2< Vec<4,short> >          A2V4s;
+typedef Array2< Vec<4,unsigned short> > A2V4us;
+typedef Array2< Vec<4,char> >           A2V4c;
+typedef Array2< Vec<4,unsigned char> >  A2V4uc;
+
+typedef Array3<double>                  Array3d;
+typedef Array3<float>                   Array3f;
+typedef Array3<int>                     Array3i;
+typedef Array3<unsigned int>            Array3ui;
+typedef Array3<short>                   Array3s;
+typedef Array3<unsigned short>          Array3us;
+typedef Array3<char>                    Array3c;
+typedef Array3<unsigned char>           Array3uc;
+
+typedef Array3< Vec<2,double> >         Array3V2d;
+typedef Array3< Vec<2,float> >          Array3V2f;
+typedef Array3< Vec<2,int> >            Array3V2i;
+typedef Array3< Vec<2,unsigned int> >   Array3V2ui;
+typedef Array3< Vec<2,short> >          Array3V2s;
+typedef Array3< Vec<2,unsigned short> > Array3V2us;
+typedef Array3< Vec<2,char> >           Array3V2c;
+typedef Array3< Vec<2,unsigned char> >  Array3V2uc;
+
+typedef Array3< Vec<3,double> >         Array3V3d;
+typedef Array3< Vec<3,float> >          Array3V3f;
+typedef Array3< Vec<3,int> >            Array3V3i;
+typedef Array3< Vec<3,unsigned int> >   Array3V3ui;
+typedef Array3< Vec<3,short> >          Array3V3s;
+typedef Array3< Vec<3,unsigned short> > Array3V3us;
+typedef Array3< Vec<3,char> >           Array3V3c;
+typedef Array3< Vec<3,unsigned char> >  Array3V3uc;
+
+typedef Array3< Vec<4,double> >         Array3V4d;
+typedef Array3< Vec<4,float> >          Array3V4f;
+typedef Array3< Vec<4,int> >            Array3V4i;
+typedef Array3< Vec<4,unsigned int> >   Array3V4ui;
+typedef Array3< Vec<4,short> >          Array3V4s;
+typedef Array3< Vec<4,unsigned short> > Array3V4us;
+typedef Array3< Vec<4,char> >           Array3V4c;
+typedef Array3< Vec<4,unsigned char> >  Array3V4uc;
+
+typedef Array3<double>                  A3d;
+typedef Array3<float>                   A3f;
+typedef Array3<int>                     A3i;
+typedef Array3<unsigned int>            A3ui;
+typedef Array3<short>                   A3s;
+typedef Array3<unsigned short>          A3us;
+typedef Array3<char>                    A3c;
+typedef Array3<unsigned char>           A3uc;
+
+typedef Array3< Vec<2,double> >         A3V2d;
+typedef Array3< Vec<2,float> >          A3V2f;
+typedef Array3< Vec<2,int> >            A3V2i;
+typedef Array3< Vec<2,unsigned int> >   A3V2ui;
+typedef Array3< Vec<2,short> >          A3V2s;
+typedef Array3< Vec<2,unsigned short> > A3V2us;
+typedef Array3< Vec<2,char> >           A3V2c;
+typedef Array3< Vec<2,unsigned char> >  A3V2uc;
+
+typedef Array3< Vec<3,double> >         A3V3d;
+typedef Array3< Vec<3,float> >          A3V3f;
+typedef Array3< Vec<3,int> >            A3V3i;
+typedef Array3< Vec<3,unsigned int> >   A3V3ui;
+typedef Array3< Vec<3,short> >          A3V3s;
+typedef Array3< Vec<3,unsigned short> > A3V3us;
+typedef Array3< Vec<3,char> >           A3V3c;
+typedef Array3< Vec<3,unsigned char> >  A3V3uc;
+
+typedef Array3< Vec<4,double> >         A3V4d;
+typedef Array3< Vec<4,float> >          A3V4f;
+typedef Array3< Vec<4,int> >            A3V4i;
+typedef Array3< Vec<4,unsigned int> >   A3V4ui;
+typedef Array3< Vec<4,short> >          A3V4s;
+typedef Array3< Vec<4,unsigned short> > A3V4us;
+typedef Array3< Vec<4,char> >           A3V4c;
+typedef Array3< Vec<4,unsigned char> >  A3V4uc;
+
+typedef Vec<2,half>                     Vec2h;
+typedef Vec<3,half>                     Vec3h;
+typedef Vec<4,half>                     Vec4h;
+typedef Vec<2,bfloat16>                 Vec2bf;
+typedef Vec<3,bfloat16>                 Vec3bf;
+typedef Vec<4,bfloat16>                 Vec4bf;
+
+typedef Array2<half>                    A2h;
+typedef Array2<bfloat16>                A2bf;
+typedef Array3<half>                    A3h;
+typedef Array3<bfloat16>                A3bf;
+
+template<> struct zero<char          > { static char           value() { return 0;    } };
+template<> struct zero<unsigned char > { static unsigned char  value() { return 0;    } };
+template<> struct zero<short         > { static short          value() { return 0;    } };
+template<> struct zero<unsigned short> { static unsigned short value() { return 0;    } };
+template<> struct zero<int           > { static int            value() { return 0;    } };
+template<> struct zero<unsigned int  > { static unsigned int   value() { return 0;    } };
+template<> struct zero<long long     > { static long long      value() { return 0;    } };
+template<> struct zero<float         > { static float          value() { return 0.0f; } };
+template<> struct zero<double        > { static double         value() { return 0.0;  } };
+template<> struct zero<half          > { static half           value() { return half::fromBits(0); } };
+template<> struct zero<bfloat16      > { static bfloat16       value() { return bfloat16::fromBits(0); } };
+
+template<int N,typename T>
+struct zero<Vec<N,T>>
+{
+  static Vec<N,T> value()
+  {
+    Vec<N,T> z;
+    for(int i=0;i<N;i++) { z[i] = zero<T>::value(); }
+    return z;
+  }
+};
+
+template<int M,int N,typename T>
+struct zero<Mat<M,N,T>>
+{
+  static Mat<M,N,T> value()
+  {
+    Mat<M,N,T> z;
+    for(int i=0;i<M;i++)
+    for(int j=0;j<N;j++)
+    {
+      z(i,j) = zero<T>::value();
+    }
+    return z;
+  }
+};
+
+template <typename T> inline
+T clamp(const T& x,const T& xmin,const T& xmax)
+{
+  return std::min(std::max(x,xmin),xmax);
+}
+
+template <typename T> inline
+T lerp(const T& a,const T& b,const T& t)
+{
+  return (1.0-t)*a+t*b;
+}
+
+namespace jzq_detail
+{
+  // Formats into *out, reusing its capacity. Output that fits the stack
+  // buffer costs a single vsnprintf; longer output is formatted a second time
+  // straight into the string. Output over 16 MiB or a formatting error leaves
+  // *out empty.
+  inline void vformat(std::string* out,const char* fmt,va_list ap)
+  {
+    char buf[512];
+
+    va_list ap2;
+    va_copy(ap2,ap);
+    const int n = vsnprintf(buf,sizeof(buf),fmt,ap);
+
+    if (n<0 || n>16*1024*1024) { out->clear(); }
+    else if (n<int(sizeof(buf))) { out->assign(buf,n); }
+    else
+    {
+      out->resize(size_t(n)+1);
+      vsnprintf(&(*out)[0],size_t(n)+1,fmt,ap2);
+      out->resize(size_t(n));
+    }
+
+    va_end(ap2);
+  }
+}
+
+inline std::string spf(const std::string fmt,...)
+{
+  std::string out;
+
+  va_list ap;
+  va_start(ap,fmt);
+  jzq_detail::vformat(&out,fmt.c_str(),ap);
+  va_end(ap);
+
+  return out;
+}
+
+// Formats into a caller-owned string, so a string reused across calls stops
+// allocating once it has grown to the longest output.
+inline const std::string& spf(std::string* out,const char* fmt,...)
+{
+  assert(out!=0);
+
+  va_list ap;
+  va_start(ap,fmt);
+  jzq_detail::vformat(out,fmt,ap);
+  va_end(ap);
+
+  return *out;
+}
+
+// Formats into a thread-local buffer and returns a pointer to it, which stays
+// valid until the next spfv call on the same thread.
+inline const char* spfv(const char* fmt,...)
+{
+  thread_local std::string buffer;
+
+  va_list ap;
+  va_start(ap,fmt);
+  jzq_detail::vformat(&buffer,fmt,ap);
+  va_end(ap);
+
+  return buffer.c_str();
+}
+
+#ifdef _WIN32
+extern "C"
+{
+  __declspec(dllimport)
+  int __stdcall MultiByteToWideChar
+  (
+    unsigned int CodePage,
+    unsigned long dwFlags,
+    const char* lpMultiByteStr,
+    int cbMultiByte,
+    wchar_t* lpWideCharStr,
+    int cchWideChar
+  );
+
+  __declspec(dllimport)
+  int __stdcall WideCharToMultiByte
+  (
+    unsigned int CodePage,
+    unsigned long dwFlags,
+    const wchar_t* lpWideCharStr,
+    int cchWideChar,
+    char* lpMultiByteStr,
+    int cbMultiByte,
+    const char* lpDefaultChar,
+    int* lpUsedDefaultChar
+  );
+
+  __declspec(dllimport)
+  int __stdcall MoveFileExW
+  (
+    const wchar_t* lpExistingFileName,
+    const wchar_t* lpNewFileName,
+    unsigned long dwFlags
+  );
+
+  FILE* _wfopen(const wchar_t* filename,const wchar_t* mode);
+}
+#endif
+
+namespace jzq_detail
+{
+#ifdef _WIN32
+  inline std::wstring utf8_to_wide(const std::string& str)
+  {
+    const unsigned int codePageUTF8 = 65001;
+    const int size = MultiByteToWideChar(codePageUTF8,0,(char*)str.c_str(),-1,NULL,0);
+    std::wstring wide_str(size,0);
+    MultiByteToWideChar(codePageUTF8,0,(char*)str.c_str(),-1,&wide_str[0],size);
+    wide_str.resize(size-1);
+    return wide_str;
+  }
+
+  inline std::string wide_to_utf8(const std::wstring& wide_str)
+  {
+    const unsigned int codePageUTF8 = 65001;
+    const int size = WideCharToMultiByte(codePageUTF8,0,wide_str.c_str(),-1,NULL,0,NULL,NULL);
+    std::string str(size,0);
+    WideCharToMultiByte(codePageUTF8,0,wide_str.c_str(),-1,&str[0],size,NULL,NULL);
+    str.resize(size-1);
+    return str;
+  }
+#endif
+}
+
+inline FILE* jzq_fopen(const char* filename,const char* mode)
+{
+#ifdef _WIN32
+  return _wfopen(jzq_detail::utf8_to_wide(filename).c_str(),
+                 jzq_detail::utf8_to_wide(mode).c_str());
+#else
+  return fopen(filename,mode);
+#endif
+}
+
+inline std::vector<std::string> jzq_listdir(const std::string& dirName)
+{
+  std::vector<std::string> names;
+
+#ifdef _WIN32
+  _wfinddata_t fd;
+  const intptr_t h = _wfindfirst(jzq_detail::utf8_to_wide(dirName+"/*").c_str(),&fd);
+  if (h==-1) { return names; }
+  do
+  {
+    if (!(fd.attrib & _A_SUBDIR)) { names.push_back(jzq_detail::wide_to_utf8(fd.name)); }
+  }
+  while(_wfindnext(h,&fd)==0);
+  _findclose(h);
+#else
+  DIR* dir = opendir(dirName.c_str());
+  if (!dir) { return names; }
+  while(dirent* e = readdir(dir))
+  {
+    const std::string name(e->d_name);
+    if (name!="." && name!="..") { names.push_back(name); }
+  }
+  closedir(dir);
+#endif
+
+  std::sort(names.begin(),names.end());
+  return names;
+}
+
+namespace jzq_detail
+{
+  // Set on pool workers and on a thread while it runs a parallel loop, so that
+  // parallel loops nested inside one run inline instead of oversubscribing.
+  inline bool& insideParallelFor()
+  {
+    static thread_local bool inside = false;
+    return inside;
+  }
+
+  // Persistent workers for parallelForRange, started on first use. Worker t
+  // always runs part t of a loop, so the static split below keeps touching
+  // the same elements from the same thread across passes and calls.
+  class WorkerPool
+  {
+  public:
+    static WorkerPool& instance()
+    {
+      static WorkerPool pool(std::max(int(std::thread::hardware_concurrency()),1)-1);
+      return pool;
+    }
+
+    int numWorkers() const { return int(threads.size()); }
+
+    // Runs task(part) for part in [1,numParts) on the workers and returns once
+    // all of them are done; part 0 is left to the caller, which runs it in
+    // between. Returns false without running anything if another thread is
+    // using the pool.
+    template<typename F0,typename F>
+    bool run(int numParts,F0 part0,F task)
+    {
+      std::unique_lock<std::mutex> busy(submitMutex,std::try_to_lock);
+      if (!busy.owns_lock()) { return false; }
+
+      const std::function<void(int)> job(task);
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        current = &job;
+        currentParts = numParts;
+        pending = numParts-1;
+        generation++;
+      }
+      wake.notify_all();
+
+      part0();
+
+      std::unique_lock<std::mutex> lock(mutex);
+      done.wait(lock,[&]() { return pending==0; });
+      current = 0;
+      return true;
+    }
+
+    ~WorkerPool()
+    {
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        quit = true;
+      }
+      wake.notify_all();
+      for(int t=0;t<int(threads.size());t++) { threads[t].join(); }
+    }
+
+  private:
+    explicit WorkerPool(int numWorkers) : current(0),currentParts(0),pending(0),generation(0),quit(false)
+    {
+      for(int t=1;t<=numWorkers;t++) { threads.push_back(std::thread([this,t]() { work(t); })); }
+    }
+
+    void work(int part)
+    {
+      insideParallelFor() = true;
+      unsigned long long seen = 0;
+
+      while(1)
+      {
+        const std::function<void(int)>* job;
+        {
+          std::unique_lock<std::mutex> lock(mutex);
+          wake.wait(lock,[&]() { return quit || generation!=seen; });
+          if (quit) { return; }
+          seen = generation;
+          if (part>=currentParts) { continue; }
+          job = current;
+        }
+
+        (*job)(part);
+
+        std::lock_guard<std::mutex> lock(mutex);
+        if (--pending==0) { done.notify_one(); }
+      }
+    }
+
+    std::vector<std::thread>        threads;
+    std::mutex                      submitMutex;
+    std::mutex                      mutex;
+    std::condition_variable         wake;
+    std::condition_variable         done;
+    const std::function<void(int)>* current;
+    int                             currentParts;
+    int                             pending;
+    unsigned long long              generation;
+    bool                            quit;
+  };
+
+  // Splits [0,n) into one contiguous range per thread and calls fun(begin,end)
+  // on each; thread t always gets [n*t/T,n*(t+1)/T), so passes over the same
+  // n touch the same elements from the same thread. The ranges run on the
+  // persistent WorkerPool; nested loops, and loops started while another
+  // thread holds the pool, fall back to inline and spawned threads respectively.
+  template<typename F>
+  void parallelForRange(int n,F fun)
+  {
+    WorkerPool& pool = WorkerPool::instance();
+    const int numThreads = std::min(n,pool.numWorkers()+1);
+
+    if (numThreads<=1 || insideParallelFor())
+    {
+      if (n>0) { fun(0,n); }
+      return;
+    }
+
+    const auto range = [&](int t)
+    {
+      fun(int((long long)n*t/numThreads),int((long long)n*(t+1)/numThreads));
+    };
+
+    const auto part0 = [&]()
+    {
+      insideParallelFor() = true;
+      range(0);
+      insideParallelFor() = false;
+    };
+
+    if (pool.run(numThreads,part0,range)) { return; }
+
+    std::vector<std::thread> threads;
+    for(int t=1;t<numThreads;t++)
+    {
+      threads.push_back(std::thread([&,t]()
+      {
+        insideParallelFor() = true;
+        range(t);
+      }));
+    }
+
+    part0();
+
+    for(int t=0;t<int(threads.size());t++) { threads[t].join(); }
+  }
+}
+
+template<typename F>
+void parallelFor(int n,F fun)
+{
+  jzq_detail::parallelForRange(n,[&](int begin,int end)
+  {
+    for(int i=begin;i<end;i++) { fun(i); }
+  });
+}
+
+namespace jzq_detail
+{
+  // Size of an open file in bytes, or -1 if it cannot be determined.
+#ifndef _WIN32
+  inline long long fileBytes(int fd)
+  {
+    struct stat st;
+    return fstat(fd,&st)==0 ? (long long)st.st_size : -1;
+  }
+
+  inline long long fileBytes(FILE* f) { return fileBytes(fileno(f)); }
+#else
+  inline long long fileBytes(FILE* f)
+  {
+    struct _stat64 st;
+    return _fstat64(_fileno(f),&st)==0 ? (long long)st.st_size : -1;
+  }
+#endif
+
+  // Reads an a2/a3 file: N ints of size, one int of element size, then the payload.
+  // Once the header is validated, getData(size) is called to obtain the destination
+  // buffer, which the payload is read into without any intermediate copy of the array.
+  template<int N,typename T,typename F>
+  bool arrayRead(const std::string& fileName,int flags,F getData)
+  {
+    int header[N+1];
+    T* data = 0;
+    size_t payloadBytes = 0;
+
+    struct Header
+    {
+      // The element count has to fit the int indexing of ArrayN, and the file
+      // has to hold the whole payload, so that a corrupt header can neither
+      // overflow the size nor make getData allocate more than the file holds.
+      static bool valid(const int* header,long long fileBytes,size_t* out_payloadBytes)
+      {
+        long long numel = 1;
+        for(int i=0;i<N;i++)
+        {
+          if (header[i]<1 || numel>std::numeric_limits<int>::max()/header[i]) { return false; }
+          numel *= header[i];
+        }
+        if (header[N]!=int(sizeof(T))) { return false; }
+        if (fileBytes<0 || (unsigned long long)(fileBytes)-sizeof(int)*(N+1)<(unsigned long long)numel*sizeof(T)) { return false; }
+        *out_payloadBytes = size_t(numel)*sizeof(T);
+        return true;
+      }
+
+      static Vec<N,int> size(const int* header)
+      {
+        Vec<N,int> size;
+        for(int i=0;i<N;i++) { size[i] = header[i]; }
+        return size;
+      }
+    };
+
+#if defined(O_DIRECT)
+    if (flags & JZQ_IO_DIRECT)
+    {
+      const int fd = open(fileName.c_str(),O_RDONLY|O_DIRECT);
+
+      // fall through to the buffered path on filesystems that refuse O_DIRECT
+      if (fd>=0)
+      {
+        const size_t alignment = 4096;
+        const size_t chunkBytes = 4*1024*1024;
+
+        void* chunk = 0;
+        if (posix_memalign(&chunk,alignment,chunkBytes)!=0) { close(fd); return false; }
+
+        size_t headerPos = 0;
+        size_t payloadPos = 0;
+        bool ok = false;
+
+        while(1)
+        {
+          const ssize_t n = read(fd,chunk,chunkBytes);
+          if (n<=0) { break; }
+
+          const char* p = (const char*)chunk;
+          size_t avail = size_t(n);
+
+          if (headerPos<sizeof(header))
+          {
+            const size_t k = std::min(avail,sizeof(header)-headerPos);
+            memcpy((char*)header+headerPos,p,k);
+            headerPos += k; p += k; avail -= k;
+
+            if (headerPos==sizeof(header))
+            {
+              if (!Header::valid(header,fileBytes(fd),&payloadBytes)) { break; }
+              data = getData(Header::size(header));
+              if (!data) { break; }
+            }
+          }
+
+          if (data)
+          {
+            const size_t k = std::min(avail,payloadBytes-payloadPos);
+            memcpy((char*)data+payloadPos,p,k);
+            payloadPos += k;
+            if (payloadPos==payloadBytes) { ok = true; break; }
+          }
+
+          if (size_t(n)<chunkBytes) { break; }
+        }
+
+        free(chunk);
+        close(fd);
+        return ok;
+      }
+    }
+#else
+    (void)flags;
+#endif
+
+    FILE* f = jzq_fopen(fileName.c_str(),"rb");
+
+    if (!f) { return false; }
+
+    if (fread(header,sizeof(header),1,f)!=1 ||
+        !Header::valid(header,fileBytes(f),&payloadBytes) ||
+        !(data = getData(Header::size(header))) ||
+        fread(data,payloadBytes,1,f)!=1)
+    {
+      fclose(f);
+      return false;
+    }
+
+    fclose(f);
+    return true;
+  }
+
+  inline std::string tempFileName(const std::string& fileName)
+  {
+    static std::atomic<unsigned int> counter(0);
+#ifdef _WIN32
+    const int pid = _getpid();
+#else
+    const int pid = getpid();
+#endif
+    return spf("%s.%d.%u.tmp",fileName.c_str(),pid,counter++);
+  }
+
+  inline bool replaceFile(const std::string& srcFileName,const std::string& dstFileName)
+  {
+#ifdef _WIN32
+    const unsigned long MOVEFILE_REPLACE_EXISTING_ = 0x1;
+    const unsigned long MOVEFILE_WRITE_THROUGH_ = 0x8;
+    return MoveFileExW(utf8_to_wide(srcFileName).c_str(),
+                       utf8_to_wide(dstFileName).c_str(),
+                       MOVEFILE_REPLACE_EXISTING_|MOVEFILE_WRITE_THROUGH_)!=0;
+#else
+    return rename(srcFileName.c_str(),dstFileName.c_str())==0;
+#endif
+  }
+
+  inline void syncParentDir(const std::string& fileName)
+  {
+#ifndef _WIN32
+    const size_t slash = fileName.find_last_of('/');
+    const std::string dirName = slash==std::string::npos ? "." : slash==0 ? "/" : fileName.substr(0,slash);
+    const int fd = open(dirName.c_str(),O_RDONLY);
+    if (fd>=0) { fsync(fd); close(fd); }
+#else
+    (void)fileName;
+#endif
+  }
+
+  // Writes the header and payload of an a2/a3 file with a single gathered
+  // write, without staging either in a stdio buffer.
+  inline bool arrayWriteFile(const std::string& fileName,const int* header,int headerCount,const void* data,size_t dataBytes,int flags)
+  {
+#ifdef _WIN32
+    FILE* f = jzq_fopen(fileName.c_str(),"wb");
+
+    if (!f) { return false; }
+
+    if (fwrite(header,sizeof(int)*headerCount,1,f)!=1 ||
+        fwrite(data,dataBytes,1,f)!=1 ||
+        ((flags & JZQ_IO_FSYNC) && (fflush(f)!=0 || _commit(_fileno(f))!=0)))
+    {
+      fclose(f);
+      return false;
+    }
+
+    return fclose(f)==0;
+#else
+    const int fd = open(fileName.c_str(),O_WRONLY|O_CREAT|O_TRUNC,0666);
+
+    if (fd<0) { return false; }
+
+    iovec iov[2];
+    iov[0].iov_base = (void*)header;
+    iov[0].iov_len  = sizeof(int)*headerCount;
+    iov[1].iov_base = (void*)data;
+    iov[1].iov_len  = dataBytes;
+
+    int first = 0;
+    while(first<2)
+    {
+      const ssize_t n = writev(fd,&iov[first],2-first);
+      if (n<0)
+      {
+        if (errno==EINTR) { continue; }
+        close(fd);
+        return false;
+      }
+
+      size_t written = size_t(n);
+      while(first<2 && written>=iov[first].iov_len) { written -= iov[first].iov_len; first++; }
+      if (first<2)
+      {
+        iov[first].iov_base = (char*)iov[first].iov_base + written;
+        iov[first].iov_len -= written;
+      }
+    }
+
+    if ((flags & JZQ_IO_FSYNC) && fsync(fd)!=0) { close(fd); return false; }
+
+    return close(fd)==0;
+#endif
+  }
+
+  // With JZQ_IO_ATOMIC the destination is either left untouched or replaced
+  // by a complete file; a crash can at worst leave a stray *.tmp behind.
+  inline bool arrayWrite(const std::string& fileName,const int* header,int headerCount,const void* data,size_t dataBytes,int flags)
+  {
+    if (!(flags & JZQ_IO_ATOMIC))
+    {
+      return arrayWriteFile(fileName,header,headerCount,data,dataBytes,flags);
+    }
+
+    const std::string tmpFileName = tempFileName(fileName);
+
+    if (!arrayWriteFile(tmpFileName,header,headerCount,data,dataBytes,flags) ||
+        !replaceFile(tmpFileName,fileName))
+    {
+      remove(tmpFileName.c_str());
+      return false;
+    }
+
+    if (flags & JZQ_IO_FSYNC) { syncParentDir(fileName); }
+
+    return true;
+  }
+
+  // Reads in place when *out_A already has the file's size, otherwise into a
+  // fresh array that replaces *out_A only once the whole file has been read.
+  template<int D,typename T>
+  bool arrayReadInto(ArrayN<D,T>* out_A,const std::string& fileName,int flags)
+  {
+    ArrayN<D,T> fresh;
+    T* dst = 0;
+
+    const bool ok = arrayRead<D,T>(fileName,flags,[&](const Vec<D,int>& size) -> T*
+    {
+      if (out_A!=0 && all(out_A->size()==size)) { return dst = out_A->data(); }
+      ArrayN<D,T>(size).swap(fresh);
+      return dst = fresh.data();
+    });
+
+    if (ok && out_A!=0 && dst==fresh.data()) { fresh.swap(*out_A); }
+
+    return ok;
+  }
+
+  template<int D,typename T>
+  bool arrayWriteFrom(const ArrayN<D,T>& A,const std::string& fileName,int flags)
+  {
+    if (A.numel()==0) { return false; }
+
+    int header[D+1];
+    for(int i=0;i<D;i++) { header[i] = A.size(i); }
+    header[D] = int(sizeof(T));
+
+    return arrayWrite(fileName,header,D+1,A.data(),sizeof(T)*size_t(A.numel()),flags);
+  }
+}
+
+template<int N,typename T>
+Vec<N,T>::Vec()
+{
+}
+
+template<int N,typename T>
+Vec<N,T>::Vec(T v0)
+{
+  assert(N==1);
+  v[0]=v0;
+}
+
+template<int N,typename T>
+Vec<N,T>::Vec(T v0,T v1)
+{
+  assert(N==2);
+  v[0]=v0; v[1]=v1;
+}
+
+template<int N,typename T>
+Vec<N,T>::Vec(T v0,T v1,T v2)
+{
+  assert(N==3);
+  v[0]=v0; v[1]=v1; v[2]=v2;
+}
+
+template<int N,typename T>
+Vec<N,T>::Vec(T v0,T v1,T v2,T v3)
+{
+  assert(N==4);
+  v[0]=v0; v[1]=v1; v[2]=v2; v[3]=v3;
+}
+
+template<int N,typename T>
+Vec<N,T>::Vec(T v0,T v1,T v2,T v3,T v4)
+{
+  assert(N==5);
+  v[0]=v0; v[1]=v1; v[2]=v2; v[3]=v3; v[4]=v4;
+}
+
+template<int N,typename T>
+Vec<N,T>::Vec(T v0,T v1,T v2,T v3,T v4,T v5)
+{
+  assert(N==6);
+  v[0]=v0; v[1]=v1; v[2]=v2; v[3]=v3; v[4]=v4; v[5]=v5;
+}
+
+template<int N,typename T> template<typename T2>
+Vec<N,T>::Vec(const Vec<N,T2>& u)
+{
+  for(int i=0;i<N;i++)
+  {
+    v[i] = static_cast<T>(u.v[i]);
+  }
+}
+
+template<int N,typename T>
+T& Vec<N,T>::operator()(int i)
+{
+  assert(i>=0 && i<N);
+  return v[i];
+}
+
+template<int N,typename T>
+const T& Vec<N,T>::operator()(int i) const
+{
+  assert(i>=0 && i<N);
+  return v[i];
+}
+
+template<int N,typename T>
+T& Vec<N,T>::operator[](int i)
+{
+  assert(i>=0 && i<N);
+  return v[i];
+}
+
+template<int N,typename T>
+const T& Vec<N,T>::operator[](int i) const
+{
+  assert(i>=0 && i<N);
+  return v[i];
+}
+
+template<int N,typename T>
+Vec<N,T> Vec<N,T>::operator*=(const Vec<N,T>& u)
+{
+  for(int i=0;i<N;i++) v[i]*=u(i);
+  return *this;
+}
+
+template<int N,typename T>
+Vec<N,T> Vec<N,T>::operator+=(const Vec<N,T>& u)
+{
+  for(int i=0;i<N;i++) v[i]+=u(i);
+  return *this;
+}
+
+template<int N,typename T>
+Vec<N,T> Vec<N,T>::operator*=(T s)
+{
+  for(int i=0;i<N;i++) v[i]*=s;
+  return *this;
+}
+
+template<int N,typename T>
+Vec<N,T> Vec<N,T>::operator+=(T s)
+{
+  for(int i=0;i<N;i++) v[i]+=s;
+  return *this;
+}
+
+template<int N,typename T>
+Vec<N,T> operator-(const Vec<N,T>& u)
+{
+  Vec<N,T> r;
+  for(int i=0;i<N;i++) r(i)=-u(i);
+  return r;
+}
+
+template<int N,typename T>
+Vec<N,T> operator+(const Vec<N,T>& u,const Vec<N,T>& v)
+{
+  Vec<N,T> r;
+  for(int i=0;i<N;i++) r(i)=u(i)+v(i);
+  return r;
+}
+
+template<int N,typename T>
+Vec<N,T> operator-(const Vec<N,T>& u,const Vec<N,T>& v)
+{
+  Vec<N,T> r;
+  for(int i=0;i<N;i++) r(i)=u(i)-v(i);
+  return r;
+}
+
+template<int N,typename T>
+Vec<N,T> operator-(const Vec<N,T>& u,const T v)
+{
+  Vec<N,T> r;
+  for(int i=0;i<N;i++) r(i)=u(i)-v;
+  return r;
+}
+
+template<int N,typename T>
+Vec<N,T> operator*(const Vec<N,T>& u,const Vec<N,T>& v)
+{
+  Vec<N,T> r;
+  for(int i=0;i<N;i++) r(i)=u(i)*v(i);
+  return r;
+}
+
+template<int N,typename T>
+Vec<N,T> operator/(const Vec<N,T>& u,const Vec<N,T>& v)
+{
+  Vec<N,T> r;
+  for(int i=0;i<N;i++) r(i)=u(i)/v(i);
+  return r;
+}
+
+template<int N,typename T>
+Vec<N,T> operator*(const T s,const Vec<N,T>& u)
+{
+  Vec<N,T> r;
+  for(int i=0;i<N;i++) r(i)=s*u(i);
+  return r;
+}
+
+template<int N,typename T>
+Vec<N,T> operator*(const Vec<N,T>& u,const T s)
+{
+  Vec<N,T> r;
+  for(int i=0;i<N;i++) r(i)=u(i)*s;
+  return r;
+}
+
+template<int N,typename T>
+Vec<N,T> operator/(const Vec<N,T>& u,const T s)
+{
+  Vec<N,T> r;
+  for(int i=0;i<N;i++) r(i)=u(i)/s;
+  return r;
+}
+
+template<int N,typename T>
+Vec<N,bool> operator<(const Vec<N,T>& u,const Vec<N,T>& v)
+{
+  Vec<N,bool> r;
+  for(int i=0;i<N;i++) r(i)=u(i)<v(i);
+  return r;
+}
+
+template<int N,typename T>
+Vec<N,bool> operator>(const Vec<N,T>& u,const Vec<N,T>& v)
+{
+  Vec<N,bool> r;
+  for(int i=0;i<N;i++) r(i)=u(i)>v(i);
+  return r;
+}
+
+template<int N,typename T>
+Vec<N,bool> operator<=(const Vec<N,T>& u,const Vec<N,T>& v)
+{
+  Vec<N,bool> r;
+  for(int i=0;i<N;i++) r(i)=u(i)<=v(i);
+  return r;
+}
+
+template<int N,typename T>
+Vec<N,bool> operator>=(const Vec<N,T>& u,const Vec<N,T>& v)
+{
+  Vec<N,bool> r;
+  for(int i=0;i<N;i++) r(i)=u(i)>=v(i);
+  return r;
+}
+
+template<int N,typename T>
+Vec<N,bool> operator==(const Vec<N,T>& u,const Vec<N,T>& v)
+{
+  Vec<N,bool> r;
+  for(int i=0;i<N;i++) r(i) = (u(i)==v(i));
+  return r;
+}
+
+template<int N,typename T>
+Vec<N,bool> operator!=(const Vec<N,T>& u,const Vec<N,T>& v)
+{
+  Vec<N,bool> r;
+  for(int i=0;i<N;i++) r(i) = (u(i)!=v(i));
+  return r;
+}
+
+template<int N,typename T>
+inline Vec<N,T> lerp(const Vec<N,T>& a,const Vec<N,T>& b,const T& t)
+{
+  return (T(1)-t)*a+t*b;
+}
+
+template<int N,typename T>
+inline T dot(const Vec<N,T>& u,const Vec<N,T>& v)
+{
+  assert(N>0);
+  T sumprod = u(0)*v(0);
+  for(int i=1;i<N;i++) sumprod += u(i)*v(i);
+  return sumprod;
+}
+
+template<typename T>
+inline T cross(const Vec<2,T> &a,const Vec<2,T> &b)
+{
+  return a[0]*b[1]-a[1]*b[0];
+}
+
+template<typename T>
+inline Vec<3,T> cross(const Vec<3,T> &a,const Vec<3,T> &b)
+{
+  return Vec<3,T>(a[1]*b[2]-a[2]*b[1],
+                  a[2]*b[0]-a[0]*b[2],
+                  a[0]*b[1]-a[1]*b[0]);
+}
+
+template<int N,typename T>
+inline T norm(const Vec<N,T>& u)
+{
+  return std::sqrt(dot(u,u));
+}
+
+template<int N,typename T>
+inline Vec<N,T> normalize(const Vec<N,T>& u)
+{
+  return u/norm(u);
+}
+
+template<int N>
+inline bool any(const Vec<N,bool>& u)
+{
+  for(int i=0;i<N;i++)
+  {
+    if (u(i)==true) return true;
+  }
+  return false;
+}
+
+template<int N>
+inline bool all(const Vec<N,bool>& u)
+{
+  for(int i=0;i<N;i++)
+  {
+    if (u(i)==false) return false;
+  }
+  return true;
+}
+
+template<int N,typename T>
+inline T min(const Vec<N,T>& u)
+{
+  assert(N>0);
+
+  T minval = u(0);
+
+  for(int i=1;i<N;i++)
+  {
+   if (u(i) < minval)
+   {
+      minval = u(i);
+   }
+  }
+
+  return minval;
+}
+
+template<int N,typename T>
+inline T max(const Vec<N,T>& u)
+{
+  assert(N>0);
+
+  T maxval = u(0);
+
+  for(int i=1;i<N;i++)
+  {
+   if (u(i) > maxval)
+   {
+      maxval = u(i);
+   }
+  }
+
+  return maxval;
+}
+
+template<int N,typename T>
+inline T sum(const Vec<N,T>& u)
+{
+  assert(N>0);
+
+  T sumval = u(0);
+
+  for(int i=1;i<N;i++)
+  {
+    sumval += u(i);
+  }
+
+  return sumval;
+}
+
+namespace std
+{
+template<int N,typename T> Vec<N,T>
+inline min(const Vec<N,T>& u,const Vec<N,T>& v)
+{
+  assert(N>0);
+
+  Vec<N,T> w;
+
+  for(int i=0;i<N;i++)
+  {
+    w(i) = std::min(u(i),v(i));
+  }
+
+  return w;
+}
+
+template<int N,typename T> Vec<N,T>
+inline max(const Vec<N,T>& u,const Vec<N,T>& v)
+{
+  assert(N>0);
+
+  Vec<N,T> w;
+
+  for(int i=0;i<N;i++)
+  {
+    w(i) = std::max(u(i),v(i));
+  }
+
+  return w;
+}
+
+template<int N,typename T> Vec<N,T>
+inline abs(const Vec<N,T>& x)
+{
+  Vec<N,T> out;
+  for(int i=0;i<N;i++) out(i) = abs(x(i));
+  return out;
+}
+}
+
+#define fori(I) for (int i=0;i<(I);i++)
+#define forj(J) for (int j=0;j<(J);j++)
+#define fork(K) for (int k=0;k<(K);k++)
+#define forij(I,J) for (int i=0;i<(I);i++) for (int j=0;j<(J);j++)
+
+template<int M,int N,typename T>
+Mat<M,N,T>::Mat() {}
+
+template<int M,int N,typename T>
+Mat<M,N,T>::Mat(T a00,T a01,
+                T a10,T a11)
+{
+  assert(M==2 && N==2);
+
+  m[0][0] = a00; m[0][1] = a01;
+  m[1][0] = a10; m[1][1] = a11;
+}
+
+template<int M,int N,typename T>
+Mat<M,N,T>::Mat(T a00,T a01,T a02,
+                T a10,T a11,T a12,
+                T a20,T a21,T a22)
+{
+  assert(M==3 && N==3);
+
+  m[0][0] = a00; m[0][1] = a01; m[0][2] = a02;
+  m[1][0] = a10; m[1][1] = a11; m[1][2] = a12;
+  m[2][0] = a20; m[2][1] = a21; m[2][2] = a22;
+}
+
+template<int M,int N,typename T>
+Mat<M,N,T>::Mat(T a00,T a01,T a02,T a03,
+                T a10,T a11,T a12,T a13,
+                T a20,T a21,T a22,T a23,
+                T a30,T a31,T a32,T a33)
+{
+  assert(M==4 && N==4);
+
+  m[0][0] = a00; m[0][1] = a01; m[0][2] = a02; m[0][3] = a03;
+  m[1][0] = a10; m[1][1] = a11; m[1][2] = a12; m[1][3] = a13;
+  m[2][0] = a20; m[2][1] = a21; m[2][2] = a22; m[2][3] = a23;
+  m[3][0] = a30; m[3][1] = a31; m[3][2] = a32; m[3][3] = a33;
+}
+
+template<int M,int N,typename T>
+T& Mat<M,N,T>::operator()(int i,int j)
+{
+  assert(0<=i && i<M);
+  assert(0<=j && j<N);
+  return m[i][j];
+}
+
+template<int M,int N,typename T>
+const T& Mat<M,N,T>::operator()(int i,int j) const
+{
+  assert(0<=i && i<M);
+  assert(0<=j && j<N);
+  return m[i][j];
+}
+
+template<int M,int N,typename T>
+T* Mat<M,N,T>::data()
+{
+  return (T*)(&m[0][0]);
+}
+
+template<int M,int N,typename T>
+const T* Mat<M,N,T>::data() const
+{
+  return (T*)(&m[0][0]);
+}
+
+template<int M1,int N1,int M2,int N2,typename T>
+Mat<M1,N2,T> operator*(const Mat<M1,N1,T>& A,const Mat<M2,N2,T>& B)
+{
+  assert(N1==M2);
+  Mat<M1,N2,T> C;
+
+  fori(M1)
+  forj(N2)
+  {
+    T dot = 0;
+    fork(N1) dot += A(i,k) * B(k,j);
+    C(i,j) = dot;
+  }
+
+  return C;
+}
+
+template<int M,int N,typename T>
+Vec<M,T> operator*(const Mat<M,N,T>& A,const Vec<N,T>& u)
+{
+  Vec<M,T> v;
+
+  fori(M)
+  {
+    T dot = 0;
+    forj(N) dot += A(i,j) * u(j);
+    v(i) = dot;
+  }
+
+  return v;
+}
+
+template<int M,int N,typename T>
+Vec<N,T> operator*(const Vec<M,T>& u,const Mat<M,N,T>& A)
+{
+  Vec<N,T> v;
+
+  forj(N)
+  {
+    T dot = 0;
+    fori(M) dot += A(i,j) * u(i);
+    v(j) = dot;
+  }
+
+  return v;
+}
+
+template<int M,int N,typename T>
+Mat<N,M,T> transpose(const Mat<M,N,T>& A)
+{
+  Mat<N,M,T> At;
+
+  forij(N,M) At(i,j) = A(j,i);
+
+  return At;
+}
+
+#undef fori
+#undef forj
+#undef fork
+
+template<int D,typename T>
+ArrayN<D,T>::ArrayN() : d(0)
+{
+  for(int k=0;k<D;k++) { s[k] = 0; }
+}
+
+template<int D,typename T>
+void ArrayN<D,T>::allocate(const Vec<D,int>& size)
+{
+  size_t n = 1;
+  for(int k=0;k<D;k++) { assert(size[k]>0); n *= size_t(size[k]); }
+  assert(n<=size_t(std::numeric_limits<int>::max()));
+  s = size;
+  d = jzq_detail::arrayAlloc<T>(n);
+}
+
+template<int D,typename T>
+ArrayN<D,T>::ArrayN(int width)
+{
+  static_assert(D==1,"ArrayN(width) needs D==1");
+  Vec<D,int> size;
+  size[0] = width;
+  allocate(size);
+}
+
+template<int D,typename T>
+ArrayN<D,T>::ArrayN(int width,int height)
+{
+  static_assert(D==2,"ArrayN(width,height) needs D==2");
+  allocate(Vec<D,int>(width,height));
+}
+
+template<int D,typename T>
+ArrayN<D,T>::ArrayN(int width,int height,int depth)
+{
+  static_assert(D==3,"ArrayN(width,height,depth) needs D==3");
+  allocate(Vec<D,int>(width,height,depth));
+}
+
+template<int D,typename T>
+ArrayN<D,T>::ArrayN(int width,int height,int depth,int count)
+{
+  static_assert(D==4,"ArrayN(width,height,depth,count) needs D==4");
+  allocate(Vec<D,int>(width,height,depth,count));
+}
+
+template<int D,typename T>
+ArrayN<D,T>::ArrayN(const Vec<D,int>& size)
+{
+  allocate(size);
+}
+
+template<int D,typename T>
+ArrayN<D,T>::ArrayN(const ArrayN<D,T>& a)
+{
+  JZQ_PROFILE_SCOPE(jzq_detail::arrayCopyName(D));
+  s = a.s;
+
+  if (a.d!=0)
+  {
+    const int n = numel();
+    d = jzq_detail::arrayAlloc<T>(size_t(n));
+
+    for(int i=0;i<n;i++) d[i] = a.d[i];
+    jzq_detail::countCopy<T>(size_t(n));
+  }
+  else
+  {
+    d = 0;
+  }
+}
+
+template<int D,typename T>
+ArrayN<D,T>::ArrayN(ArrayN<D,T>&& a) noexcept : s(a.s),d(a.d)
+{
+  for(int k=0;k<D;k++) { a.s[k] = 0; }
+  a.d = 0;
+}
+
+template<int D,typename T>
+ArrayN<D,T>& ArrayN<D,T>::operator=(ArrayN<D,T>&& a) noexcept
+{
+  if (this!=&a)
+  {
+    jzq_detail::arrayFree(d,size_t(numel()));
+    s = a.s;
+    d = a.d;
+    for(int k=0;k<D;k++) { a.s[k] = 0; }
+    a.d = 0;
+  }
+
+  return *this;
+}
+
+template<int D,typename T>
+ArrayN<D,T>& ArrayN<D,T>::operator=(const ArrayN<D,T>& a)
+{
+  JZQ_PROFILE_SCOPE(jzq_detail::arrayCopyName(D));
+  if (this!=&a)
+  {
+    if (all(s==a.s))
+    {
+      const int n = numel();
+      for(int i=0;i<n;i++) d[i] = a.d[i];
+      jzq_detail::countCopy<T>(size_t(n));
+    }
+    else
+    {
+      jzq_detail::arrayFree(d,size_t(numel()));
+      s = a.s;
+
+      if (a.d!=0)
+      {
+        const int n = numel();
+        d = jzq_detail::arrayAlloc<T>(size_t(n));
+        for(int i=0;i<n;i++) d[i] = a.d[i];
+        jzq_detail::countCopy<T>(size_t(n));
+      }
+      else
+      {
+        d = 0;
+      }
+    }
+  }
+
+  return *this;
+}
+
+template<int D,typename T>
+ArrayN<D,T>::~ArrayN()
+{
+  jzq_detail::arrayFree(d,size_t(numel()));
+}
+
+template<int D,typename T>
+inline T& ArrayN<D,T>::operator[](int i)
+{
+  assert(i>=0 && i<numel());
+
+  return d[i];
+}
+
+template<int D,typename T>
+inline const T& ArrayN<D,T>::operator[](int i) const
+{
+  assert(i>=0 && i<numel());
+
+  return d[i];
+}
+
+template<int D,typename T> template<typename... I>
+inline T& ArrayN<D,T>::operator()(int i,I... rest)
+{
+  static_assert(sizeof...(I)+1==D,"ArrayN<D,T> takes D indices");
+  assert(d!=0);
+  assert(jzq_detail::arrayInside(&s[0],i,rest...));
+
+  return d[jzq_detail::arrayOffset(&s[0],i,rest...)];
+}
+
+template<int D,typename T> template<typename... I>
+inline const T& ArrayN<D,T>::operator()(int i,I... rest) const
+{
+  static_assert(sizeof...(I)+1==D,"ArrayN<D,T> takes D indices");
+  assert(d!=0);
+  assert(jzq_detail::arrayInside(&s[0],i,rest...));
+
+  return d[jzq_detail::arrayOffset(&s[0],i,rest...)];
+}
+
+template<int D,typename T>
+inline T& ArrayN<D,T>::operator()(const Vec<D,int>& idx)
+{
+  assert(d!=0);
+
+  int offset = 0;
+  for(int k=D-1;k>=0;k--)
+  {
+    assert(idx[k]>=0 && idx[k]<s[k]);
+    offset = offset*s[k]+idx[k];
+  }
+
+  return d[offset];
+}
+
+template<int D,typename T>
+inline const T& ArrayN<D,T>::operator()(const Vec<D,int>& idx) const
+{
+  assert(d!=0);
+
+  int offset = 0;
+  for(int k=D-1;k>=0;k--)
+  {
+    assert(idx[k]>=0 && idx[k]<s[k]);
+    offset = offset*s[k]+idx[k];
+  }
+
+  return d[offset];
+}
+
+template<int D,typename T>
+Vec<D,int> ArrayN<D,T>::size() const
+{
+  return s;
+}
+
+template<int D,typename T>
+int ArrayN<D,T>::size(int dim) const
+{
+  assert(dim>=0 && dim<D);
+  return s[dim];
+}
+
+template<int D,typename T>
+int ArrayN<D,T>::width() const
+{
+  return s[0];
+}
+
+template<int D,typename T>
+int ArrayN<D,T>::height() const
+{
+  static_assert(D>=2,"height() needs D>=2");
+  return s[1];
+}
+
+template<int D,typename T>
+int ArrayN<D,T>::depth() const
+{
+  static_assert(D>=3,"depth() needs D>=3");
+  return s[2];
+}
+
+template<int D,typename T>
+int ArrayN<D,T>::numel() const
+{
+  int n = s[0];
+  for(int k=1;k<D;k++) { n *= s[k]; }
+  return n;
+}
+
+template<int D,typename T>
+bool ArrayN<D,T>::empty() const
+{
+  return (numel()==0);
+}
+
+template<int D,typename T>
+T* ArrayN<D,T>::data()
+{
+  return d;
+}
+
+template<int D,typename T>
+const T* ArrayN<D,T>::data() const
+{
+  return d;
+}
+
+template<int D,typename T>
+T* ArrayN<D,T>::begin()
+{
+  return d;
+}
+
+template<int D,typename T>
+const T* ArrayN<D,T>::begin() const
+{
+  return d;
+}
+
+template<int D,typename T>
+T* ArrayN<D,T>::end()
+{
+  return d+numel();
+}
+
+template<int D,typename T>
+const T* ArrayN<D,T>::end() const
+{
+  return d+numel();
+}
+
+template<int D,typename T> template<typename... I>
+ArraySpan<T> ArrayN<D,T>::row(I... rest)
+{
+  static_assert(sizeof...(I)+1==D,"row() takes D-1 indices");
+  // s.v+1 rather than &s[1]: for D==1 there are no indices and the row is
+  // the whole array
+  assert(jzq_detail::arrayInside(s.v+1,rest...));
+
+  T* p = d+ptrdiff_t(jzq_detail::arrayOffset(s.v+1,rest...))*s[0];
+  return ArraySpan<T>(p,p+s[0]);
+}
+
+template<int D,typename T> template<typename... I>
+ArraySpan<const T> ArrayN<D,T>::row(I... rest) const
+{
+  static_assert(sizeof...(I)+1==D,"row() takes D-1 indices");
+  // s.v+1 rather than &s[1]: for D==1 there are no indices and the row is
+  // the whole array
+  assert(jzq_detail::arrayInside(s.v+1,rest...));
+
+  const T* p = d+ptrdiff_t(jzq_detail::arrayOffset(s.v+1,rest...))*s[0];
+  return ArraySpan<const T>(p,p+s[0]);
+}
+
+template<int D,typename T>
+ArraySpans<T> ArrayN<D,T>::rows()
+{
+  return ArraySpans<T>(d,s[0],s[0]>0 ? numel()/s[0] : 0);
+}
+
+template<int D,typename T>
+ArraySpans<const T> ArrayN<D,T>::rows() const
+{
+  return ArraySpans<const T>(d,s[0],s[0]>0 ? numel()/s[0] : 0);
+}
+
+template<int D,typename T>
+ArraySpan<T> ArrayN<D,T>::slice(int k)
+{
+  assert(k>=0 && k<s[D-1]);
+
+  const ptrdiff_t n = numel()/s[D-1];
+  return ArraySpan<T>(d+k*n,d+(k+1)*n);
+}
+
+template<int D,typename T>
+ArraySpan<const T> ArrayN<D,T>::slice(int k) const
+{
+  assert(k>=0 && k<s[D-1]);
+
+  const ptrdiff_t n = numel()/s[D-1];
+  return ArraySpan<const T>(d+k*n,d+(k+1)*n);
+}
+
+template<int D,typename T>
+ArraySpans<T> ArrayN<D,T>::slices()
+{
+  return ArraySpans<T>(d,s[D-1]>0 ? numel()/s[D-1] : 0,s[D-1]);
+}
+
+template<int D,typename T>
+ArraySpans<const T> ArrayN<D,T>::slices() const
+{
+  return ArraySpans<const T>(d,s[D-1]>0 ? numel()/s[D-1] : 0,s[D-1]);
+}
+
+template<int D,typename T>
+void ArrayN<D,T>::clear()
+{
+  jzq_detail::arrayFree(d,size_t(numel()));
+  for(int k=0;k<D;k++) { s[k] = 0; }
+  d = 0;
+}
+
+template<int D,typename T>
+void ArrayN<D,T>::swap(ArrayN<D,T>& b) noexcept
+{
+  Vec<D,int> tmp_s = s;
+  s = b.s;
+  b.s = tmp_s;
+
+  T* tmp_d = d;
+  d = b.d;
+  b.d = tmp_d;
+}
+
+template<int D,typename T>
+Vec<D,int> size(const ArrayN<D,T>& a)
+{
+  return a.size();
+}
+
+template<int D,typename T>
+int size(const ArrayN<D,T>& a,int dim)
+{
+  return a.size(dim);
+}
+
+template<int D,typename T>
+int numel(const ArrayN<D,T>& a)
+{
+  return a.numel();
+}
+
+template<int D,typename T>
+bool empty(const ArrayN<D,T>& a)
+{
+  return a.empty();
+}
+
+template<int D,typename T>
+void clear(ArrayN<D,T>* a)
+{
+  a->clear();
+}
+
+template<int D,typename T>
+void swap(ArrayN<D,T>& a,ArrayN<D,T>& b)
+{
+  a.swap(b);
+}
+
+template<int D,typename T>
+T min(const ArrayN<D,T>& a)
+{
+  JZQ_PROFILE_SCOPE("min");
+  assert(numel(a)>0);
+
+  const int n = numel(a);
+
+  const T* d = a.data();
+
+  T minval = d[0];
+
+  for(int i=1;i<n;i++) minval = (d[i]<minval) ? d[i] : minval;
+
+  return minval;
+}
+
+template<int D,typename T>
+T max(const ArrayN<D,T>& a)
+{
+  JZQ_PROFILE_SCOPE("max");
+  assert(numel(a)>0);
+
+  const int n = numel(a);
+
+  const T* d = a.data();
+
+  T maxval = d[0];
+
+  for(int i=1;i<n;i++) maxval = (maxval<d[i]) ? d[i] : maxval;
+
+  return maxval;
+}
+
+template<int D,typename T>
+Vec<2,T> minmax(const ArrayN<D,T>& a)
+{
+  JZQ_PROFILE_SCOPE("minmax");
+  assert(numel(a)>0);
+
+  const int n = numel(a);
+
+  const T* d = a.data();
+
+  T minval = d[0];
+  T maxval = d[0];
+
+  for(int i=1;i<n;i++)
+  {
+    minval = (d[i]<minval) ? d[i] : minval;
+    maxval = (maxval<d[i]) ? d[i] : maxval;
+  }
+
+  return Vec<2,T>(minval,maxval);
+}
+
+namespace jzq_detail
+{
+  // Inverse of the element offset: the index of the i-th element in memory.
+  template<int D>
+  Vec<D,int> arrayIndex(const Vec<D,int>& size,int i)
+  {
+    Vec<D,int> idx;
+    for(int k=0;k<D;k++)
+    {
+      idx[k] = i%size[k];
+      i /= size[k];
+    }
+    return idx;
+  }
+}
+
+template<int D,typename T>
+Vec<D,int> argmin(const ArrayN<D,T>& a)
+{
+  JZQ_PROFILE_SCOPE("argmin");
+  assert(numel(a)>0);
+
+  const int n = numel(a);
+  const T* d = a.data();
+
+  T minValue = d[0];
+  int minIndex = 0;
+
+  for(int i=1;i<n;i++)
+  {
+    if (d[i]<minValue)
+    {
+      minValue = d[i];
+      minIndex = i;
+    }
+  }
+
+  return jzq_detail::arrayIndex(a.size(),minIndex);
+}
+
+template<int D,typename T>
+Vec<D,int> argmax(const ArrayN<D,T>& a)
+{
+  JZQ_PROFILE_SCOPE("argmax");
+  assert(numel(a)>0);
+
+  const int n = numel(a);
+  const T* d = a.data();
+
+  T maxValue = d[0];
+  int maxIndex = 0;
+
+  for(int i=1;i<n;i++)
+  {
+    if (maxValue<d[i])
+    {
+      maxValue = d[i];
+      maxIndex = i;
+    }
+  }
+
+  return jzq_detail::arrayIndex(a.size(),maxIndex);
+}
+
+template<int D,typename T>
+T sum(const ArrayN<D,T>& a)
+{
+  JZQ_PROFILE_SCOPE("sum");
+  assert(numel(a)>0);
+
+  const int n = numel(a);
+
+  const T* d = a.data();
+
+  T sumval = d[0];
+
+  for(int i=1;i<n;i++) sumval += d[i];
+
+  return sumval;
+}
+
+template<int D,typename T>
+void fill(ArrayN<D,T>* a,const T& value)
+{
+  JZQ_PROFILE_SCOPE("fill");
+  assert(a!=0);
+  assert(a->numel()>0);
+
+  const int n = a->numel();
+  T* d = a->data();
+
+  for(int i=0;i<n;i++) d[i] = value;
+}
+
+template<int D,typename T,typename F>
+ArrayN<D,T> apply(const ArrayN<D,T>& a,F fun)
+{
+  JZQ_PROFILE_SCOPE("apply");
+  assert(numel(a) > 0);
+
+  ArrayN<D,T> fun_a(size(a));
+
+  const int n = numel(a);
+
+  for(int i=0;i<n;i++) fun_a.data()[i] = fun(a.data()[i]);
+
+  return fun_a;
+}
+
+namespace jzq_detail
+{
+  // Column strip width for the vertical passes of the summed-area tables;
+  // each thread walks down its strip adding the previous row, which keeps
+  // the inner loop contiguous and vectorizable.
+  const int integralStripWidth = 512;
+
+  template<typename S>
+  void integralAccumulateRows(S* data,int rowLength,int numRows,int numPlanes,size_t planeStride)
+  {
+    const int numStrips = (rowLength+integralStripWidth-1)/integralStripWidth;
+
+    parallelFor(numStrips*numPlanes,[=](int job)
+    {
+      const int x0 = (job%numStrips)*integralStripWidth;
+      const int x1 = std::min(x0+integralStripWidth,rowLength);
+      S* plane = data+size_t(job/numStrips)*planeStride;
+
+      for(int y=1;y<numRows;y++)
+      {
+        const S* prev = plane+size_t(y-1)*rowLength;
+        S* row = plane+size_t(y)*rowLength;
+        for(int x=x0;x<x1;x++) { row[x] += prev[x]; }
+      }
+    });
+  }
+}
+
+// The summed-area table has one extra leading row and column of zeros, so
+// I(x,y) holds the sum of a over [0,x)x[0,y) and box sums need no branches.
+template<typename S,typename T>
+Array2<S> integral(const Array2<T>& a)
+{
+  JZQ_PROFILE_SCOPE("integral");
+  assert(numel(a)>0);
+
+  const int w = a.width();
+  const int h = a.height();
+
+  Array2<S> I(w+1,h+1);
+  S* d = I.data();
+
+  for(int x=0;x<=w;x++) { d[x] = zero<S>::value(); }
+
+  parallelFor(h,[&](int y)
+  {
+    const T* src = a.data()+size_t(y)*w;
+    S* row = d+size_t(y+1)*(w+1);
+
+    S acc = zero<S>::value();
+    row[0] = acc;
+    for(int x=0;x<w;x++) { acc += S(src[x]); row[x+1] = acc; }
+  });
+
+  jzq_detail::integralAccumulateRows(d,w+1,h+1,1,0);
+
+  return I;
+}
+
+template<typename T>
+Array2<typename jzq_detail::Accum<T>::type> integral(const Array2<T>& a)
+{
+  return integral<typename jzq_detail::Accum<T>::type>(a);
+}
+
+template<typename S>
+S boxSum(const Array2<S>& I,const Vec2i& p0,const Vec2i& p1)
+{
+  assert(p0(0)<=p1(0) && p0(1)<=p1(1));
+
+  return (I(p1(0),p1(1))-I(p0(0),p1(1)))-(I(p1(0),p0(1))-I(p0(0),p0(1)));
+}
+
+template<typename S>
+S boxMean(const Array2<S>& I,const Vec2i& p0,const Vec2i& p1)
+{
+  typedef typename jzq_detail::Scalar<S>::type Scalar;
+
+  const Vec2i extent = p1-p0;
+  assert(extent(0)>0 && extent(1)>0);
+
+  return boxSum(I,p0,p1)/Scalar(extent(0)*extent(1));
+}
+
+template<int D,typename T>
+ArrayN<D,T> anread(const std::string& fileName)
+{
+  ArrayN<D,T> A;
+  if(!anread(&A,fileName)) { return ArrayN<D,T>(); }
+  return A;
+}
+
+template<int D,typename T>
+bool anread(ArrayN<D,T>* out_A,const std::string& fileName,int flags)
+{
+  JZQ_PROFILE_SCOPE("anread");
+  return jzq_detail::arrayReadInto(out_A,fileName,flags);
+}
+
+template<int D,typename T>
+bool anwrite(const ArrayN<D,T>& A,const std::string& fileName,int flags)
+{
+  JZQ_PROFILE_SCOPE("anwrite");
+  return jzq_detail::arrayWriteFrom(A,fileName,flags);
+}
+
+template<typename T>
+Array2<T> a2read(const std::string& fileName)
+{
+  Array2<T> A;
+  if(!a2read(&A,fileName)) { return Array2<T>(); }
+  return A;
+}
+
+template<typename T>
+bool a2read(Array2<T>* out_A,const std::string& fileName,int flags)
+{
+  JZQ_PROFILE_SCOPE("a2read");
+  return jzq_detail::arrayReadInto(out_A,fileName,flags);
+}
+
+template<typename T>
+bool a2read(T* out_data,const Vec2i& size,const std::string& fileName,int flags)
+{
+  JZQ_PROFILE_SCOPE("a2read");
+  assert(out_data!=0);
+
+  return jzq_detail::arrayRead<2,T>(fileName,flags,[&](const Vec2i& fileSize) -> T*
+  {
+    return all(fileSize==size) ? out_data : 0;
+  });
+}
+
+template<typename T>
+bool a2write(const Array2<T>& A,const std::string& fileName,int flags)
+{
+  JZQ_PROFILE_SCOPE("a2write");
+  return jzq_detail::arrayWriteFrom(A,fileName,flags);
+}
+
+inline A2Info a2info(const std::string& fileName)
+{
+  A2Info info;
+  a2info(&info,fileName);
+  return info;
+}
+
+inline bool a2info(A2Info* out_info,const std::string& fileName)
+{
+  A2Info info;
+  info.fileName = fileName;
+  info.size = Vec2i(0,0);
+  info.elemSize = 0;
+  info.valid = false;
+
+  FILE* f = jzq_fopen(fileName.c_str(),"rb");
+
+  if(f)
+  {
+    int header[3];
+
+    if(fread(header,sizeof(header),1,f)==1 &&
+       header[0]>0 && header[1]>0 && header[2]>0)
+    {
+      info.size = Vec2i(header[0],header[1]);
+      info.elemSize = header[2];
+      info.valid = true;
+    }
+
+    fclose(f);
+  }
+
+  if(out_info!=0) { *out_info = info; }
+
+  return info.valid;
+}
+
+inline std::vector<A2Info> a2info(const std::vector<std::string>& fileNames)
+{
+  std::vector<A2Info> infos(fileNames.size());
+
+  parallelFor(int(fileNames.size()),[&](int i)
+  {
+    a2info(&infos[i],fileNames[i]);
+  });
+
+  return infos;
+}
+
+inline std::vector<A2Info> a2scan(const std::string& dirName,const std::string& extension)
+{
+  const std::vector<std::string> names = jzq_listdir(dirName);
+
+  std::vector<std::string> fileNames;
+  for(int i=0;i<int(names.size());i++)
+  {
+    const std::string& name = names[i];
+    if (name.size()>=extension.size() &&
+        name.compare(name.size()-extension.size(),extension.size(),extension)==0)
+    {
+      fileNames.push_back(dirName+"/"+name);
+    }
+  }
+
+  return a2info(fileNames);
+}
+
+namespace jzq_detail
+{
+  // Pixel layouts understood by the Netpbm/PFM readers and writers:
+  // 'f' = PFM, 'p' = PPM, 'g' = PGM. Samples of 2 or 4 bytes may need
+  // byte swapping (PFM stores its endianness in the scale sign, 16-bit
+  // PGM/PPM are always big endian).
+  template<typename T> struct Netpbm { };
+
+  template<> struct Netpbm<float>          { static const char kind = 'f'; static const int channels = 1; typedef float          Sample; static const char* magic() { return "Pf"; } };
+  template<> struct Netpbm<Vec<3,float> >  { static const char kind = 'f'; static const int channels = 3; typedef float          Sample; static const char* magic() { return "PF"; } };
+  template<> struct Netpbm<unsigned char>  { static const char kind = 'g'; static const int channels = 1; typedef unsigned char  Sample; static const char* magic() { return "P5"; } };
+  template<> struct Netpbm<unsigned short> { static const char kind = 'g'; static const int channels = 1; typedef unsigned short Sample; static const char* magic() { return "P5"; } };
+  template<> struct Netpbm<Vec<3,unsigned char> >  { static const char kind = 'p'; static const int channels = 3; typedef unsigned char  Sample; static const char* magic() { return "P6"; } };
+  template<> struct Netpbm<Vec<3,unsigned short> > { static const char kind = 'p'; static const int channels = 3; typedef unsigned short Sample; static const char* magic() { return "P6"; } };
+
+  inline bool isLittleEndian()
+  {
+    const unsigned short one = 1;
+    return *((const unsigned char*)&one)==1;
+  }
+
+  inline void byteSwap(void* data,size_t count,int sampleSize)
+  {
+    unsigned char* p = (unsigned char*)data;
+
+    if (sampleSize==2)
+    {
+      for(size_t i=0;i<count;i++,p+=2) { std::swap(p[0],p[1]); }
+    }
+    else if (sampleSize==4)
+    {
+      for(size_t i=0;i<count;i++,p+=4) { std::swap(p[0],p[3]); std::swap(p[1],p[2]); }
+    }
+  }
+
+  // Reads the next whitespace separated header token, skipping '#' comments.
+  inline bool netpbmToken(FILE* f,std::string* out_token)
+  {
+    std::string token;
+    int c = fgetc(f);
+
+    while(c!=EOF)
+    {
+      if      (c=='#') { while(c!=EOF && c!='\n' && c!='\r') { c = fgetc(f); } }
+      else if (isspace(c)) { c = fgetc(f); }
+      else { break; }
+    }
+
+    while(c!=EOF && !isspace(c)) { token.push_back(char(c)); c = fgetc(f); }
+
+    // the single whitespace character terminating the token has been consumed,
+    // so after the last header field the stream points at the raster
+    *out_token = token;
+    return !token.empty();
+  }
+
+  // Parses a positive decimal header field no larger than maxValue.
+  inline bool netpbmInt(const std::string& token,long maxValue,int* out_value)
+  {
+    long value = 0;
+
+    for(size_t i=0;i<token.size();i++)
+    {
+      if (token[i]<'0' || token[i]>'9') { return false; }
+      value = value*10 + (token[i]-'0');
+      if (value>maxValue) { return false; }
+    }
+
+    if (token.empty() || value<1) { return false; }
+
+    *out_value = int(value);
+    return true;
+  }
+
+  template<typename T>
+  bool netpbmRead(Array2<T>* out_A,const std::string& fileName)
+  {
+    typedef typename Netpbm<T>::Sample Sample;
+
+    FILE* f = jzq_fopen(fileName.c_str(),"rb");
+
+    if (!f) { return false; }
+
+    std::string magic,width,height,last;
+
+    if (!netpbmToken(f,&magic) || magic!=Netpbm<T>::magic() ||
+        !netpbmToken(f,&width) || !netpbmToken(f,&height) ||
+        !netpbmToken(f,&last))
+    {
+      fclose(f);
+      return false;
+    }
+
+    int w = 0;
+    int h = 0;
+
+    if (!netpbmInt(width,std::numeric_limits<int>::max(),&w) ||
+        !netpbmInt(height,std::numeric_limits<int>::max()/w,&h))
+    {
+      fclose(f);
+      return false;
+    }
+
+    bool swapBytes = false;
+    bool flipRows = false;
+
+    if (Netpbm<T>::kind=='f')
+    {
+      // the scale's sign gives the byte order, so it must be a finite nonzero number
+      char* end = 0;
+      const double scale = strtod(last.c_str(),&end);
+      if (*end!=0 || !(scale!=0.0) || !std::isfinite(scale)) { fclose(f); return false; }
+      swapBytes = (scale<0.0)!=isLittleEndian();
+      flipRows = true;
+    }
+    else
+    {
+      int maxval = 0;
+      if (!netpbmInt(last,65535,&maxval) || (maxval<256)!=(sizeof(Sample)==1)) { fclose(f); return false; }
+      swapBytes = sizeof(Sample)>1 && isLittleEndian();
+    }
+
+    // a truncated file is rejected before anything is allocated or overwritten
+    const long long rasterBytes = (long long)sizeof(T)*w*h;
+    const long long headerBytes = (long long)ftell(f);
+    if (headerBytes<0 || fileBytes(f)-headerBytes<rasterBytes) { fclose(f); return false; }
+
+    // Same size: read in place. Otherwise read into a fresh array that
+    // replaces *out_A only on success, as a2read does.
+    Array2<T> fresh;
+    Array2<T>& A = (out_A!=0 && out_A->width()==w && out_A->height()==h) ? *out_A : fresh;
+
+    if (&A==&fresh) { Array2<T>(w,h).swap(fresh); }
+
+    // each row is read straight into its final place and fixed up while it is still in cache
+    for(int y=0;y<h;y++)
+    {
+      T* row = A.data()+size_t(flipRows ? h-1-y : y)*w;
+
+      if (fread(row,sizeof(T)*w,1,f)!=1) { fclose(f); return false; }
+
+      if (swapBytes) { byteSwap(row,size_t(w)*Netpbm<T>::channels,sizeof(Sample)); }
+    }
+
+    fclose(f);
+
+    if (out_A!=0 && &A==&fresh) { fresh.swap(*out_A); }
+
+    return true;
+  }
+
+  template<typename T>
+  bool netpbmWrite(const Array2<T>& A,const std::string& fileName)
+  {
+    typedef typename Netpbm<T>::Sample Sample;
+
+    if (A.numel()==0) { return false; }
+
+    FILE* f = jzq_fopen(fileName.c_str(),"wb");
+
+    if (!f) { return false; }
+
+    const int w = A.width();
+    const int h = A.height();
+
+    bool swapBytes = false;
+    bool flipRows = false;
+
+    if (Netpbm<T>::kind=='f')
+    {
+      // PFM is written in native byte order, which the sign of the scale records
+      fprintf(f,"%s\n%d %d\n%s\n",Netpbm<T>::magic(),w,h,isLittleEndian() ? "-1.0" : "1.0");
+      flipRows = true;
+    }
+    else
+    {
+      fprintf(f,"%s\n%d %d\n%d\n",Netpbm<T>::magic(),w,h,sizeof(Sample)==1 ? 255 : 65535);
+      swapBytes = sizeof(Sample)>1 && isLittleEndian();
+    }
+
+    std::vector<T> swapped(swapBytes ? w : 0);
+
+    for(int y=0;y<h;y++)
+    {
+      const T* row = A.data()+size_t(flipRows ? h-1-y : y)*w;
+
+      if (swapBytes)
+      {
+        std::copy(row,row+w,swapped.begin());
+        byteSwap(&swapped[0],size_t(w)*Netpbm<T>::channels,sizeof(Sample));
+        row = &swapped[0];
+      }
+
+      if (fwrite(row,sizeof(T)*w,1,f)!=1) { fclose(f); return false; }
+    }
+
+    return fclose(f)==0;
+  }
+}
+
+template<typename T>
+Array2<T> pfmread(const std::string& fileName)
+{
+  Array2<T> A;
+  if(!pfmread(&A,fileName)) { return Array2<T>(); }
+  return A;
+}
+
+template<typename T>
+bool pfmread(Array2<T>* out_A,const std::string& fileName)
+{
+  JZQ_PROFILE_SCOPE("pfmread");
+  static_assert(jzq_detail::Netpbm<T>::kind=='f',"pfmread supports Array2<float> and Array2<Vec3f>");
+  return jzq_detail::netpbmRead(out_A,fileName);
+}
+
+template<typename T>
+bool pfmwrite(const Array2<T>& A,const std::string& fileName)
+{
+  JZQ_PROFILE_SCOPE("pfmwrite");
+  static_assert(jzq_detail::Netpbm<T>::kind=='f',"pfmwrite supports Array2<float> and Array2<Vec3f>");
+  return jzq_detail::netpbmWrite(A,fileName);
+}
+
+template<typename T>
+Array2<T> ppmread(const std::string& fileName)
+{
+  Array2<T> A;
+  if(!ppmread(&A,fileName)) { return Array2<T>(); }
+  return A;
+}
+
+template<typename T>
+bool ppmread(Array2<T>* out_A,const std::string& fileName)
+{
+  JZQ_PROFILE_SCOPE("ppmread");
+  static_assert(jzq_detail::Netpbm<T>::kind=='p',"ppmread supports Array2<Vec3uc> and Array2<Vec3us>");
+  return jzq_detail::netpbmRead(out_A,fileName);
+}
+
+template<typename T>
+bool ppmwrite(const Array2<T>& A,const std::string& fileName)
+{
+  JZQ_PROFILE_SCOPE("ppmwrite");
+  static_assert(jzq_detail::Netpbm<T>::kind=='p',"ppmwrite supports Array2<Vec3uc> and Array2<Vec3us>");
+  return jzq_detail::netpbmWrite(A,fileName);
+}
+
+template<typename T>
+Array2<T> pgmread(const std::string& fileName)
+{
+  Array2<T> A;
+  if(!pgmread(&A,fileName)) { return Array2<T>(); }
+  return A;
+}
+
+template<typename T>
+bool pgmread(Array2<T>* out_A,const std::string& fileName)
+{
+  JZQ_PROFILE_SCOPE("pgmread");
+  static_assert(jzq_detail::Netpbm<T>::kind=='g',"pgmread supports Array2<unsigned char> and Array2<unsigned short>");
+  return jzq_detail::netpbmRead(out_A,fileName);
+}
+
+template<typename T>
+bool pgmwrite(const Array2<T>& A,const std::string& fileName)
+{
+  JZQ_PROFILE_SCOPE("pgmwrite");
+  static_assert(jzq_detail::Netpbm<T>::kind=='g',"pgmwrite supports Array2<unsigned char> and Array2<unsigned short>");
+  return jzq_detail::netpbmWrite(A,fileName);
+}
+
+template<typename S,typename T>
+Array3<S> integral(const Array3<T>& a)
+{
+  JZQ_PROFILE_SCOPE("integral");
+  assert(numel(a)>0);
+
+  const int w = a.width();
+  const int h = a.height();
+  const int d = a.depth();
+
+  const size_t sliceSize = size_t(w+1)*(h+1);
+
+  Array3<S> I(w+1,h+1,d+1);
+  S* data = I.data();
+
+  for(size_t i=0;i<sliceSize;i++) { data[i] = zero<S>::value(); }
+
+  parallelFor(h*d,[&](int yz)
+  {
+    const int y = yz%h;
+    const int z = yz/h;
+
+    const T* src = a.data()+(size_t(z)*h+y)*w;
+    S* slice = data+size_t(z+1)*sliceSize;
+    S* row = slice+size_t(y+1)*(w+1);
+
+    if (y==0) { for(int x=0;x<=w;x++) { slice[x] = zero<S>::value(); } }
+
+    S acc = zero<S>::value();
+    row[0] = acc;
+    for(int x=0;x<w;x++) { acc += S(src[x]); row[x+1] = acc; }
+  });
+
+  jzq_detail::integralAccumulateRows(data+sliceSize,w+1,h+1,d,sliceSize);
+  jzq_detail::integralAccumulateRows(data,int(sliceSize),d+1,1,0);
+
+  return I;
+}
+
+template<typename T>
+Array3<typename jzq_detail::Accum<T>::type> integral(const Array3<T>& a)
+{
+  return integral<typename jzq_detail::Accum<T>::type>(a);
+}
+
+template<typename S>
+S boxSum(const Array3<S>& I,const Vec3i& p0,const Vec3i& p1)
+{
+  assert(p0(0)<=p1(0) && p0(1)<=p1(1) && p0(2)<=p1(2));
+
+  const S far  = (I(p1(0),p1(1),p1(2))-I(p0(0),p1(1),p1(2)))-(I(p1(0),p0(1),p1(2))-I(p0(0),p0(1),p1(2)));
+  const S near = (I(p1(0),p1(1),p0(2))-I(p0(0),p1(1),p0(2)))-(I(p1(0),p0(1),p0(2))-I(p0(0),p0(1),p0(2)));
+
+  return far-near;
+}
+
+template<typename S>
+S boxMean(const Array3<S>& I,const Vec3i& p0,const Vec3i& p1)
+{
+  typedef typename jzq_detail::Scalar<S>::type Scalar;
+
+  const Vec3i extent = p1-p0;
+  assert(extent(0)>0 && extent(1)>0 && extent(2)>0);
+
+  return boxSum(I,p0,p1)/Scalar(extent(0)*extent(1)*extent(2));
+}
+
+template<typename T>
+Array3<T> a3read(const std::string& fileName)
+{
+  Array3<T> A;
+  if(!a3read(&A,fileName)) { return Array3<T>(); }
+  return A;
+}
+
+template<typename T>
+bool a3read(Array3<T>* out_A,const std::string& fileName,int flags)
+{
+  JZQ_PROFILE_SCOPE("a3read");
+  return jzq_detail::arrayReadInto(out_A,fileName,flags);
+}
+
+template<typename T>
+bool a3read(T* out_data,const Vec3i& size,const std::string& fileName,int flags)
+{
+  JZQ_PROFILE_SCOPE("a3read");
+  assert(out_data!=0);
+
+  return jzq_detail::arrayRead<3,T>(fileName,flags,[&](const Vec3i& fileSize) -> T*
+  {
+    return all(fileSize==size) ? out_data : 0;
+  });
+}
+
+template<typename T>
+bool a3write(const Array3<T>& A,const std::string& fileName,int flags)
+{
+  JZQ_PROFILE_SCOPE("a3write");
+  return jzq_detail::arrayWriteFrom(A,fileName,flags);
+}
+
+inline A3Info a3info(const std::string& fileName)
+{
+  A3Info info;
+  a3info(&info,fileName);
+  return info;
+}
+
+inline bool a3info(A3Info* out_info,const std::string& fileName)
+{
+  A3Info info;
+  info.fileName = fileName;
+  info.size = Vec3i(0,0,0);
+  info.elemSize = 0;
+  info.valid = false;
+
+  FILE* f = jzq_fopen(fileName.c_str(),"rb");
+
+  if(f)
+  {
+    int header[4];
+
+    if(fread(header,sizeof(header),1,f)==1 &&
+       header[0]>0 && header[1]>0 && header[2]>0 && header[3]>0)
+    {
+      info.size = Vec3i(header[0],header[1],header[2]);
+      info.elemSize = header[3];
+      info.valid = true;
+    }
+
+    fclose(f);
+  }
+
+  if(out_info!=0) { *out_info = info; }
+
+  return info.valid;
+}
+
+inline std::vector<A3Info> a3info(const std::vector<std::string>& fileNames)
+{
+  std::vector<A3Info> infos(fileNames.size());
+
+  parallelFor(int(fileNames.size()),[&](int i)
+  {
+    a3info(&infos[i],fileNames[i]);
+  });
+
+  return infos;
+}
+
+inline std::vector<A3Info> a3scan(const std::string& dirName,const std::string& extension)
+{
+  const std::vector<std::string> names = jzq_listdir(dirName);
+
+  std::vector<std::string> fileNames;
+  for(int i=0;i<int(names.size());i++)
+  {
+    const std::string& name = names[i];
+    if (name.size()>=extension.size() &&
+        name.compare(name.size()-extension.size(),extension.size(),extension)==0)
+    {
+      fileNames.push_back(dirName+"/"+name);
+    }
+  }
+
+  return a3info(fileNames);
+}
+
+template<typename T>
+struct ArrayWriter::ArrayJob<Array2<T>> : ArrayWriter::Job
+{
+  Array2<T> array;
+  bool run(int flags) { return a2write(array,fileName,flags); }
+};
+
+template<typename T>
+struct ArrayWriter::ArrayJob<Array3<T>> : ArrayWriter::Job
+{
+  Array3<T> array;
+  bool run(int flags) { return a3write(array,fileName,flags); }
+};
+
+inline ArrayWriter::ArrayWriter(int numThreads,size_t maxQueuedBytes,int flags)
+  : maxQueuedBytes(maxQueuedBytes),flags(flags),busy(0),stopping(false)
+{
+  counters.queueDepth = 0;
+  counters.queuedBytes = 0;
+  counters.filesWritten = 0;
+  counters.bytesWritten = 0;
+  counters.failures = 0;
+  counters.bytesPerSecond = 0.0;
+  start = std::chrono::steady_clock::now();
+
+  if (numThreads<1) { numThreads = std::max(int(std::thread::hardware_concurrency()),1); }
+
+  for(int i=0;i<numThreads;i++) { threads.push_back(std::thread([this]() { work(); })); }
+}
+
+inline ArrayWriter::~ArrayWriter()
+{
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    stopping = true;
+  }
+  queueChanged.notify_all();
+
+  for(int i=0;i<int(threads.size());i++) { threads[i].join(); }
+}
+
+template<typename T>
+void ArrayWriter::write(Array2<T>&& A,const std::string& fileName)
+{
+  ArrayJob<Array2<T>>* job = new ArrayJob<Array2<T>>();
+  job->fileName = fileName;
+  job->bytes = sizeof(T)*size_t(A.numel());
+  job->array = std::move(A);
+  push(job);
+}
+
+template<typename T>
+void ArrayWriter::write(Array3<T>&& A,const std::string& fileName)
+{
+  ArrayJob<Array3<T>>* job = new ArrayJob<Array3<T>>();
+  job->fileName = fileName;
+  job->bytes = sizeof(T)*size_t(A.numel());
+  job->array = std::move(A);
+  push(job);
+}
+
+inline void ArrayWriter::push(Job* job)
+{
+  std::unique_ptr<Job> owned(job);
+  std::unique_lock<std::mutex> lock(mutex);
+
+  // backpressure: block the producer while the queued payload would exceed the cap,
+  // but always admit a job into an empty queue so oversized arrays still get written
+  while(!queue.empty() && counters.queuedBytes+job->bytes>maxQueuedBytes)
+  {
+    queueChanged.wait(lock);
+  }
+
+  counters.queuedBytes += job->bytes;
+  counters.queueDepth++;
+  queue.push_back(std::move(owned));
+  lock.unlock();
+
+  queueChanged.notify_all();
+}
+
+inline void ArrayWriter::work()
+{
+  std::unique_lock<std::mutex> lock(mutex);
+
+  while(1)
+  {
+    while(queue.empty() && !stopping) { queueChanged.wait(lock); }
+    if (queue.empty()) { return; }
+
+    std::unique_ptr<Job> job = std::move(queue.front());
+    queue.pop_front();
+    busy++;
+    lock.unlock();
+
+    const bool ok = job->run(flags);
+    const size_t bytes = job->bytes;
+    job.reset();
+
+    lock.lock();
+    busy--;
+    counters.queuedBytes -= bytes;
+    counters.queueDepth--;
+    if (ok) { counters.filesWritten++; counters.bytesWritten += bytes; }
+    else    { counters.failures++; }
+    queueChanged.notify_all();
+  }
+}
+
+inline void ArrayWriter::wait()
+{
+  std::unique_lock<std::mutex> lock(mutex);
+  while(!queue.empty() || busy>0) { queueChanged.wait(lock); }
+}
+
+inline ArrayWriter::Stats ArrayWriter::stats()
+{
+  std::unique_lock<std::mutex> lock(mutex);
+
+  Stats s = counters;
+  const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now()-start).count();
+  s.bytesPerSecond = seconds>0.0 ? double(s.bytesWritten)/seconds : 0.0;
+
+  return s;
+}
+
+namespace jzq_detail
+{
+  // Working type of the filters: float for everything but double, per component for Vec.
+  template<typename T> struct Filter                 { typedef float type; };
+  template<>           struct Filter<double>         { typedef double type; };
+  template<int N,typename T> struct Filter<Vec<N,T>> { typedef Vec<N,typename Filter<T>::type> type; };
+
+  // Converts a filter result back to the element type, rounding and saturating integers.
+  template<typename T> struct Saturate
+  {
+    template<typename F> static T cast(const F& x) { return T(x); }
+  };
+
+  template<typename T> struct SaturateInt
+  {
+    template<typename F> static T cast(const F& x)
+    {
+      const F r = std::floor(x+F(0.5));
+      return r<=F(std::numeric_limits<T>::min()) ? std::numeric_limits<T>::min() :
+             r>=F(std::numeric_limits<T>::max()) ? std::numeric_limits<T>::max() : T(r);
+    }
+  };
+
+  template<> struct Saturate<char>           : SaturateInt<char>           { };
+  template<> struct Saturate<unsigned char>  : SaturateInt<unsigned char>  { };
+  template<> struct Saturate<short>          : SaturateInt<short>          { };
+  template<> struct Saturate<unsigned short> : SaturateInt<unsigned short> { };
+  template<> struct Saturate<int>            : SaturateInt<int>            { };
+  template<> struct Saturate<unsigned int>   : SaturateInt<unsigned int>   { };
+
+  template<int N,typename T> struct Saturate<Vec<N,T>>
+  {
+    template<typename F> static Vec<N,T> cast(const Vec<N,F>& x)
+    {
+      Vec<N,T> r;
+      for(int i=0;i<N;i++) { r[i] = Saturate<T>::cast(x[i]); }
+      return r;
+    }
+  };
+
+  // Maps an out-of-range index into [0,n) according to the border mode;
+  // returns -1 when the sample should be treated as zero.
+  inline int borderIndex(int i,int n,int border)
+  {
+    if (i>=0 && i<n) { return i; }
+    if (border==JZQ_BORDER_ZERO) { return -1; }
+    if (border==JZQ_BORDER_CLAMP || n==1) { return i<0 ? 0 : n-1; }
+
+    const int period = 2*(n-1);
+    i %= period;
+    if (i<0) { i += period; }
+    return i<n ? i : period-i;
+  }
+
+  // Reversed kernel weights, so that the inner loops below compute a true convolution.
+  template<typename W>
+  std::vector<W> flipKernel(const std::vector<float>& kernel)
+  {
+    assert(kernel.size()%2==1);
+    std::vector<W> flipped(kernel.size());
+    for(int i=0;i<int(kernel.size());i++) { flipped[i] = W(kernel[kernel.size()-1-i]); }
+    return flipped;
+  }
+
+  // Filters numRows contiguous rows of rowLength elements along the row.
+  // Each row is copied into a padded buffer first, so the border is resolved
+  // once per row and the tap loop runs without any index checks.
+  template<typename F,typename S,typename D>
+  void convolveAlongRows(const S* src,D* dst,int rowLength,int numRows,const std::vector<float>& kernel,int border)
+  {
+    typedef typename Scalar<F>::type W;
+
+    const std::vector<W> k = flipKernel<W>(kernel);
+    const int r = int(k.size())/2;
+
+    parallelForRange(numRows,[&](int begin,int end)
+    {
+      std::vector<F> padded(rowLength+2*r);
+      std::vector<F> acc(rowLength);
+
+      for(int y=begin;y<end;y++)
+      {
+        const S* srcRow = src+size_t(y)*rowLength;
+
+        for(int x=-r;x<rowLength+r;x++)
+        {
+          const int i = borderIndex(x,rowLength,border);
+          padded[x+r] = i<0 ? zero<F>::value() : F(srcRow[i]);
+        }
+
+        for(int x=0;x<rowLength;x++) { acc[x] = zero<F>::value(); }
+
+        for(int t=0;t<int(k.size());t++)
+        {
+          const W w = k[t];
+          const F* p = &padded[t];
+          for(int x=0;x<rowLength;x++) { acc[x] += p[x]*w; }
+        }
+
+        D* dstRow = dst+size_t(y)*rowLength;
+        for(int x=0;x<rowLength;x++) { dstRow[x] = Saturate<D>::cast(acc[x]); }
+      }
+    });
+  }
+
+  // Filters across rows: output row y of each plane is a weighted sum of whole
+  // source rows, processed in column strips so the taps stay in cache. This
+  // covers the vertical pass of 2D and the y and z passes of 3D filters
+  // without transposing anything.
+  template<typename F,typename S,typename D>
+  void convolveAcrossRows(const S* src,D* dst,int rowLength,int numRows,int numPlanes,size_t planeStride,const std::vector<float>& kernel,int border)
+  {
+    typedef typename Scalar<F>::type W;
+
+    const std::vector<W> k = flipKernel<W>(kernel);
+    const int r = int(k.size())/2;
+    const int stripWidth = 1024;
+
+    parallelForRange(numRows*numPlanes,[&](int begin,int end)
+    {
+      std::vector<F> acc(std::min(stripWidth,rowLength));
+      std::vector<const S*> rows(k.size());
+      std::vector<W> weights(k.size());
+
+      for(int job=begin;job<end;job++)
+      {
+        const int y = job%numRows;
+        const size_t plane = size_t(job/numRows)*planeStride;
+
+        int numTaps = 0;
+        for(int t=0;t<int(k.size());t++)
+        {
+          const int i = borderIndex(y+t-r,numRows,border);
+          if (i<0) { continue; }
+          rows[numTaps] = src+plane+size_t(i)*rowLength;
+          weights[numTaps] = k[t];
+          numTaps++;
+        }
+
+        D* dstRow = dst+plane+size_t(y)*rowLength;
+
+        for(int x0=0;x0<rowLength;x0+=stripWidth)
+        {
+          const int n = std::min(stripWidth,rowLength-x0);
+
+          for(int x=0;x<n;x++) { acc[x] = zero<F>::value(); }
+
+          for(int t=0;t<numTaps;t++)
+          {
+            const W w = weights[t];
+            const S* p = rows[t]+x0;
+            for(int x=0;x<n;x++) { acc[x] += F(p[x])*w; }
+          }
+
+          for(int x=0;x<n;x++) { dstRow[x0+x] = Saturate<D>::cast(acc[x]); }
+        }
+      }
+    });
+  }
+}
+
+template<typename T>
+Array2<T> convolve(const Array2<T>& a,const std::vector<float>& kernelX,const std::vector<float>& kernelY,int border)
+{
+  JZQ_PROFILE_SCOPE("convolve");
+  typedef typename jzq_detail::Filter<T>::type F;
+
+  assert(numel(a)>0);
+
+  Array2<F> tmp(size(a));
+  Array2<T> out(size(a));
+
+  jzq_detail::convolveAlongRows<F>(a.data(),tmp.data(),a.width(),a.height(),kernelX,border);
+  jzq_detail::convolveAcrossRows<F>(tmp.data(),out.data(),a.width(),a.height(),1,0,kernelY,border);
+
+  return out;
+}
+
+template<typename T>
+Array2<T> convolve(const Array2<T>& a,const Array2<float>& kernel,int border)
+{
+  JZQ_PROFILE_SCOPE("convolve");
+  typedef typename jzq_detail::Filter<T>::type F;
+  typedef typename jzq_detail::Scalar<F>::type W;
+
+  assert(numel(a)>0);
+  assert(kernel.width()%2==1 && kernel.height()%2==1);
+
+  const int w = a.width();
+  const int h = a.height();
+  const int rx = kernel.width()/2;
+  const int ry = kernel.height()/2;
+
+  // pad once so the tap loops below never look at the border mode
+  Array2<F> padded(w+2*rx,h+2*ry);
+
+  parallelFor(padded.height(),[&](int y)
+  {
+    const int j = jzq_detail::borderIndex(y-ry,h,border);
+    for(int x=0;x<padded.width();x++)
+    {
+      const int i = jzq_detail::borderIndex(x-rx,w,border);
+      padded(x,y) = (i<0 || j<0) ? zero<F>::value() : F(a(i,j));
+    }
+  });
+
+  Array2<T> out(w,h);
+
+  jzq_detail::parallelForRange(h,[&](int begin,int end)
+  {
+    std::vector<F> acc(w);
 
-typedef Mat<2,2,float> Mat2x2f;
-typedef Mat<2,3,float> Mat2x3f;
-typedef Mat<2,4,float> Mat2x4f;
-typedef Mat<2,5,float> Mat2x5f;
-typedef Mat<2,6,float> Mat2x6f;
-typedef Mat<2,7,float> Mat2x7f;
-typedef Mat<2,8,float> Mat2x8f;
-typedef Mat<3,2,float> Mat3x2f;
-typedef Mat<3,3,float> Mat3x3f;
-typedef Mat<3,4,float> Mat3x4f;
-typedef Mat<3,5,float> Mat3x5f;
-typedef Mat<3,6,float> Mat3x6f;
-typedef Mat<3,7,float> Mat3x7f;
-typedef Mat<3,8,float> Mat3x8f;
-typedef Mat<4,2,float> Mat4x2f;
-typedef Mat<4,3,float> Mat4x3f;
-typedef Mat<4,4,float> Mat4x4f;
-typedef Mat<4,5,float> Mat4x5f;
-typedef Mat<4,6,float> Mat4x6f;
-typedef Mat<4,7,float> Mat4x7f;
-typedef Mat<4,8,float> Mat4x8f;
-typedef Mat<5,2,float> Mat5x2f;
-typedef Mat<5,3,float> Mat5x3f;
-typedef Mat<5,4,float> Mat5x4f;
-typedef Mat<5,5,float> Mat5x5f;
-typedef Mat<5,6,float> Mat5x6f;
-typedef Mat<5,7,float> Mat5x7f;
-typedef Mat<5,8,float> Mat5x8f;
-typedef Mat<6,2,float> Mat6x2f;
-typedef Mat<6,3,float> Mat6x3f;
-typedef Mat<6,4,float> Mat6x4f;
-typedef Mat<6,5,float> Mat6x5f;
-typedef Mat<6,6,float> Mat6x6f;
-typedef Mat<6,7,float> Mat6x7f;
-typedef Mat<6,8,float> Mat6x8f;
-typedef Mat<7,2,float> Mat7x2f;
-typedef Mat<7,3,float> Mat7x3f;
-typedef Mat<7,4,float> Mat7x4f;
-typedef Mat<7,5,float> Mat7x5f;
-typedef Mat<7,6,float> Mat7x6f;
-typedef Mat<7,7,float> Mat7x7f;
-typedef Mat<7,8,float> Mat7x8f;
-typedef Mat<8,2,float> Mat8x2f;
-typedef Mat<8,3,float> Mat8x3f;
-typedef Mat<8,4,float> Mat8x4f;
-typedef Mat<8,5,float> Mat8x5f;
-typedef Mat<8,6,float> Mat8x6f;
-typedef Mat<8,7,float> Mat8x7f;
-typedef Mat<8,8,float> Mat8x8f;
+    for(int y=begin;y<end;y++)
+    {
+      for(int x=0;x<w;x++) { acc[x] = zero<F>::value(); }
 
-typedef Mat<2,2,double> Mat2x2d;
-typedef Mat<2,3,double> Mat2x3d;
-typedef Mat<2,4,double> Mat2x4d;
-typedef Mat<2,5,double> Mat2x5d;
-typedef Mat<2,6,double> Mat2x6d;
-typedef Mat<2,7,double> Mat2x7d;
-typedef Mat<2,8,double> Mat2x8d;
-typedef Mat<3,2,double> Mat3x2d;
-typedef Mat<3,3,double> Mat3x3d;
-typedef Mat<3,4,double> Mat3x4d;
-typedef Mat<3,5,double> Mat3x5d;
-typedef Mat<3,6,double> Mat3x6d;
-typedef Mat<3,7,double> Mat3x7d;
-typedef Mat<3,8,double> Mat3x8d;
-typedef Mat<4,2,double> Mat4x2d;
-typedef Mat<4,3,double> Mat4x3d;
-typedef Mat<4,4,double> Mat4x4d;
-typedef Mat<4,5,double> Mat4x5d;
-typedef Mat<4,6,double> Mat4x6d;
-typedef Mat<4,7,double> Mat4x7d;
-typedef Mat<4,8,double> Mat4x8d;
-typedef Mat<5,2,double> Mat5x2d;
-typedef Mat<5,3,double> Mat5x3d;
-typedef Mat<5,4,double> Mat5x4d;
-typedef Mat<5,5,double> Mat5x5d;
-typedef Mat<5,6,double> Mat5x6d;
-typedef Mat<5,7,double> Mat5x7d;
-typedef Mat<5,8,double> Mat5x8d;
-typedef Mat<6,2,double> Mat6x2d;
-typedef Mat<6,3,double> Mat6x3d;
-typedef Mat<6,4,double> Mat6x4d;
-typedef Mat<6,5,double> Mat6x5d;
-typedef Mat<6,6,double> Mat6x6d;
-typedef Mat<6,7,double> Mat6x7d;
-typedef Mat<6,8,double> Mat6x8d;
-typedef Mat<7,2,double> Mat7x2d;
-typedef Mat<7,3,double> Mat7x3d;
-typedef Mat<7,4,double> Mat7x4d;
-typedef Mat<7,5,double> Mat7x5d;
-typedef Mat<7,6,double> Mat7x6d;
-typedef Mat<7,7,double> Mat7x7d;
-typedef Mat<7,8,double> Mat7x8d;
-typedef Mat<8,2,double> Mat8x2d;
-typedef Mat<8,3,double> Mat8x3d;
-typedef Mat<8,4,double> Mat8x4d;
-typedef Mat<8,5,double> Mat8x5d;
-typedef Mat<8,6,double> Mat8x6d;
-typedef Mat<8,7,double> Mat8x7d;
-typedef Mat<8,8,double> Mat8x8d;
+      for(int ky=0;ky<kernel.height();ky++)
+      for(int kx=0;kx<kernel.width();kx++)
+      {
+        const W k = W(kernel(kernel.width()-1-kx,kernel.height()-1-ky));
+        const F* p = &padded(kx,y+ky);
+        for(int x=0;x<w;x++) { acc[x] += p[x]*k; }
+      }
 
-typedef Array2<double>                  Array2d;
-typedef Array2<float>                   Array2f;
-typedef Array2<int>                     Array2i;
-typedef Array2<unsigned int>            Array2ui;
-typedef Array2<short>                   Array2s;
-typedef Array2<unsigned short>          Array2us;
-typedef Array2<char>                    Array2c;
-typedef Array2<unsigned char>           Array2uc;
+      T* row = &out(0,y);
+      for(int x=0;x<w;x++) { row[x] = jzq_detail::Saturate<T>::cast(acc[x]); }
+    }
+  });
 
-typedef Array2< Vec<2,double> >         Array2V2d;
-typedef Array2< Vec<2,float> >          Array2V2f;
-typedef Array2< Vec<2,int> >            Array2V2i;
-typedef Array2< Vec<2,unsigned int> >   Array2V2ui;
-typedef Array2< Vec<2,short> >          Array2V2s;
-typedef Array2< Vec<2,unsigned short> > Array2V2us;
-typedef Array2< Vec<2,char> >           Array2V2c;
-typedef Array2< Vec<2,unsigned char> >  Array2V2uc;
+  return out;
+}
 
-typedef Array2< Vec<3,double> >         Array2V3d;
-typedef Array2< Vec<3,float> >          Array2V3f;
-typedef Array2< Vec<3,int> >            Array2V3i;
-typedef Array2< Vec<3,unsigned int> >   Array2V3ui;
-typedef Array2< Vec<3,short> >          Array2V3s;
-typedef Array2< Vec<3,unsigned short> > Array2V3us;
-typedef Array2< Vec<3,char> >           Array2V3c;
-typedef Array2< Vec<3,unsigned char> >  Array2V3uc;
+template<typename T>
+Array3<T> convolve(const Array3<T>& a,const std::vector<float>& kernelX,const std::vector<float>& kernelY,const std::vector<float>& kernelZ,int border)
+{
+  JZQ_PROFILE_SCOPE("convolve");
+  typedef typename jzq_detail::Filter<T>::type F;
 
-typedef Array2< Vec<4,double> >         Array2V4d;
-typedef Array2< Vec<4,float> >          Array2V4f;
-typedef Array2< Vec<4,int> >            Array2V4i;
-typedef Array2< Vec<4,unsigned int> >   Array2V4ui;
-typedef Array2< Vec<4,short> >          Array2V4s;
-typedef Array2< Vec<4,unsigned short> > Array2V4us;
-typedef Array2< Vec<4,char> >           Array2V4c;
-typedef Array2< Vec<4,unsigned char> >  Array2V4uc;
+  assert(numel(a)>0);
 
-typedef Array2<double>                  A2d;
-typedef Array2<float>                   A2f;
-typedef Array2<int>                     A2i;
-typedef Array2<unsigned int>            A2ui;
-typedef Array2<short>                   A2s;
-typedef Array2<unsigned short>          A2us;
-typedef Array2<char>                    A2c;
-typedef Array2<unsigned char>           A2uc;
+  const int w = a.width();
+  const int h = a.height();
+  const int d = a.depth();
 
-typedef Array2< Vec<2,double> >         A2V2d;
-typedef Array2< Vec<2,float> >          A2V2f;
-typedef Array2< Vec<2,int> >            A2V2i;
-typedef Array2< Vec<2,unsigned int> >   A2V2ui;
-typedef Array2< Vec<2,short> >          A2V2s;
-typedef Array2< Vec<2,unsigned short> > A2V2us;
-typedef Array2< Vec<2,char> >           A2V2c;
-typedef Array2< Vec<2,unsigned char> >  A2V2uc;
+  Array3<F> tmpX(size(a));
+  Array3<F> tmpY(size(a));
+  Array3<T> out(size(a));
 
-typedef Array2< Vec<3,double> >         A2V3d;
-typedef Array2< Vec<3,float> >          A2V3f;
-typedef Array2< Vec<3,int> >            A2V3i;
-typedef Array2< Vec<3,unsigned int> >   A2V3ui;
-typedef Array2< Vec<3,short> >          A2V3s;
-typedef Array2< Vec<3,unsigned short> > A2V3us;
-typedef Array2< Vec<3,char> >           A2V3c;
-typedef Array2< Vec<3,unsigned char> >  A2V3uc;
+  jzq_detail::convolveAlongRows<F>(a.data(),tmpX.data(),w,h*d,kernelX,border);
+  jzq_detail::convolveAcrossRows<F>(tmpX.data(),tmpY.data(),w,h,d,size_t(w)*h,kernelY,border);
+  jzq_detail::convolveAcrossRows<F>(tmpY.data(),out.data(),w*h,d,1,0,kernelZ,border);
 
-typedef Array2< Vec<4,double> >         A2V4d;
-typedef Array2< Vec<4,float> >          A2V4f;
-typedef Array2< Vec<4,int> >            A2V4i;
-typedef Array2< Vec<4,unsigned int> >   A2V4ui;
-typedef Array2< Vec<4,short> >          A2V4s;
-typedef Array2< Vec<4,unsigned short> > A2V4us;
-typedef Array2< Vec<4,char> >           A2V4c;
-typedef Array2< Vec<4,unsigned char> >  A2V4uc;
+  return out;
+}
 
-typedef Array3<double>                  Array3d;
-typedef Array3<float>                   Array3f;
-typedef Array3<int>                     Array3i;
-typedef Array3<unsigned int>            Array3ui;
-typedef Array3<short>                   Array3s;
-typedef Array3<unsigned short>          Array3us;
-typedef Array3<char>                    Array3c;
-typedef Array3<unsigned char>           Array3uc;
+template<typename T>
+Array3<T> convolve(const Array3<T>& a,const Array3<float>& kernel,int border)
+{
+  JZQ_PROFILE_SCOPE("convolve");
+  typedef typename jzq_detail::Filter<T>::type F;
+  typedef typename jzq_detail::Scalar<F>::type W;
 
-typedef Array3< Vec<2,double> >         Array3V2d;
-typedef Array3< Vec<2,float> >          Array3V2f;
-typedef Array3< Vec<2,int> >            Array3V2i;
-typedef Array3< Vec<2,unsigned int> >   Array3V2ui;
-typedef Array3< Vec<2,short> >          Array3V2s;
-typedef Array3< Vec<2,unsigned short> > Array3V2us;
-typedef Array3< Vec<2,char> >           Array3V2c;
-typedef Array3< Vec<2,unsigned char> >  Array3V2uc;
+  assert(numel(a)>0);
+  assert(kernel.width()%2==1 && kernel.height()%2==1 && kernel.depth()%2==1);
 
-typedef Array3< Vec<3,double> >         Array3V3d;
-typedef Array3< Vec<3,float> >          Array3V3f;
-typedef Array3< Vec<3,int> >            Array3V3i;
-typedef Array3< Vec<3,unsigned int> >   Array3V3ui;
-typedef Array3< Vec<3,short> >          Array3V3s;
-typedef Array3< Vec<3,unsigned short> > Array3V3us;
-typedef Array3< Vec<3,char> >           Array3V3c;
-typedef Array3< Vec<3,unsigned char> >  Array3V3uc;
+  const int w = a.width();
+  const int h = a.height();
+  const int d = a.depth();
+  const int rx = kernel.width()/2;
+  const int ry = kernel.height()/2;
+  const int rz = kernel.depth()/2;
 
-typedef Array3< Vec<4,double> >         Array3V4d;
-typedef Array3< Vec<4,float> >          Array3V4f;
-typedef Array3< Vec<4,int> >            Array3V4i;
-typedef Array3< Vec<4,unsigned int> >   Array3V4ui;
-typedef Array3< Vec<4,short> >          Array3V4s;
-typedef Array3< Vec<4,unsigned short> > Array3V4us;
-typedef Array3< Vec<4,char> >           Array3V4c;
-typedef Array3< Vec<4,unsigned char> >  Array3V4uc;
+  Array3<F> padded(w+2*rx,h+2*ry,d+2*rz);
 
-typedef Array3<double>                  A3d;
-typedef Array3<float>                   A3f;
-typedef Array3<int>                     A3i;
-typedef Array3<unsigned int>            A3ui;
-typedef Array3<short>                   A3s;
-typedef Array3<unsigned short>          A3us;
-typedef Array3<char>                    A3c;
-typedef Array3<unsigned char>           A3uc;
+  parallelFor(padded.height()*padded.depth(),[&](int yz)
+  {
+    const int y = yz%padded.height();
+    const int z = yz/padded.height();
+    const int j = jzq_detail::borderIndex(y-ry,h,border);
+    const int k = jzq_detail::borderIndex(z-rz,d,border);
+    for(int x=0;x<padded.width();x++)
+    {
+      const int i = jzq_detail::borderIndex(x-rx,w,border);
+      padded(x,y,z) = (i<0 || j<0 || k<0) ? zero<F>::value() : F(a(i,j,k));
+    }
+  });
+
+  Array3<T> out(w,h,d);
+
+  jzq_detail::parallelForRange(h*d,[&](int begin,int end)
+  {
+    std::vector<F> acc(w);
+
+    for(int yz=begin;yz<end;yz++)
+    {
+      const int y = yz%h;
+      const int z = yz/h;
+
+      for(int x=0;x<w;x++) { acc[x] = zero<F>::value(); }
+
+      for(int kz=0;kz<kernel.depth();kz++)
+      for(int ky=0;ky<kernel.height();ky++)
+      for(int kx=0;kx<kernel.width();kx++)
+      {
+        const W c = W(kernel(kernel.width()-1-kx,kernel.height()-1-ky,kernel.depth()-1-kz));
+        const F* p = &padded(kx,y+ky,z+kz);
+        for(int x=0;x<w;x++) { acc[x] += p[x]*c; }
+      }
+
+      T* row = &out(0,y,z);
+      for(int x=0;x<w;x++) { row[x] = jzq_detail::Saturate<T>::cast(acc[x]); }
+    }
+  });
+
+  return out;
+}
+
+namespace jzq_detail
+{
+  // Running-sum box filters: each output costs one add and one subtract no
+  // matter how large the radius. A list of radii applies the boxes in turn,
+  // which is how gaussianBlur approximates a Gaussian.
+  template<typename F,typename S,typename D>
+  void boxAlongRows(const S* src,D* dst,int rowLength,int numRows,const std::vector<int>& radii,int border)
+  {
+    typedef typename Accum<F>::type A;
+    typedef typename Scalar<F>::type W;
+
+    const int maxRadius = *std::max_element(radii.begin(),radii.end());
+
+    parallelForRange(numRows,[&](int begin,int end)
+    {
+      std::vector<F> line(rowLength);
+      std::vector<F> padded(rowLength+2*maxRadius);
+
+      for(int y=begin;y<end;y++)
+      {
+        const S* srcRow = src+size_t(y)*rowLength;
+        for(int x=0;x<rowLength;x++) { line[x] = F(srcRow[x]); }
+
+        for(int pass=0;pass<int(radii.size());pass++)
+        {
+          const int r = radii[pass];
+          const W scale = W(1)/W(2*r+1);
+
+          for(int x=-r;x<rowLength+r;x++)
+          {
+            const int i = borderIndex(x,rowLength,border);
+            padded[x+r] = i<0 ? zero<F>::value() : line[i];
+          }
+
+          A acc = zero<A>::value();
+          for(int t=0;t<2*r;t++) { acc += A(padded[t]); }
+
+          for(int x=0;x<rowLength;x++)
+          {
+            acc += A(padded[x+2*r]);
+            line[x] = F(acc)*scale;
+            acc = acc-A(padded[x]);
+          }
+        }
+
+        D* dstRow = dst+size_t(y)*rowLength;
+        for(int x=0;x<rowLength;x++) { dstRow[x] = Saturate<D>::cast(line[x]); }
+      }
+    });
+  }
+
+  // The running sum across rows is carried for a whole strip of columns at
+  // once, so the per-row update is a contiguous vector add/subtract.
+  template<typename F,typename S,typename D>
+  void boxAcrossRows(const S* src,D* dst,int rowLength,int numRows,int numPlanes,size_t planeStride,int r,int border)
+  {
+    typedef typename Accum<F>::type A;
+    typedef typename Scalar<F>::type W;
+
+    const W scale = W(1)/W(2*r+1);
+    const int stripWidth = 128;
+    const int numStrips = (rowLength+stripWidth-1)/stripWidth;
 
-typedef Array3< Vec<2,double> >         A3V2d;
-typedef Array3< Vec<2,float> >          A3V2f;
-typedef Array3< Vec<2,int> >            A3V2i;
-typedef Array3< Vec<2,unsigned int> >   A3V2ui;
-typedef Array3< Vec<2,short> >          A3V2s;
-typedef Array3< Vec<2,unsigned short> > A3V2us;
-typedef Array3< Vec<2,char> >           A3V2c;
-typedef Array3< Vec<2,unsigned char> >  A3V2uc;
+    parallelForRange(numStrips*numPlanes,[&](int begin,int end)
+    {
+      std::vector<A> acc(stripWidth);
 
-typedef Array3< Vec<3,double> >         A3V3d;
-typedef Array3< Vec<3,float> >          A3V3f;
-typedef Array3< Vec<3,int> >            A3V3i;
-typedef Array3< Vec<3,unsigned int> >   A3V3ui;
-typedef Array3< Vec<3,short> >          A3V3s;
-typedef Array3< Vec<3,unsigned short> > A3V3us;
-typedef Array3< Vec<3,char> >           A3V3c;
-typedef Array3< Vec<3,unsigned char> >  A3V3uc;
+      for(int job=begin;job<end;job++)
+      {
+        const int x0 = (job%numStrips)*stripWidth;
+        const int n = std::min(stripWidth,rowLength-x0);
+        const size_t plane = size_t(job/numStrips)*planeStride;
+
+        const S* base = src+plane+x0;
+        D* dstBase = dst+plane+x0;
+
+        for(int x=0;x<n;x++) { acc[x] = zero<A>::value(); }
+
+        for(int t=-r;t<r;t++)
+        {
+          const int i = borderIndex(t,numRows,border);
+          if (i<0) { continue; }
+          const S* p = base+size_t(i)*rowLength;
+          for(int x=0;x<n;x++) { acc[x] += A(p[x]); }
+        }
+
+        for(int y=0;y<numRows;y++)
+        {
+          const int iAdd = borderIndex(y+r,numRows,border);
+          if (iAdd>=0)
+          {
+            const S* p = base+size_t(iAdd)*rowLength;
+            for(int x=0;x<n;x++) { acc[x] += A(p[x]); }
+          }
+
+          D* q = dstBase+size_t(y)*rowLength;
+          for(int x=0;x<n;x++) { q[x] = Saturate<D>::cast(F(acc[x])*scale); }
+
+          const int iSub = borderIndex(y-r,numRows,border);
+          if (iSub>=0)
+          {
+            const S* p = base+size_t(iSub)*rowLength;
+            for(int x=0;x<n;x++) { acc[x] = acc[x]-A(p[x]); }
+          }
+        }
+      }
+    });
+  }
 
-typedef Array3< Vec<4,double> >         A3V4d;
-typedef Array3< Vec<4,float> >          A3V4f;
-typedef Array3< Vec<4,int> >            A3V4i;
-typedef Array3< Vec<4,unsigned int> >   A3V4ui;
-typedef Array3< Vec<4,short> >          A3V4s;
-typedef Array3< Vec<4,unsigned short> > A3V4us;
-typedef Array3< Vec<4,char> >           A3V4c;
-typedef Array3< Vec<4,unsigned char> >  A3V4uc;
+  // Box widths whose threefold convolution best matches a Gaussian of the given sigma.
+  inline std::vector<int> gaussianBoxRadii(float sigma,int numBoxes)
+  {
+    const double s2 = 12.0*double(sigma)*sigma;
 
-template<> struct zero<char          > { static char           value() { return 0;    } };
-template<> struct zero<unsigned char > { static unsigned char  value() { return 0;    } };
-template<> struct zero<short         > { static short          value() { return 0;    } };
-template<> struct zero<unsigned short> { static unsigned short value() { return 0;    } };
-template<> struct zero<int           > { static int            value() { return 0;    } };
-template<> struct zero<unsigned int  > { static unsigned int   value() { return 0;    } };
-template<> struct zero<float         > { static float          value() { return 0.0f; } };
-template<> struct zero<double        > { static double         value() { return 0.0;  } };
+    int wl = int(std::floor(std::sqrt(s2/numBoxes+1.0)));
+    if (wl%2==0) { wl--; }
+    wl = std::max(wl,1);
+    const int wu = wl+2;
 
-template<int N,typename T>
-struct zero<Vec<N,T>>
-{
-  static Vec<N,T> value()
+    const int m = int(std::floor((s2-numBoxes*wl*wl-4.0*numBoxes*wl-3.0*numBoxes)/(-4.0*wl-4.0)+0.5));
+
+    std::vector<int> radii(numBoxes);
+    for(int i=0;i<numBoxes;i++) { radii[i] = ((i<m ? wl : wu)-1)/2; }
+    return radii;
+  }
+
+  struct MinOp { template<typename T> T operator()(const T& a,const T& b) const { return std::min(a,b); } };
+  struct MaxOp { template<typename T> T operator()(const T& a,const T& b) const { return std::max(a,b); } };
+
+  // van Herk/Gil-Werman running min/max: block-wise prefix and suffix extrema
+  // give every window of 2r+1 samples in three comparisons per element.
+  // The edge is clamped, which for min/max is the same as ignoring samples
+  // outside the array.
+  template<typename T,typename Op>
+  void minmaxAlongRows(const T* src,T* dst,int rowLength,int numRows,int r,Op op)
   {
-    Vec<N,T> z;
-    for(int i=0;i<N;i++) { z[i] = zero<T>::value(); }
-    return z;
+    const int k = 2*r+1;
+    const int L = rowLength+2*r;
+
+    parallelForRange(numRows,[&](int begin,int end)
+    {
+      std::vector<T> g(L);
+      std::vector<T> h(L);
+
+      for(int y=begin;y<end;y++)
+      {
+        const T* p = src+size_t(y)*rowLength;
+
+        for(int i=0;i<L;i++)
+        {
+          const T& v = p[std::min(std::max(i-r,0),rowLength-1)];
+          g[i] = (i%k==0) ? v : op(g[i-1],v);
+        }
+
+        for(int i=L-1;i>=0;i--)
+        {
+          const T& v = p[std::min(std::max(i-r,0),rowLength-1)];
+          h[i] = (i==L-1 || (i+1)%k==0) ? v : op(h[i+1],v);
+        }
+
+        T* q = dst+size_t(y)*rowLength;
+        for(int x=0;x<rowLength;x++) { q[x] = op(h[x],g[x+k-1]); }
+      }
+    });
   }
-};
 
-template<int M,int N,typename T>
-struct zero<Mat<M,N,T>>
-{
-  static Mat<M,N,T> value()
+  template<typename T,typename Op>
+  void minmaxAcrossRows(const T* src,T* dst,int rowLength,int numRows,int numPlanes,size_t planeStride,int r,Op op)
   {
-    Mat<M,N,T> z;
-    for(int i=0;i<M;i++)
-    for(int j=0;j<N;j++)
+    const int k = 2*r+1;
+    const int L = numRows+2*r;
+    const int stripWidth = 128;
+    const int numStrips = (rowLength+stripWidth-1)/stripWidth;
+
+    parallelForRange(numStrips*numPlanes,[&](int begin,int end)
     {
-      z(i,j) = zero<T>::value();
-    }
-    return z;
+      std::vector<T> g(size_t(L)*stripWidth);
+      std::vector<T> h(size_t(L)*stripWidth);
+
+      for(int job=begin;job<end;job++)
+      {
+        const int x0 = (job%numStrips)*stripWidth;
+        const int n = std::min(stripWidth,rowLength-x0);
+        const size_t plane = size_t(job/numStrips)*planeStride;
+
+        const T* base = src+plane+x0;
+
+        for(int i=0;i<L;i++)
+        {
+          const T* p = base+size_t(std::min(std::max(i-r,0),numRows-1))*rowLength;
+          T* gi = &g[size_t(i)*stripWidth];
+          if (i%k==0) { for(int x=0;x<n;x++) { gi[x] = p[x]; } }
+          else        { const T* gp = gi-stripWidth; for(int x=0;x<n;x++) { gi[x] = op(gp[x],p[x]); } }
+        }
+
+        for(int i=L-1;i>=0;i--)
+        {
+          const T* p = base+size_t(std::min(std::max(i-r,0),numRows-1))*rowLength;
+          T* hi = &h[size_t(i)*stripWidth];
+          if (i==L-1 || (i+1)%k==0) { for(int x=0;x<n;x++) { hi[x] = p[x]; } }
+          else                      { const T* hn = hi+stripWidth; for(int x=0;x<n;x++) { hi[x] = op(hn[x],p[x]); } }
+        }
+
+        for(int y=0;y<numRows;y++)
+        {
+          const T* hy = &h[size_t(y)*stripWidth];
+          const T* gy = &g[size_t(y+k-1)*stripWidth];
+          T* q = dst+plane+size_t(y)*rowLength+x0;
+          for(int x=0;x<n;x++) { q[x] = op(hy[x],gy[x]); }
+        }
+      }
+    });
   }
-};
+}
 
-template <typename T> inline
-T clamp(const T& x,const T& xmin,const T& xmax)
+template<typename T>
+Array2<T> boxFilter(const Array2<T>& a,int radius,int border)
 {
-  return std::min(std::max(x,xmin),xmax);
+  JZQ_PROFILE_SCOPE("boxFilter");
+  typedef typename jzq_detail::Filter<T>::type F;
+
+  assert(numel(a)>0);
+  assert(radius>=0);
+
+  Array2<F> tmp(size(a));
+  Array2<T> out(size(a));
+
+  jzq_detail::boxAlongRows<F>(a.data(),tmp.data(),a.width(),a.height(),std::vector<int>(1,radius),border);
+  jzq_detail::boxAcrossRows<F>(tmp.data(),out.data(),a.width(),a.height(),1,0,radius,border);
+
+  return out;
 }
 
-template <typename T> inline
-T lerp(const T& a,const T& b,const T& t)
+template<typename T>
+Array2<T> gaussianBlur(const Array2<T>& a,float sigma,int border)
 {
-  return (1.0-t)*a+t*b;
+  JZQ_PROFILE_SCOPE("gaussianBlur");
+  typedef typename jzq_detail::Filter<T>::type F;
+
+  assert(numel(a)>0);
+  assert(sigma>0.0f);
+
+  const std::vector<int> radii = jzq_detail::gaussianBoxRadii(sigma,3);
+
+  Array2<F> tmp(size(a));
+  Array2<F> tmp2(size(a));
+  Array2<T> out(size(a));
+
+  jzq_detail::boxAlongRows<F>(a.data(),tmp.data(),a.width(),a.height(),radii,border);
+
+  for(int pass=0;pass<int(radii.size())-1;pass++)
+  {
+    jzq_detail::boxAcrossRows<F>(tmp.data(),tmp2.data(),a.width(),a.height(),1,0,radii[pass],border);
+    tmp.swap(tmp2);
+  }
+
+  jzq_detail::boxAcrossRows<F>(tmp.data(),out.data(),a.width(),a.height(),1,0,radii.back(),border);
+
+  return out;
 }
 
-inline std::string spf(const std::string fmt,...)
+template<typename T>
+Array2<T> erode(const Array2<T>& a,int radius)
 {
-  int size = 1024;
-  std::vector<char> buf;
-  va_list ap;
+  JZQ_PROFILE_SCOPE("erode");
+  assert(numel(a)>0);
+  assert(radius>=0);
 
-  while(1)
-  {
-    if (size>16*1024*1024) { return std::string(""); }
+  Array2<T> tmp(size(a));
+  Array2<T> out(size(a));
 
-    buf.resize(size);
+  jzq_detail::minmaxAlongRows(a.data(),tmp.data(),a.width(),a.height(),radius,jzq_detail::MinOp());
+  jzq_detail::minmaxAcrossRows(tmp.data(),out.data(),a.width(),a.height(),1,0,radius,jzq_detail::MinOp());
 
-    va_start(ap,fmt);
-    const int n = vsnprintf(&buf[0],size-1,fmt.c_str(),ap);
-    va_end(ap);
+  return out;
+}
 
-    if      (n>-1 && n<size) { break; }
-    else if (n>-1)           { size = n + 1; }
-    else                     { size = 2*size; }
-  }
+template<typename T>
+Array2<T> dilate(const Array2<T>& a,int radius)
+{
+  JZQ_PROFILE_SCOPE("dilate");
+  assert(numel(a)>0);
+  assert(radius>=0);
+
+  Array2<T> tmp(size(a));
+  Array2<T> out(size(a));
 
-  return std::string(&buf[0]);
+  jzq_detail::minmaxAlongRows(a.data(),tmp.data(),a.width(),a.height(),radius,jzq_detail::MaxOp());
+  jzq_detail::minmaxAcrossRows(tmp.data(),out.data(),a.width(),a.height(),1,0,radius,jzq_detail::MaxOp());
+
+  return out;
 }
 
-#ifdef _WIN32
-extern "C"
+template<typename T>
+Array3<T> boxFilter(const Array3<T>& a,int radius,int border)
 {
-  __declspec(dllimport)
-  int __stdcall MultiByteToWideChar
-  (
-    unsigned int CodePage,
-    unsigned long dwFlags,
-    const char* lpMultiByteStr,
-    int cbMultiByte,
-    wchar_t* lpWideCharStr,
-    int cchWideChar
-  );
+  JZQ_PROFILE_SCOPE("boxFilter");
+  typedef typename jzq_detail::Filter<T>::type F;
 
-  FILE* _wfopen(const wchar_t* filename,const wchar_t* mode);
+  assert(numel(a)>0);
+  assert(radius>=0);
+
+  const int w = a.width();
+  const int h = a.height();
+  const int d = a.depth();
+
+  Array3<F> tmpX(size(a));
+  Array3<F> tmpY(size(a));
+  Array3<T> out(size(a));
+
+  jzq_detail::boxAlongRows<F>(a.data(),tmpX.data(),w,h*d,std::vector<int>(1,radius),border);
+  jzq_detail::boxAcrossRows<F>(tmpX.data(),tmpY.data(),w,h,d,size_t(w)*h,radius,border);
+  jzq_detail::boxAcrossRows<F>(tmpY.data(),out.data(),w*h,d,1,0,radius,border);
+
+  return out;
 }
-#endif
 
-namespace jzq_detail
+template<typename T>
+Array3<T> gaussianBlur(const Array3<T>& a,float sigma,int border)
 {
-  inline std::wstring utf8_to_wide(const std::string& str)
+  JZQ_PROFILE_SCOPE("gaussianBlur");
+  typedef typename jzq_detail::Filter<T>::type F;
+
+  assert(numel(a)>0);
+  assert(sigma>0.0f);
+
+  const int w = a.width();
+  const int h = a.height();
+  const int d = a.depth();
+
+  const std::vector<int> radii = jzq_detail::gaussianBoxRadii(sigma,3);
+
+  Array3<F> tmp(size(a));
+  Array3<F> tmp2(size(a));
+  Array3<T> out(size(a));
+
+  jzq_detail::boxAlongRows<F>(a.data(),tmp.data(),w,h*d,radii,border);
+
+  for(int pass=0;pass<int(radii.size());pass++)
   {
-    const unsigned int codePageUTF8 = 65001;
-    const int size = MultiByteToWideChar(codePageUTF8,0,(char*)str.c_str(),-1,NULL,0);
-    std::wstring wide_str(size,0);
-    MultiByteToWideChar(codePageUTF8,0,(char*)str.c_str(),-1,&wide_str[0],size);
-    wide_str.resize(size-1);
-    return wide_str;
+    jzq_detail::boxAcrossRows<F>(tmp.data(),tmp2.data(),w,h,d,size_t(w)*h,radii[pass],border);
+    tmp.swap(tmp2);
+  }
+
+  for(int pass=0;pass<int(radii.size())-1;pass++)
+  {
+    jzq_detail::boxAcrossRows<F>(tmp.data(),tmp2.data(),w*h,d,1,0,radii[pass],border);
+    tmp.swap(tmp2);
   }
+
+  jzq_detail::boxAcrossRows<F>(tmp.data(),out.data(),w*h,d,1,0,radii.back(),border);
+
+  return out;
 }
 
-inline FILE* jzq_fopen(const char* filename,const char* mode)
+template<typename T>
+Array3<T> erode(const Array3<T>& a,int radius)
 {
-#ifdef _WIN32
-  return _wfopen(jzq_detail::utf8_to_wide(filename).c_str(),
-                 jzq_detail::utf8_to_wide(mode).c_str());
-#else
-  return fopen(filename,mode);
-#endif
+  JZQ_PROFILE_SCOPE("erode");
+  assert(numel(a)>0);
+  assert(radius>=0);
+
+  const int w = a.width();
+  const int h = a.height();
+  const int d = a.depth();
+
+  Array3<T> tmp(size(a));
+  Array3<T> out(size(a));
+
+  jzq_detail::minmaxAlongRows(a.data(),out.data(),w,h*d,radius,jzq_detail::MinOp());
+  jzq_detail::minmaxAcrossRows(out.data(),tmp.data(),w,h,d,size_t(w)*h,radius,jzq_detail::MinOp());
+  jzq_detail::minmaxAcrossRows(tmp.data(),out.data(),w*h,d,1,0,radius,jzq_detail::MinOp());
+
+  return out;
 }
 
-template<int N,typename T>
-Vec<N,T>::Vec()
+template<typename T>
+Array3<T> dilate(const Array3<T>& a,int radius)
 {
+  JZQ_PROFILE_SCOPE("dilate");
+  assert(numel(a)>0);
+  assert(radius>=0);
+
+  const int w = a.width();
+  const int h = a.height();
+  const int d = a.depth();
+
+  Array3<T> tmp(size(a));
+  Array3<T> out(size(a));
+
+  jzq_detail::minmaxAlongRows(a.data(),out.data(),w,h*d,radius,jzq_detail::MaxOp());
+  jzq_detail::minmaxAcrossRows(out.data(),tmp.data(),w,h,d,size_t(w)*h,radius,jzq_detail::MaxOp());
+  jzq_detail::minmaxAcrossRows(tmp.data(),out.data(),w*h,d,1,0,radius,jzq_detail::MaxOp());
+
+  return out;
 }
 
-template<int N,typename T>
-Vec<N,T>::Vec(T v0)
+namespace jzq_detail
 {
-  assert(N==1);
-  v[0]=v0;
+  // 2x decimation with the binomial kernel [1 4 6 4 1]/16 and a clamped edge.
+  // Rows are filtered and decimated horizontally first, then pairs of
+  // intermediate rows are combined vertically for whole output rows.
+  template<typename T>
+  void downsample2x(const T* src,int w,int h,T* dst)
+  {
+    typedef typename Filter<T>::type F;
+    typedef typename Scalar<F>::type W;
+
+    const int dw = (w+1)/2;
+    const int dh = (h+1)/2;
+
+    std::vector<F> tmp(size_t(dw)*h);
+
+    parallelFor(h,[&](int y)
+    {
+      const T* row = src+size_t(y)*w;
+      F* out = &tmp[size_t(y)*dw];
+      for(int x=0;x<dw;x++)
+      {
+        const int x0 = 2*x;
+        const F a = F(row[std::max(x0-2,0)]);
+        const F b = F(row[std::max(x0-1,0)]);
+        const F c = F(row[x0]);
+        const F d = F(row[std::min(x0+1,w-1)]);
+        const F e = F(row[std::min(x0+2,w-1)]);
+        out[x] = (a+e)*W(1.0/16.0)+(b+d)*W(4.0/16.0)+c*W(6.0/16.0);
+      }
+    });
+
+    parallelFor(dh,[&](int y)
+    {
+      const int y0 = 2*y;
+      const F* a = &tmp[size_t(std::max(y0-2,0))*dw];
+      const F* b = &tmp[size_t(std::max(y0-1,0))*dw];
+      const F* c = &tmp[size_t(y0)*dw];
+      const F* d = &tmp[size_t(std::min(y0+1,h-1))*dw];
+      const F* e = &tmp[size_t(std::min(y0+2,h-1))*dw];
+      T* out = dst+size_t(y)*dw;
+      for(int x=0;x<dw;x++)
+      {
+        out[x] = Saturate<T>::cast((a[x]+e[x])*W(1.0/16.0)+(b[x]+d[x])*W(4.0/16.0)+c[x]*W(6.0/16.0));
+      }
+    });
+  }
+
+  inline float resizeKernel(float x,int filter)
+  {
+    x = std::abs(x);
+
+    switch(filter)
+    {
+      case JZQ_FILTER_BOX:
+        return x<0.5f ? 1.0f : 0.0f;
+      case JZQ_FILTER_BILINEAR:
+        return x<1.0f ? 1.0f-x : 0.0f;
+      case JZQ_FILTER_BICUBIC:
+        if (x<1.0f) { return (1.5f*x-2.5f)*x*x+1.0f; }
+        if (x<2.0f) { return ((-0.5f*x+2.5f)*x-4.0f)*x+2.0f; }
+        return 0.0f;
+      case JZQ_FILTER_LANCZOS:
+      {
+        if (x<1e-6f) { return 1.0f; }
+        if (x>=3.0f) { return 0.0f; }
+        const float pi = 3.14159265358979f;
+        return 3.0f*std::sin(pi*x)*std::sin(pi*x/3.0f)/(pi*pi*x*x);
+      }
+    }
+
+    return 0.0f;
+  }
+
+  inline float resizeKernelRadius(int filter)
+  {
+    switch(filter)
+    {
+      case JZQ_FILTER_BOX:      return 0.5f;
+      case JZQ_FILTER_BILINEAR: return 1.0f;
+      case JZQ_FILTER_BICUBIC:  return 2.0f;
+      case JZQ_FILTER_LANCZOS:  return 3.0f;
+    }
+    return 0.5f;
+  }
+
+  // Source indices and normalized weights of every output sample along one
+  // axis, numTaps per output; computed once and shared by all rows/columns.
+  // When shrinking, the kernel is stretched to cover the source footprint.
+  struct ResizeWeights
+  {
+    int numTaps;
+    std::vector<int> index;
+    std::vector<float> weight;
+
+    ResizeWeights(int srcSize,int dstSize,int filter)
+    {
+      const float scale = float(dstSize)/float(srcSize);
+      const float stretch = filter==JZQ_FILTER_NEAREST ? 1.0f : std::max(1.0f,1.0f/scale);
+      const float support = filter==JZQ_FILTER_NEAREST ? 0.0f : resizeKernelRadius(filter)*stretch;
+
+      numTaps = filter==JZQ_FILTER_NEAREST ? 1 : int(std::ceil(2.0f*support))+1;
+      index.resize(size_t(dstSize)*numTaps);
+      weight.resize(size_t(dstSize)*numTaps);
+
+      for(int x=0;x<dstSize;x++)
+      {
+        const float center = (float(x)+0.5f)/scale-0.5f;
+        int* idx = &index[size_t(x)*numTaps];
+        float* wgt = &weight[size_t(x)*numTaps];
+
+        if (filter==JZQ_FILTER_NEAREST)
+        {
+          idx[0] = std::min(std::max(int(std::floor(center+0.5f)),0),srcSize-1);
+          wgt[0] = 1.0f;
+          continue;
+        }
+
+        const int first = int(std::floor(center-support))+1;
+        float sum = 0.0f;
+        for(int t=0;t<numTaps;t++)
+        {
+          idx[t] = std::min(std::max(first+t,0),srcSize-1);
+          wgt[t] = resizeKernel((float(first+t)-center)/stretch,filter);
+          sum += wgt[t];
+        }
+
+        if (sum==0.0f)
+        {
+          const int nearest = std::min(std::max(int(std::floor(center+0.5f)),first),first+numTaps-1);
+          for(int t=0;t<numTaps;t++) { wgt[t] = (first+t)==nearest ? 1.0f : 0.0f; }
+        }
+        else
+        {
+          for(int t=0;t<numTaps;t++) { wgt[t] /= sum; }
+        }
+      }
+    }
+  };
 }
 
-template<int N,typename T>
-Vec<N,T>::Vec(T v0,T v1)
+template<typename T>
+Array2<T> downsample2x(const Array2<T>& a)
 {
-  assert(N==2);
-  v[0]=v0; v[1]=v1;
+  JZQ_PROFILE_SCOPE("downsample2x");
+  assert(numel(a)>0);
+
+  Array2<T> out((a.width()+1)/2,(a.height()+1)/2);
+
+  jzq_detail::downsample2x(a.data(),a.width(),a.height(),out.data());
+
+  return out;
 }
 
-template<int N,typename T>
-Vec<N,T>::Vec(T v0,T v1,T v2)
+template<typename T>
+Array2<T> resize(const Array2<T>& a,const Vec2i& size,int filter)
 {
-  assert(N==3);
-  v[0]=v0; v[1]=v1; v[2]=v2;
+  JZQ_PROFILE_SCOPE("resize");
+  typedef typename jzq_detail::Filter<T>::type F;
+  typedef typename jzq_detail::Scalar<F>::type W;
+
+  assert(numel(a)>0);
+  assert(size(0)>0 && size(1)>0);
+
+  const int sw = a.width();
+  const int sh = a.height();
+  const int dw = size(0);
+  const int dh = size(1);
+
+  const jzq_detail::ResizeWeights wx(sw,dw,filter);
+  const jzq_detail::ResizeWeights wy(sh,dh,filter);
+
+  Array2<F> tmp(dw,sh);
+
+  parallelFor(sh,[&](int y)
+  {
+    const T* src = a.data()+size_t(y)*sw;
+    F* dst = tmp.data()+size_t(y)*dw;
+
+    for(int x=0;x<dw;x++)
+    {
+      const int* idx = &wx.index[size_t(x)*wx.numTaps];
+      const float* wgt = &wx.weight[size_t(x)*wx.numTaps];
+
+      F acc = zero<F>::value();
+      for(int t=0;t<wx.numTaps;t++) { acc += F(src[idx[t]])*W(wgt[t]); }
+      dst[x] = acc;
+    }
+  });
+
+  Array2<T> out(dw,dh);
+
+  jzq_detail::parallelForRange(dh,[&](int begin,int end)
+  {
+    std::vector<F> acc(dw);
+
+    for(int y=begin;y<end;y++)
+    {
+      const int* idx = &wy.index[size_t(y)*wy.numTaps];
+      const float* wgt = &wy.weight[size_t(y)*wy.numTaps];
+
+      for(int x=0;x<dw;x++) { acc[x] = zero<F>::value(); }
+
+      for(int t=0;t<wy.numTaps;t++)
+      {
+        const W w = W(wgt[t]);
+        if (w==W(0)) { continue; }
+        const F* row = tmp.data()+size_t(idx[t])*dw;
+        for(int x=0;x<dw;x++) { acc[x] += row[x]*w; }
+      }
+
+      T* dst = out.data()+size_t(y)*dw;
+      for(int x=0;x<dw;x++) { dst[x] = jzq_detail::Saturate<T>::cast(acc[x]); }
+    }
+  });
+
+  return out;
 }
 
-template<int N,typename T>
-Vec<N,T>::Vec(T v0,T v1,T v2,T v3)
-{
-  assert(N==4);
-  v[0]=v0; v[1]=v1; v[2]=v2; v[3]=v3;
-}
+template<typename T>
+Pyramid<T>::Pyramid() {}
 
-template<int N,typename T>
-Vec<N,T>::Vec(T v0,T v1,T v2,T v3,T v4)
+template<typename T>
+Pyramid<T>::Pyramid(const Array2<T>& a,int numLevels)
 {
-  assert(N==5);
-  v[0]=v0; v[1]=v1; v[2]=v2; v[3]=v3; v[4]=v4;
-}
+  assert(numel(a)>0);
 
-template<int N,typename T>
-Vec<N,T>::Vec(T v0,T v1,T v2,T v3,T v4,T v5)
-{
-  assert(N==6);
-  v[0]=v0; v[1]=v1; v[2]=v2; v[3]=v3; v[4]=v4; v[5]=v5;
-}
+  Vec2i s = a.size();
+  size_t total = 0;
 
-template<int N,typename T> template<typename T2>
-Vec<N,T>::Vec(const Vec<N,T2>& u)
-{
-  for(int i=0;i<N;i++)
+  while(1)
   {
-    v[i] = static_cast<T>(u.v[i]);
+    sizes.push_back(s);
+    offsets.push_back(total);
+    total += size_t(s(0))*s(1);
+
+    if ((numLevels>0 && int(sizes.size())==numLevels) || (s(0)==1 && s(1)==1)) { break; }
+
+    s = Vec2i((s(0)+1)/2,(s(1)+1)/2);
   }
-}
 
-template<int N,typename T>
-T& Vec<N,T>::operator()(int i)
-{
-  assert(i>=0 && i<N);
-  return v[i];
-}
+  d.resize(total);
+  std::copy(a.data(),a.data()+a.numel(),d.begin());
 
-template<int N,typename T>
-const T& Vec<N,T>::operator()(int i) const
-{
-  assert(i>=0 && i<N);
-  return v[i];
+  for(int l=1;l<int(sizes.size());l++)
+  {
+    jzq_detail::downsample2x(data(l-1),width(l-1),height(l-1),data(l));
+  }
 }
 
-template<int N,typename T>
-T& Vec<N,T>::operator[](int i)
+template<typename T>
+int Pyramid<T>::numLevels() const
 {
-  assert(i>=0 && i<N);
-  return v[i];
+  return int(sizes.size());
 }
 
-template<int N,typename T>
-const T& Vec<N,T>::operator[](int i) const
+template<typename T>
+Vec2i Pyramid<T>::size(int level) const
 {
-  assert(i>=0 && i<N);
-  return v[i];
+  assert(level>=0 && level<numLevels());
+  return sizes[level];
 }
 
-template<int N,typename T>
-Vec<N,T> Vec<N,T>::operator*=(const Vec<N,T>& u)
+template<typename T>
+int Pyramid<T>::width(int level) const
 {
-  for(int i=0;i<N;i++) v[i]*=u(i);
-  return *this;
+  return size(level)(0);
 }
 
-template<int N,typename T>
-Vec<N,T> Vec<N,T>::operator+=(const Vec<N,T>& u)
+template<typename T>
+int Pyramid<T>::height(int level) const
 {
-  for(int i=0;i<N;i++) v[i]+=u(i);
-  return *this;
+  return size(level)(1);
 }
 
-template<int N,typename T>
-Vec<N,T> Vec<N,T>::operator*=(T s)
+template<typename T>
+T* Pyramid<T>::data(int level)
 {
-  for(int i=0;i<N;i++) v[i]*=s;
-  return *this;
+  assert(level>=0 && level<numLevels());
+  return &d[offsets[level]];
 }
 
-template<int N,typename T>
-Vec<N,T> Vec<N,T>::operator+=(T s)
+template<typename T>
+const T* Pyramid<T>::data(int level) const
 {
-  for(int i=0;i<N;i++) v[i]+=s;
-  return *this;
+  assert(level>=0 && level<numLevels());
+  return &d[offsets[level]];
 }
 
-template<int N,typename T>
-Vec<N,T> operator-(const Vec<N,T>& u)
+template<typename T>
+Array2<T> Pyramid<T>::level(int level) const
 {
-  Vec<N,T> r;
-  for(int i=0;i<N;i++) r(i)=-u(i);
-  return r;
+  Array2<T> A(size(level));
+  std::copy(data(level),data(level)+A.numel(),A.data());
+  return A;
 }
 
-template<int N,typename T>
-Vec<N,T> operator+(const Vec<N,T>& u,const Vec<N,T>& v)
+template<typename T>
+inline T& Pyramid<T>::operator()(int level,int i,int j)
 {
-  Vec<N,T> r;
-  for(int i=0;i<N;i++) r(i)=u(i)+v(i);
-  return r;
-}
+  assert(i>=0 && i<width(level) &&
+         j>=0 && j<height(level));
 
-template<int N,typename T>
-Vec<N,T> operator-(const Vec<N,T>& u,const Vec<N,T>& v)
-{
-  Vec<N,T> r;
-  for(int i=0;i<N;i++) r(i)=u(i)-v(i);
-  return r;
+  return data(level)[i+j*width(level)];
 }
 
-template<int N,typename T>
-Vec<N,T> operator-(const Vec<N,T>& u,const T v)
+template<typename T>
+inline const T& Pyramid<T>::operator()(int level,int i,int j) const
 {
-  Vec<N,T> r;
-  for(int i=0;i<N;i++) r(i)=u(i)-v;
-  return r;
-}
+  assert(i>=0 && i<width(level) &&
+         j>=0 && j<height(level));
 
-template<int N,typename T>
-Vec<N,T> operator*(const Vec<N,T>& u,const Vec<N,T>& v)
-{
-  Vec<N,T> r;
-  for(int i=0;i<N;i++) r(i)=u(i)*v(i);
-  return r;
+  return data(level)[i+j*width(level)];
 }
 
-template<int N,typename T>
-Vec<N,T> operator/(const Vec<N,T>& u,const Vec<N,T>& v)
+namespace jzq_detail
 {
-  Vec<N,T> r;
-  for(int i=0;i<N;i++) r(i)=u(i)/v(i);
-  return r;
-}
+  // Beyond 2^22 a float no longer resolves half a pixel, so coordinates are
+  // kept inside that range before they are converted to int. NaN counts as
+  // lying beyond the low end.
+  const float sampleLimit = 4194304.0f;
 
-template<int N,typename T>
-Vec<N,T> operator*(const T s,const Vec<N,T>& u)
-{
-  Vec<N,T> r;
-  for(int i=0;i<N;i++) r(i)=s*u(i);
-  return r;
-}
+  inline float clampSampleCoord(float v)
+  {
+    return v<sampleLimit ? (v>-sampleLimit ? v : -sampleLimit) : (v==v ? sampleLimit : -sampleLimit);
+  }
 
-template<int N,typename T>
-Vec<N,T> operator*(const Vec<N,T>& u,const T s)
-{
-  Vec<N,T> r;
-  for(int i=0;i<N;i++) r(i)=u(i)*s;
-  return r;
-}
+  // Samples a at (x,y), where element (i,j) sits at integer coordinates.
+  // The taps are read straight from the row pointers when the whole
+  // footprint lies inside the array; only samples near the border go
+  // through borderIndex. Non-finite and huge coordinates lie outside: zero
+  // with JZQ_BORDER_ZERO, otherwise clamped to +-2^22 and resolved by the border.
+  template<int FILTER,typename T>
+  inline typename Filter<T>::type sampleAt(const Array2<T>& a,float x,float y,int border)
+  {
+    typedef typename Filter<T>::type F;
+    typedef typename Scalar<F>::type W;
 
-template<int N,typename T>
-Vec<N,T> operator/(const Vec<N,T>& u,const T s)
-{
-  Vec<N,T> r;
-  for(int i=0;i<N;i++) r(i)=u(i)/s;
-  return r;
-}
+    const int w = a.width();
+    const int h = a.height();
 
-template<int N,typename T>
-Vec<N,bool> operator<(const Vec<N,T>& u,const Vec<N,T>& v)
-{
-  Vec<N,bool> r;
-  for(int i=0;i<N;i++) r(i)=u(i)<v(i);
-  return r;
-}
+    if (!(std::fabs(x)<sampleLimit && std::fabs(y)<sampleLimit))
+    {
+      if (border==JZQ_BORDER_ZERO) { return zero<F>::value(); }
+      x = clampSampleCoord(x);
+      y = clampSampleCoord(y);
+    }
 
-template<int N,typename T>
-Vec<N,bool> operator>(const Vec<N,T>& u,const Vec<N,T>& v)
-{
-  Vec<N,bool> r;
-  for(int i=0;i<N;i++) r(i)=u(i)>v(i);
-  return r;
+    if (FILTER==JZQ_FILTER_NEAREST || FILTER==JZQ_FILTER_BOX)
+    {
+      const int i = borderIndex(int(std::floor(x+0.5f)),w,border);
+      const int j = borderIndex(int(std::floor(y+0.5f)),h,border);
+      return (i<0 || j<0) ? zero<F>::value() : F(a.data()[size_t(j)*w+i]);
+    }
+
+    const int R = FILTER==JZQ_FILTER_BILINEAR ? 1 : FILTER==JZQ_FILTER_BICUBIC ? 2 : 3;
+
+    const int x0 = int(std::floor(x))-R+1;
+    const int y0 = int(std::floor(y))-R+1;
+
+    W wx[2*R];
+    W wy[2*R];
+    W sx = W(0);
+    W sy = W(0);
+    for(int t=0;t<2*R;t++)
+    {
+      wx[t] = W(resizeKernel(x-float(x0+t),FILTER)); sx += wx[t];
+      wy[t] = W(resizeKernel(y-float(y0+t),FILTER)); sy += wy[t];
+    }
+    if (FILTER==JZQ_FILTER_LANCZOS)
+    {
+      for(int t=0;t<2*R;t++) { wx[t] /= sx; wy[t] /= sy; }
+    }
+
+    F acc = zero<F>::value();
+
+    if (x0>=0 && y0>=0 && x0+2*R<=w && y0+2*R<=h)
+    {
+      for(int j=0;j<2*R;j++)
+      {
+        const T* row = a.data()+size_t(y0+j)*w+x0;
+        F racc = zero<F>::value();
+        for(int i=0;i<2*R;i++) { racc += F(row[i])*wx[i]; }
+        acc += racc*wy[j];
+      }
+    }
+    else
+    {
+      int ix[2*R];
+      for(int i=0;i<2*R;i++) { ix[i] = borderIndex(x0+i,w,border); }
+
+      for(int j=0;j<2*R;j++)
+      {
+        const int iy = borderIndex(y0+j,h,border);
+        if (iy<0) { continue; }
+        const T* row = a.data()+size_t(iy)*w;
+        F racc = zero<F>::value();
+        for(int i=0;i<2*R;i++) { if (ix[i]>=0) { racc += F(row[ix[i]])*wx[i]; } }
+        acc += racc*wy[j];
+      }
+    }
+
+    return acc;
+  }
+
+  // Fills out row by row: rowCoords(y,xs,ys) writes the source coordinates
+  // of the whole output row, then the row is sampled with a filter fixed at
+  // compile time.
+  template<int FILTER,typename T,typename C>
+  void resampleRows(const Array2<T>& a,Array2<T>* out,int border,C rowCoords)
+  {
+    const int w = out->width();
+
+    parallelForRange(out->height(),[&](int begin,int end)
+    {
+      std::vector<float> xs(w);
+      std::vector<float> ys(w);
+
+      for(int y=begin;y<end;y++)
+      {
+        rowCoords(y,&xs[0],&ys[0]);
+        T* row = out->data()+size_t(y)*w;
+        for(int x=0;x<w;x++) { row[x] = Saturate<T>::cast(sampleAt<FILTER>(a,xs[x],ys[x],border)); }
+      }
+    });
+  }
+
+  template<typename T,typename C>
+  void resample(const Array2<T>& a,Array2<T>* out,int filter,int border,C rowCoords)
+  {
+    switch(filter)
+    {
+      case JZQ_FILTER_NEAREST:
+      case JZQ_FILTER_BOX:      resampleRows<JZQ_FILTER_NEAREST>(a,out,border,rowCoords);  break;
+      case JZQ_FILTER_BICUBIC:  resampleRows<JZQ_FILTER_BICUBIC>(a,out,border,rowCoords);  break;
+      case JZQ_FILTER_LANCZOS:  resampleRows<JZQ_FILTER_LANCZOS>(a,out,border,rowCoords);  break;
+      default:                  resampleRows<JZQ_FILTER_BILINEAR>(a,out,border,rowCoords); break;
+    }
+  }
 }
 
-template<int N,typename T>
-Vec<N,bool> operator<=(const Vec<N,T>& u,const Vec<N,T>& v)
+template<typename T>
+T sample(const Array2<T>& a,const Vec2f& xy,int filter,int border)
 {
-  Vec<N,bool> r;
-  for(int i=0;i<N;i++) r(i)=u(i)<=v(i);
-  return r;
+  assert(numel(a)>0);
+
+  switch(filter)
+  {
+    case JZQ_FILTER_NEAREST:
+    case JZQ_FILTER_BOX:     return jzq_detail::Saturate<T>::cast(jzq_detail::sampleAt<JZQ_FILTER_NEAREST>(a,xy(0),xy(1),border));
+    case JZQ_FILTER_BICUBIC: return jzq_detail::Saturate<T>::cast(jzq_detail::sampleAt<JZQ_FILTER_BICUBIC>(a,xy(0),xy(1),border));
+    case JZQ_FILTER_LANCZOS: return jzq_detail::Saturate<T>::cast(jzq_detail::sampleAt<JZQ_FILTER_LANCZOS>(a,xy(0),xy(1),border));
+  }
+
+  return jzq_detail::Saturate<T>::cast(jzq_detail::sampleAt<JZQ_FILTER_BILINEAR>(a,xy(0),xy(1),border));
 }
 
-template<int N,typename T>
-Vec<N,bool> operator>=(const Vec<N,T>& u,const Vec<N,T>& v)
+template<typename T>
+Array2<T> remap(const Array2<T>& a,const Array2<Vec2f>& coords,int filter,int border)
 {
-  Vec<N,bool> r;
-  for(int i=0;i<N;i++) r(i)=u(i)>=v(i);
-  return r;
+  JZQ_PROFILE_SCOPE("remap");
+  assert(numel(a)>0 && numel(coords)>0);
+
+  Array2<T> out(size(coords));
+
+  jzq_detail::resample(a,&out,filter,border,[&](int y,float* xs,float* ys)
+  {
+    const Vec2f* c = coords.data()+size_t(y)*coords.width();
+    for(int x=0;x<coords.width();x++) { xs[x] = c[x].v[0]; ys[x] = c[x].v[1]; }
+  });
+
+  return out;
 }
 
-template<int N,typename T>
-Vec<N,bool> operator==(const Vec<N,T>& u,const Vec<N,T>& v)
+template<typename T>
+Array2<T> warp(const Array2<T>& a,const Array2<Vec2f>& flow,int filter,int border)
 {
-  Vec<N,bool> r;
-  for(int i=0;i<N;i++) r(i) = (u(i)==v(i));
-  return r;
+  JZQ_PROFILE_SCOPE("warp");
+  assert(numel(a)>0 && numel(flow)>0);
+
+  Array2<T> out(size(flow));
+
+  jzq_detail::resample(a,&out,filter,border,[&](int y,float* xs,float* ys)
+  {
+    const Vec2f* f = flow.data()+size_t(y)*flow.width();
+    for(int x=0;x<flow.width();x++) { xs[x] = float(x)+f[x].v[0]; ys[x] = float(y)+f[x].v[1]; }
+  });
+
+  return out;
 }
 
-template<int N,typename T>
-Vec<N,bool> operator!=(const Vec<N,T>& u,const Vec<N,T>& v)
+// H maps homogeneous output coordinates (x,y,1) to source coordinates.
+// Points that H maps to w<=0 lie behind the projection and are sampled as
+// outside the source.
+template<typename T>
+Array2<T> warpPerspective(const Array2<T>& a,const Mat3x3f& H,const Vec2i& size,int filter,int border)
 {
-  Vec<N,bool> r;
-  for(int i=0;i<N;i++) r(i) = (u(i)!=v(i));
-  return r;
+  JZQ_PROFILE_SCOPE("warpPerspective");
+  assert(numel(a)>0);
+  assert(size(0)>0 && size(1)>0);
+
+  Array2<T> out(size);
+
+  jzq_detail::resample(a,&out,filter,border,[&](int y,float* xs,float* ys)
+  {
+    // along a row the homogeneous source point moves by the first column of H
+    const float px = H(0,1)*float(y)+H(0,2);
+    const float py = H(1,1)*float(y)+H(1,2);
+    const float pz = H(2,1)*float(y)+H(2,2);
+
+    for(int x=0;x<size(0);x++)
+    {
+      const float z = pz+H(2,0)*float(x);
+      const float iz = z>0.0f ? 1.0f/z : std::numeric_limits<float>::quiet_NaN();
+      xs[x] = (px+H(0,0)*float(x))*iz;
+      ys[x] = (py+H(1,0)*float(x))*iz;
+    }
+  });
+
+  return out;
 }
 
-template<int N,typename T>
-inline Vec<N,T> lerp(const Vec<N,T>& a,const Vec<N,T>& b,const T& t)
+namespace jzq_detail
 {
-  return (T(1)-t)*a+t*b;
+  const int transposeTile = 32;
+  const int transposeMicro = 8;
+
+  // Copies src (w x h) so that src(i,j) lands at dst[base+j*stepX+i*stepY].
+  // Transpose and both quarter turns are this copy with different steps.
+  // The array is walked in cache-sized tiles, and each tile in 8x8 blocks
+  // with constant trip counts that the compiler fully unrolls.
+  template<typename T>
+  void transposeCopy(const T* src,int w,int h,T* dst,ptrdiff_t base,ptrdiff_t stepX,ptrdiff_t stepY)
+  {
+    const int numTilesX = (w+transposeTile-1)/transposeTile;
+    const int numTilesY = (h+transposeTile-1)/transposeTile;
+
+    parallelFor(numTilesX*numTilesY,[&](int tile)
+    {
+      const int i0 = (tile%numTilesX)*transposeTile;
+      const int j0 = (tile/numTilesX)*transposeTile;
+      const int i1 = std::min(i0+transposeTile,w);
+      const int j1 = std::min(j0+transposeTile,h);
+
+      for(int jb=j0;jb<j1;jb+=transposeMicro)
+      for(int ib=i0;ib<i1;ib+=transposeMicro)
+      {
+        if (ib+transposeMicro<=i1 && jb+transposeMicro<=j1)
+        {
+          for(int i=0;i<transposeMicro;i++)
+          for(int j=0;j<transposeMicro;j++)
+          {
+            dst[base+(jb+j)*stepX+(ib+i)*stepY] = src[(ib+i)+size_t(jb+j)*w];
+          }
+        }
+        else
+        {
+          for(int i=ib;i<std::min(ib+transposeMicro,i1);i++)
+          for(int j=jb;j<std::min(jb+transposeMicro,j1);j++)
+          {
+            dst[base+j*stepX+i*stepY] = src[i+size_t(j)*w];
+          }
+        }
+      }
+    });
+  }
+
+  // Square in-place transpose: each tile above the diagonal is swapped with
+  // its mirror tile, diagonal tiles swap their own upper and lower halves.
+  template<typename T>
+  void transposeSquare(T* d,int n)
+  {
+    const int numTiles = (n+transposeTile-1)/transposeTile;
+
+    parallelFor(numTiles,[&](int tj)
+    {
+      const int j0 = tj*transposeTile;
+      const int j1 = std::min(j0+transposeTile,n);
+
+      for(int ti=tj;ti<numTiles;ti++)
+      {
+        const int i0 = ti*transposeTile;
+        const int i1 = std::min(i0+transposeTile,n);
+
+        for(int j=j0;j<j1;j++)
+        for(int i=(ti==tj ? j+1 : i0);i<i1;i++)
+        {
+          std::swap(d[i+size_t(j)*n],d[j+size_t(i)*n]);
+        }
+      }
+    });
+  }
 }
 
-template<int N,typename T>
-inline T dot(const Vec<N,T>& u,const Vec<N,T>& v)
+template<typename T>
+Array2<T> transpose(const Array2<T>& a)
 {
-  assert(N>0);
-  T sumprod = u(0)*v(0);
-  for(int i=1;i<N;i++) sumprod += u(i)*v(i);
-  return sumprod;
+  JZQ_PROFILE_SCOPE("transpose");
+  assert(numel(a)>0);
+
+  Array2<T> out(a.height(),a.width());
+
+  jzq_detail::transposeCopy(a.data(),a.width(),a.height(),out.data(),0,1,a.height());
+
+  return out;
 }
 
 template<typename T>
-inline T cross(const Vec<2,T> &a,const Vec<2,T> &b)
+void transpose(Array2<T>* a)
 {
-  return a[0]*b[1]-a[1]*b[0];
+  JZQ_PROFILE_SCOPE("transpose");
+  assert(a!=0);
+  assert(a->numel()>0);
+
+  if (a->width()==a->height())
+  {
+    jzq_detail::transposeSquare(a->data(),a->width());
+  }
+  else
+  {
+    Array2<T> t = transpose(*a);
+    a->swap(t);
+  }
 }
 
 template<typename T>
-inline Vec<3,T> cross(const Vec<3,T> &a,const Vec<3,T> &b)
+Array2<T> flipX(const Array2<T>& a)
 {
-  return Vec<3,T>(a[1]*b[2]-a[2]*b[1],
-                  a[2]*b[0]-a[0]*b[2],
-                  a[0]*b[1]-a[1]*b[0]);
-}
+  JZQ_PROFILE_SCOPE("flipX");
+  assert(numel(a)>0);
 
-template<int N,typename T>
-inline T norm(const Vec<N,T>& u)
-{
-  return std::sqrt(dot(u,u));
+  const int w = a.width();
+  Array2<T> out(size(a));
+
+  parallelFor(a.height(),[&](int y)
+  {
+    const T* src = a.data()+size_t(y)*w;
+    T* dst = out.data()+size_t(y)*w;
+    for(int x=0;x<w;x++) { dst[x] = src[w-1-x]; }
+  });
+
+  return out;
 }
 
-template<int N,typename T>
-inline Vec<N,T> normalize(const Vec<N,T>& u)
+template<typename T>
+void flipX(Array2<T>* a)
 {
-  return u/norm(u);
+  JZQ_PROFILE_SCOPE("flipX");
+  assert(a!=0);
+  assert(a->numel()>0);
+
+  const int w = a->width();
+
+  parallelFor(a->height(),[&](int y)
+  {
+    T* row = a->data()+size_t(y)*w;
+    std::reverse(row,row+w);
+  });
 }
 
-template<int N>
-inline bool any(const Vec<N,bool>& u)
+template<typename T>
+Array2<T> flipY(const Array2<T>& a)
 {
-  for(int i=0;i<N;i++)
+  JZQ_PROFILE_SCOPE("flipY");
+  assert(numel(a)>0);
+
+  const int w = a.width();
+  const int h = a.height();
+  Array2<T> out(size(a));
+
+  parallelFor(h,[&](int y)
   {
-    if (u(i)==true) return true;
-  }
-  return false;
+    const T* src = a.data()+size_t(h-1-y)*w;
+    std::copy(src,src+w,out.data()+size_t(y)*w);
+  });
+
+  return out;
 }
 
-template<int N>
-inline bool all(const Vec<N,bool>& u)
+template<typename T>
+void flipY(Array2<T>* a)
 {
-  for(int i=0;i<N;i++)
+  JZQ_PROFILE_SCOPE("flipY");
+  assert(a!=0);
+  assert(a->numel()>0);
+
+  const int w = a->width();
+  const int h = a->height();
+
+  parallelFor(h/2,[&](int y)
   {
-    if (u(i)==false) return false;
-  }
-  return true;
+    T* top = a->data()+size_t(y)*w;
+    std::swap_ranges(top,top+w,a->data()+size_t(h-1-y)*w);
+  });
 }
 
-template<int N,typename T>
-inline T min(const Vec<N,T>& u)
+// Rotates by k quarter turns; for k=1 element (i,j) moves to (j,width-1-i).
+template<typename T>
+Array2<T> rot90(const Array2<T>& a,int k)
 {
-  assert(N>0);
+  JZQ_PROFILE_SCOPE("rot90");
+  assert(numel(a)>0);
 
-  T minval = u(0);
+  const int w = a.width();
+  const int h = a.height();
 
-  for(int i=1;i<N;i++)
+  switch(((k%4)+4)%4)
   {
-   if (u(i) < minval)
-   {
-      minval = u(i);
-   }
+    case 0: return a;
+    case 2:
+    {
+      Array2<T> out(w,h);
+      const T* src = a.data();
+      T* dst = out.data();
+      const size_t n = size_t(w)*h;
+      parallelFor(h,[&](int y)
+      {
+        for(int x=0;x<w;x++) { dst[n-1-(size_t(y)*w+x)] = src[size_t(y)*w+x]; }
+      });
+      return out;
+    }
+    case 1:
+    {
+      Array2<T> out(h,w);
+      jzq_detail::transposeCopy(a.data(),w,h,out.data(),ptrdiff_t(w-1)*h,1,-ptrdiff_t(h));
+      return out;
+    }
+    default:
+    {
+      Array2<T> out(h,w);
+      jzq_detail::transposeCopy(a.data(),w,h,out.data(),ptrdiff_t(h-1),-1,ptrdiff_t(h));
+      return out;
+    }
   }
-
-  return minval;
 }
 
-template<int N,typename T>
-inline T max(const Vec<N,T>& u)
+template<typename T>
+void rot90(Array2<T>* a,int k)
 {
-  assert(N>0);
-
-  T maxval = u(0);
+  JZQ_PROFILE_SCOPE("rot90");
+  assert(a!=0);
+  assert(a->numel()>0);
 
-  for(int i=1;i<N;i++)
+  switch(((k%4)+4)%4)
   {
-   if (u(i) > maxval)
-   {
-      maxval = u(i);
-   }
+    case 0: return;
+    case 2: flipX(a); flipY(a); return;
   }
 
-  return maxval;
+  if (a->width()==a->height())
+  {
+    transpose(a);
+    if (((k%4)+4)%4==1) { flipY(a); } else { flipX(a); }
+  }
+  else
+  {
+    Array2<T> r = rot90(*a,k);
+    a->swap(r);
+  }
 }
 
-template<int N,typename T>
-inline T sum(const Vec<N,T>& u)
+namespace jzq_detail
 {
-  assert(N>0);
+  // Felzenszwalb-Huttenlocher: squared distance along one line as the lower
+  // envelope of the parabolas rooted at every finite sample. Infinite samples
+  // never enter the envelope; a line without any stays infinite with arg -1.
+  inline void edt1d(const double* f,int n,double* d,int* arg,int* v,double* z)
+  {
+    const double inf = std::numeric_limits<double>::infinity();
 
-  T sumval = u(0);
+    int k = -1;
+    for(int q=0;q<n;q++)
+    {
+      if (f[q]==inf) { continue; }
 
-  for(int i=1;i<N;i++)
-  {
-    sumval += u(i);
+      if (k<0) { k = 0; v[0] = q; z[0] = -inf; z[1] = inf; continue; }
+
+      double s;
+      while(1)
+      {
+        const int p = v[k];
+        s = ((f[q]+double(q)*q)-(f[p]+double(p)*p))/(2.0*(q-p));
+        if (s>z[k]) { break; }
+        k--;
+      }
+
+      k++;
+      v[k] = q;
+      z[k] = s;
+      z[k+1] = inf;
+    }
+
+    if (k<0)
+    {
+      for(int q=0;q<n;q++) { d[q] = inf; arg[q] = -1; }
+      return;
+    }
+
+    k = 0;
+    for(int q=0;q<n;q++)
+    {
+      while(z[k+1]<q) { k++; }
+      d[q] = double(q-v[k])*(q-v[k])+f[v[k]];
+      arg[q] = v[k];
+    }
   }
 
-  return sumval;
+  // Runs edt1d over numLines lines of n samples, line l starting at
+  // lineStart(l) with the given stride; lines are gathered into contiguous
+  // buffers so the envelope pass never touches strided memory.
+  template<typename L>
+  void edtLines(double* d,int* arg,int n,ptrdiff_t stride,int numLines,L lineStart)
+  {
+    parallelForRange(numLines,[&](int begin,int end)
+    {
+      std::vector<double> f(n);
+      std::vector<double> out(n);
+      std::vector<int> a(n);
+      std::vector<int> v(n);
+      std::vector<double> z(n+1);
+
+      for(int l=begin;l<end;l++)
+      {
+        const ptrdiff_t start = lineStart(l);
+
+        for(int q=0;q<n;q++) { f[q] = d[start+q*stride]; }
+        edt1d(&f[0],n,&out[0],&a[0],&v[0],&z[0]);
+        for(int q=0;q<n;q++) { d[start+q*stride] = out[q]; }
+        if (arg) { for(int q=0;q<n;q++) { arg[start+q*stride] = a[q]; } }
+      }
+    });
+  }
 }
 
-namespace std
-{
-template<int N,typename T> Vec<N,T>
-inline min(const Vec<N,T>& u,const Vec<N,T>& v)
+// Exact Euclidean distance from every element to the nearest non-zero element
+// of mask, in linear time. Optionally also returns the coordinates of that
+// element; with no non-zero elements distances are infinite and coordinates -1.
+template<typename T>
+Array2<float> distanceTransform(const Array2<T>& mask,Array2<Vec2i>* out_nearest)
 {
-  assert(N>0);
+  JZQ_PROFILE_SCOPE("distanceTransform");
+  assert(numel(mask)>0);
 
-  Vec<N,T> w;
+  const int w = mask.width();
+  const int h = mask.height();
+  const size_t n = size_t(w)*h;
 
-  for(int i=0;i<N;i++)
+  std::vector<double> d(n);
+  for(size_t i=0;i<n;i++) { d[i] = mask.data()[i]!=T(0) ? 0.0 : std::numeric_limits<double>::infinity(); }
+
+  std::vector<int> argX(out_nearest ? n : 0);
+  std::vector<int> argY(out_nearest ? n : 0);
+
+  jzq_detail::edtLines(&d[0],out_nearest ? &argX[0] : 0,w,1,h,[&](int y) { return ptrdiff_t(y)*w; });
+  jzq_detail::edtLines(&d[0],out_nearest ? &argY[0] : 0,h,w,w,[&](int x) { return ptrdiff_t(x); });
+
+  Array2<float> dist(w,h);
+  for(size_t i=0;i<n;i++) { dist.data()[i] = float(std::sqrt(d[i])); }
+
+  if (out_nearest)
   {
-    w(i) = std::min(u(i),v(i));
+    if (any(out_nearest->size()!=mask.size())) { Array2<Vec2i>(mask.size()).swap(*out_nearest); }
+
+    parallelFor(h,[&](int y)
+    {
+      for(int x=0;x<w;x++)
+      {
+        const int ny = argY[size_t(y)*w+x];
+        (*out_nearest)(x,y) = ny<0 ? Vec2i(-1,-1) : Vec2i(argX[size_t(ny)*w+x],ny);
+      }
+    });
   }
 
-  return w;
+  return dist;
 }
 
-template<int N,typename T> Vec<N,T>
-inline max(const Vec<N,T>& u,const Vec<N,T>& v)
+template<typename T>
+Array3<float> distanceTransform(const Array3<T>& mask,Array3<Vec3i>* out_nearest)
 {
-  assert(N>0);
+  JZQ_PROFILE_SCOPE("distanceTransform");
+  assert(numel(mask)>0);
 
-  Vec<N,T> w;
+  const int w = mask.width();
+  const int h = mask.height();
+  const int dp = mask.depth();
+  const size_t slice = size_t(w)*h;
+  const size_t n = slice*dp;
 
-  for(int i=0;i<N;i++)
+  std::vector<double> d(n);
+  for(size_t i=0;i<n;i++) { d[i] = mask.data()[i]!=T(0) ? 0.0 : std::numeric_limits<double>::infinity(); }
+
+  std::vector<int> argX(out_nearest ? n : 0);
+  std::vector<int> argY(out_nearest ? n : 0);
+  std::vector<int> argZ(out_nearest ? n : 0);
+
+  jzq_detail::edtLines(&d[0],out_nearest ? &argX[0] : 0,w,1,h*dp,[&](int yz) { return ptrdiff_t(yz)*w; });
+  jzq_detail::edtLines(&d[0],out_nearest ? &argY[0] : 0,h,w,w*dp,[&](int xz) { return ptrdiff_t(xz%w)+ptrdiff_t(xz/w)*ptrdiff_t(slice); });
+  jzq_detail::edtLines(&d[0],out_nearest ? &argZ[0] : 0,dp,ptrdiff_t(slice),int(slice),[&](int xy) { return ptrdiff_t(xy); });
+
+  Array3<float> dist(w,h,dp);
+  for(size_t i=0;i<n;i++) { dist.data()[i] = float(std::sqrt(d[i])); }
+
+  if (out_nearest)
   {
-    w(i) = std::max(u(i),v(i));
+    if (any(out_nearest->size()!=mask.size())) { Array3<Vec3i>(mask.size()).swap(*out_nearest); }
+
+    parallelFor(h*dp,[&](int yz)
+    {
+      const int y = yz%h;
+      const int z = yz/h;
+      for(int x=0;x<w;x++)
+      {
+        const int nz = argZ[size_t(yz)*w+x];
+        if (nz<0) { (*out_nearest)(x,y,z) = Vec3i(-1,-1,-1); continue; }
+        const int ny = argY[size_t(nz)*slice+size_t(y)*w+x];
+        const int nx = argX[size_t(nz)*slice+size_t(ny)*w+x];
+        (*out_nearest)(x,y,z) = Vec3i(nx,ny,nz);
+      }
+    });
   }
 
-  return w;
+  return dist;
 }
 
-template<int N,typename T> Vec<N,T>
-inline abs(const Vec<N,T>& x)
+namespace jzq_detail
 {
-  Vec<N,T> out;
-  for(int i=0;i<N;i++) out(i) = abs(x(i));
-  return out;
-}
-}
+  template<typename T>
+  struct Histogram
+  {
+    // Counts channel c of every element into bins over [lo,hi]; values equal
+    // to hi go to the last bin and values outside the range are not counted. Each thread fills a private histogram and the
+    // private histograms are summed at the end.
+    static void count(const Array2<T>& a,int c,int bins,double lo,double hi,int* out)
+    {
+      const int n = a.numel();
+      const double scale = double(bins)/(hi-lo);
+      const int numParts = std::max(std::min(int(std::thread::hardware_concurrency()),n/4096),1);
 
-#define fori(I) for (int i=0;i<(I);i++)
-#define forj(J) for (int j=0;j<(J);j++)
-#define fork(K) for (int k=0;k<(K);k++)
-#define forij(I,J) for (int i=0;i<(I);i++) for (int j=0;j<(J);j++)
+      std::vector<int> partial(size_t(numParts)*bins,0);
 
-template<int M,int N,typename T>
-Mat<M,N,T>::Mat() {}
+      parallelFor(numParts,[&](int part)
+      {
+        int* h = &partial[size_t(part)*bins];
+        const T* d = a.data();
+        const int begin = int((long long)n*part/numParts);
+        const int end = int((long long)n*(part+1)/numParts);
+        for(int i=begin;i<end;i++)
+        {
+          const double v = double(Channels<T>::at(d[i],c));
+          if (!(v>=lo && v<=hi)) { continue; }
+          h[std::min(int((v-lo)*scale),bins-1)]++;
+        }
+      });
+
+      for(int b=0;b<bins;b++) { out[b] = 0; }
+      for(int part=0;part<numParts;part++)
+      for(int b=0;b<bins;b++) { out[b] += partial[size_t(part)*bins+b]; }
+    }
+  };
 
-template<int M,int N,typename T>
-Mat<M,N,T>::Mat(T a00,T a01,
-                T a10,T a11)
-{
-  assert(M==2 && N==2);
+  // 8-bit channels are counted directly into 256 bins. Four interleaved
+  // sub-histograms per thread keep consecutive equal values from stalling on
+  // the same counter.
+  inline void histogram8(const unsigned char* d,int n,int stride,int* out)
+  {
+    const int numParts = std::max(std::min(int(std::thread::hardware_concurrency()),n/65536),1);
 
-  m[0][0] = a00; m[0][1] = a01;
-  m[1][0] = a10; m[1][1] = a11;
-}
+    std::vector<int> partial(size_t(numParts)*4*256,0);
 
-template<int M,int N,typename T>
-Mat<M,N,T>::Mat(T a00,T a01,T a02,
-                T a10,T a11,T a12,
-                T a20,T a21,T a22)
-{
-  assert(M==3 && N==3);
+    parallelFor(numParts,[&](int part)
+    {
+      int* h0 = &partial[size_t(part)*4*256];
+      int* h1 = h0+256;
+      int* h2 = h1+256;
+      int* h3 = h2+256;
+      const int begin = int((long long)n*part/numParts);
+      const int end = int((long long)n*(part+1)/numParts);
+      int i = begin;
+      for(;i+4<=end;i+=4)
+      {
+        h0[d[size_t(i  )*stride]]++;
+        h1[d[size_t(i+1)*stride]]++;
+        h2[d[size_t(i+2)*stride]]++;
+        h3[d[size_t(i+3)*stride]]++;
+      }
+      for(;i<end;i++) { h0[d[size_t(i)*stride]]++; }
+    });
 
-  m[0][0] = a00; m[0][1] = a01; m[0][2] = a02;
-  m[1][0] = a10; m[1][1] = a11; m[1][2] = a12;
-  m[2][0] = a20; m[2][1] = a21; m[2][2] = a22;
-}
+    for(int b=0;b<256;b++) { out[b] = 0; }
+    for(size_t k=0;k<partial.size()/256;k++)
+    for(int b=0;b<256;b++) { out[b] += partial[k*256+b]; }
+  }
 
-template<int M,int N,typename T>
-Mat<M,N,T>::Mat(T a00,T a01,T a02,T a03,
-                T a10,T a11,T a12,T a13,
-                T a20,T a21,T a22,T a23,
-                T a30,T a31,T a32,T a33)
-{
-  assert(M==4 && N==4);
+  template<int N>
+  struct Histogram<Vec<N,unsigned char>>
+  {
+    static void count(const Array2<Vec<N,unsigned char>>& a,int c,int bins,double lo,double hi,int* out)
+    {
+      if (bins==256 && lo==0.0 && hi==256.0) { histogram8(&a.data()->v[c],a.numel(),N,out); return; }
+      countGeneric(a,c,bins,lo,hi,out);
+    }
 
-  m[0][0] = a00; m[0][1] = a01; m[0][2] = a02; m[0][3] = a03;
-  m[1][0] = a10; m[1][1] = a11; m[1][2] = a12; m[1][3] = a13;
-  m[2][0] = a20; m[2][1] = a21; m[2][2] = a22; m[2][3] = a23;
-  m[3][0] = a30; m[3][1] = a31; m[3][2] = a32; m[3][3] = a33;
-}
+    static void countGeneric(const Array2<Vec<N,unsigned char>>& a,int c,int bins,double lo,double hi,int* out)
+    {
+      std::vector<int> direct(256);
+      histogram8(&a.data()->v[c],a.numel(),N,&direct[0]);
+      const double scale = double(bins)/(hi-lo);
+      for(int b=0;b<bins;b++) { out[b] = 0; }
+      for(int v=0;v<256;v++)
+      {
+        if (!(v>=lo && v<=hi)) { continue; }
+        out[std::min(int((v-lo)*scale),bins-1)] += direct[v];
+      }
+    }
+  };
 
-template<int M,int N,typename T>
-T& Mat<M,N,T>::operator()(int i,int j)
-{
-  assert(0<=i && i<M);
-  assert(0<=j && j<N);
-  return m[i][j];
-}
+  template<>
+  struct Histogram<unsigned char>
+  {
+    static void count(const Array2<unsigned char>& a,int,int bins,double lo,double hi,int* out)
+    {
+      std::vector<int> direct(256);
+      histogram8(a.data(),a.numel(),1,&direct[0]);
+      const double scale = double(bins)/(hi-lo);
+      for(int b=0;b<bins;b++) { out[b] = 0; }
+      for(int v=0;v<256;v++)
+      {
+        if (!(v>=lo && v<=hi)) { continue; }
+        out[std::min(int((v-lo)*scale),bins-1)] += direct[v];
+      }
+    }
+  };
+
+  // Nearest-rank quantile q in [0,1] of channel c without sorting the array:
+  // a coarse histogram over [min,max] locates the bin holding the rank, then
+  // only the values in that bin are gathered and partially sorted. NaN and
+  // infinite values are ignored; if there are no finite values the first
+  // element's channel is returned.
+  template<typename T>
+  typename Scalar<T>::type selectRank(const Array2<T>& a,int c,double q)
+  {
+    typedef typename Scalar<T>::type S;
 
-template<int M,int N,typename T>
-const T& Mat<M,N,T>::operator()(int i,int j) const
-{
-  assert(0<=i && i<M);
-  assert(0<=j && j<N);
-  return m[i][j];
-}
+    const int n = a.numel();
+    const T* d = a.data();
+
+    const auto finite = [](S v) { return std::numeric_limits<S>::is_integer || std::isfinite(double(v)); };
+
+    int count = 0;
+    S lo = Channels<T>::at(d[0],c);
+    S hi = lo;
+    for(int i=0;i<n;i++)
+    {
+      const S v = Channels<T>::at(d[i],c);
+      if (!finite(v)) { continue; }
+      if (count==0) { lo = v; hi = v; }
+      lo = v<lo ? v : lo;
+      hi = hi<v ? v : hi;
+      count++;
+    }
+    if (!(lo<hi)) { return lo; }
+
+    const int k = int(std::floor(q*(count-1)+0.5));
+
+    const int bins = 4096;
+    const double scale = double(bins)/(double(hi)-double(lo));
+    const int numParts = std::max(std::min(int(std::thread::hardware_concurrency()),n/4096),1);
 
-template<int M,int N,typename T>
-T* Mat<M,N,T>::data()
-{
-  return (T*)(&m[0][0]);
-}
+    // the maximum lands on index bins, which is folded into the last bin
+    const auto binOf = [&](S v) { return std::min(int((double(v)-double(lo))*scale),bins-1); };
 
-template<int M,int N,typename T>
-const T* Mat<M,N,T>::data() const
-{
-  return (T*)(&m[0][0]);
-}
+    std::vector<int> partial(size_t(numParts)*bins,0);
 
-template<int M1,int N1,int M2,int N2,typename T>
-Mat<M1,N2,T> operator*(const Mat<M1,N1,T>& A,const Mat<M2,N2,T>& B)
-{
-  assert(N1==M2);
-  Mat<M1,N2,T> C;
+    parallelFor(numParts,[&](int part)
+    {
+      int* h = &partial[size_t(part)*bins];
+      const int begin = int((long long)n*part/numParts);
+      const int end = int((long long)n*(part+1)/numParts);
+      for(int i=begin;i<end;i++)
+      {
+        const S v = Channels<T>::at(d[i],c);
+        if (finite(v)) { h[binOf(v)]++; }
+      }
+    });
 
-  fori(M1)
-  forj(N2)
-  {
-    T dot = 0;
-    fork(N1) dot += A(i,k) * B(k,j);
-    C(i,j) = dot;
-  }
+    std::vector<int> h(bins,0);
+    for(int part=0;part<numParts;part++)
+    for(int b=0;b<bins;b++) { h[b] += partial[size_t(part)*bins+b]; }
 
-  return C;
-}
+    int bin = 0;
+    int before = 0;
+    while(before+h[bin]<=k) { before += h[bin]; bin++; }
 
-template<int M,int N,typename T>
-Vec<M,T> operator*(const Mat<M,N,T>& A,const Vec<N,T>& u)
-{
-  Vec<M,T> v;
+    std::vector<S> candidates;
+    candidates.reserve(h[bin]);
+    for(int i=0;i<n;i++)
+    {
+      const S v = Channels<T>::at(d[i],c);
+      if (finite(v) && binOf(v)==bin) { candidates.push_back(v); }
+    }
 
-  fori(M)
-  {
-    T dot = 0;
-    forj(N) dot += A(i,j) * u(j);
-    v(i) = dot;
+    std::nth_element(candidates.begin(),candidates.begin()+(k-before),candidates.end());
+    return candidates[k-before];
   }
-
-  return v;
 }
 
-template<int M,int N,typename T>
-Vec<N,T> operator*(const Vec<M,T>& u,const Mat<M,N,T>& A)
+// Returns counts as an Array2<int> of bins x channels: histogram(b,c) is the
+// number of elements whose channel c falls into bin b of range [min,max].
+// The bins are half-open except the last, which also counts the maximum, so
+// a normalized image binned over (0,1) keeps its pixels at exactly 1.
+template<typename T>
+Array2<int> histogram(const Array2<T>& a,int bins,const Vec2f& range)
 {
-  Vec<N,T> v;
+  JZQ_PROFILE_SCOPE("histogram");
+  assert(numel(a)>0);
+  assert(bins>0 && range(0)<range(1));
 
-  forj(N)
+  const int numChannels = jzq_detail::Channels<T>::count;
+
+  Array2<int> h(bins,numChannels);
+
+  for(int c=0;c<numChannels;c++)
   {
-    T dot = 0;
-    fori(M) dot += A(i,j) * u(i);
-    v(j) = dot;
+    jzq_detail::Histogram<T>::count(a,c,bins,double(range(0)),double(range(1)),&h(0,c));
   }
 
-  return v;
+  return h;
 }
 
-template<int M,int N,typename T>
-Mat<N,M,T> transpose(const Mat<M,N,T>& A)
+// Normalized cumulative distribution of each channel of a histogram.
+inline Array2<float> cdf(const Array2<int>& histogram)
 {
-  Mat<N,M,T> At;
+  assert(numel(histogram)>0);
 
-  forij(N,M) At(i,j) = A(j,i);
+  Array2<float> out(size(histogram));
 
-  return At;
-}
+  for(int c=0;c<histogram.height();c++)
+  {
+    long long total = 0;
+    for(int b=0;b<histogram.width();b++) { total += histogram(b,c); }
 
-#undef fori
-#undef forj
-#undef fork
+    long long running = 0;
+    for(int b=0;b<histogram.width();b++)
+    {
+      running += histogram(b,c);
+      out(b,c) = total>0 ? float(double(running)/double(total)) : 0.0f;
+    }
+  }
 
-template<typename T>
-Array2<T>::Array2() : s(0,0),d(0) {}
+  return out;
+}
 
+// Per-channel value of nearest rank p percent (0 gives the minimum, 100 the
+// maximum). NaN and infinite values, e.g. holes in a depth map, are skipped
+// and the rank is taken among the finite values of each channel.
 template<typename T>
-Array2<T>::Array2(int width,int height)
+T percentile(const Array2<T>& a,float p)
 {
-  assert(width>0 && height>0);
-  s = Vec2i(width,height);
-  d = new T[s(0)*s(1)];
+  JZQ_PROFILE_SCOPE("percentile");
+  assert(numel(a)>0);
+  assert(p>=0.0f && p<=100.0f);
+
+  T out;
+  for(int c=0;c<jzq_detail::Channels<T>::count;c++)
+  {
+    jzq_detail::Channels<T>::at(out,c) = jzq_detail::selectRank(a,c,double(p)/100.0);
+  }
+
+  return out;
 }
 
 template<typename T>
-Array2<T>::Array2(const Vec2i& size)
+T median(const Array2<T>& a)
 {
-  assert(size(0)>0 && size(1)>0);
-  s = size;
-  d = new T[s(0)*s(1)];
+  return percentile(a,50.0f);
 }
 
-template<typename T>
-Array2<T>::Array2(const Array2<T>& a)
+namespace jzq_detail
 {
-  s = a.s;
-
-  if (s(0)>0 && s(1)>0)
+  inline int findRoot(int* parent,int i)
   {
-    d = new T[s(0)*s(1)];
-
-    for(int i=0;i<s(0)*s(1);i++) d[i] = a.d[i];
-  }
-  else
-  {
-    d = 0;
+    int root = i;
+    while(parent[root]!=root) { root = parent[root]; }
+    while(parent[i]!=root) { const int next = parent[i]; parent[i] = root; i = next; }
+    return root;
   }
-}
 
-template<typename T>
-Array2<T>& Array2<T>::operator=(const Array2<T>& a)
-{
-  if (this!=&a)
+  // Two-pass union-find labeling of a w x h x d mask. The rows are split into
+  // one band per thread that is labeled independently; the unions across band
+  // boundaries are then done serially, and the final pass resolves every
+  // element to its root in at most two steps. Labels are 1..N in the raster
+  // order of each component's first element, 0 is background.
+  template<typename T>
+  int labelComponents(const T* mask,int w,int h,int d,int connectivity,int* out_labels)
   {
-    if (s(0)==a.s(0) && s(1)==a.s(1))
+    std::vector<ptrdiff_t> offsets;
+    std::vector<Vec3i> deltas;
+    for(int dz=-1;dz<=0;dz++)
+    for(int dy=-1;dy<=1;dy++)
+    for(int dx=-1;dx<=1;dx++)
     {
-      for(int i=0;i<s(0)*s(1);i++) d[i] = a.d[i];
+      if (dz==0 && (dy>0 || (dy==0 && dx>=0))) { continue; }
+      if (d==1 && dz!=0) { continue; }
+      const int dist = std::abs(dx)+std::abs(dy)+std::abs(dz);
+      if ((connectivity==4 || connectivity==6) && dist>1) { continue; }
+      if (connectivity==18 && dist>2) { continue; }
+      deltas.push_back(Vec3i(dx,dy,dz));
+      offsets.push_back(ptrdiff_t(dz)*w*h+ptrdiff_t(dy)*w+dx);
     }
-    else
+    const int numDeltas = int(deltas.size());
+
+    const int numLines = h*d;
+    const int n = w*numLines;
+    std::vector<int> parent(n);
+    int* P = &parent[0];
+
+    const int numBands = std::max(std::min(int(std::thread::hardware_concurrency()),numLines),1);
+    std::vector<int> bandLine(numBands+1);
+    std::vector<int> bandBegin(numBands+1);
+    for(int b=0;b<=numBands;b++)
     {
-      delete[] d;
-      s = a.s;
+      bandLine[b] = int((long long)numLines*b/numBands);
+      bandBegin[b] = w*bandLine[b];
+    }
+
+    // Unites the foreground elements of a line with their backward neighbors
+    // whose index falls in [lo,hi). Only the first and last elements of a line
+    // and the first row and slice need the bounds checks. The larger root is
+    // always linked under the smaller one, so every root is the first element
+    // of its component in raster order.
+    const auto scanLine = [&](int line,int lo,int hi,std::vector<int>* relinked)
+    {
+      const int y = line%h;
+      const int z = line/h;
+      const int row = line*w;
 
-      if (a.s(0)>0 && a.s(1)>0)
+      for(int x=0;x<w;x++)
       {
-        d = new T[s(0)*s(1)];
-        for(int i=0;i<s(0)*s(1);i++) d[i] = a.d[i];
+        const int i = row+x;
+        if (P[i]<0) { continue; }
+        int root = findRoot(P,i);
+        const bool interior = x>0 && x<w-1 && y>0 && y<h-1 && z>0;
+        for(int k=0;k<numDeltas;k++)
+        {
+          const int j = int(i+offsets[k]);
+          if (j<lo || j>=hi) { continue; }
+          if (!interior)
+          {
+            const int nx = x+deltas[k](0);
+            const int ny = y+deltas[k](1);
+            const int nz = z+deltas[k](2);
+            if (nx<0 || nx>=w || ny<0 || ny>=h || nz<0) { continue; }
+          }
+          if (P[j]<0 || P[j]==root) { continue; }
+          const int other = findRoot(P,j);
+          if (other==root) { continue; }
+          const int lower = std::min(root,other);
+          const int upper = std::max(root,other);
+          P[upper] = lower;
+          if (relinked) { relinked->push_back(upper); }
+          root = lower;
+        }
       }
-      else
+    };
+
+    parallelFor(numBands,[&](int b)
+    {
+      const int begin = bandBegin[b];
+      const int end = bandBegin[b+1];
+
+      for(int line=bandLine[b];line<bandLine[b+1];line++)
       {
-        d = 0;
+        for(int i=line*w;i<(line+1)*w;i++) { P[i] = mask[i]!=T(0) ? i : -1; }
+        scanLine(line,begin,end,0);
       }
+
+      // point every element straight at its band-local root
+      for(int i=begin;i<end;i++) { if (P[i]>=0 && P[i]!=i) { P[i] = P[P[i]]; } }
+    });
+
+    // Only the lines within reach of the band's first element can have
+    // neighbors in an earlier band. Roots relinked here are recorded and then
+    // resolved in increasing order, which leaves each pointing at its final
+    // root because links always go down.
+    std::vector<int> relinked;
+    const int reachLines = d>1 ? h+1 : 1;
+    for(int b=1;b<numBands;b++)
+    {
+      const int lastLine = std::min(bandLine[b+1],bandLine[b]+reachLines);
+      for(int line=bandLine[b];line<lastLine;line++) { scanLine(line,0,bandBegin[b],&relinked); }
     }
-  }
+    std::sort(relinked.begin(),relinked.end());
+    for(int k=0;k<int(relinked.size());k++) { findRoot(P,relinked[k]); }
 
-  return *this;
-}
+    std::vector<int> numRoots(numBands+1,0);
+    parallelFor(numBands,[&](int b)
+    {
+      for(int i=bandBegin[b];i<bandBegin[b+1];i++) { if (P[i]==i) { numRoots[b+1]++; } }
+    });
+    for(int b=0;b<numBands;b++) { numRoots[b+1] += numRoots[b]; }
 
-template<typename T>
-Array2<T>::~Array2()
-{
-  delete[] d;
-}
+    parallelFor(numBands,[&](int b)
+    {
+      int label = numRoots[b];
+      for(int i=bandBegin[b];i<bandBegin[b+1];i++) { out_labels[i] = P[i]==i ? ++label : 0; }
+    });
 
-template<typename T>
-inline T& Array2<T>::operator[](int i)
-{
-  assert(i>=0 && i<numel());
+    parallelFor(numBands,[&](int b)
+    {
+      for(int i=bandBegin[b];i<bandBegin[b+1];i++)
+      {
+        if (P[i]<0 || P[i]==i) { continue; }
+        out_labels[i] = out_labels[P[P[i]]];
+      }
+    });
 
-  return d[i];
-}
+    return numRoots[numBands];
+  }
 
-template<typename T>
-inline const T& Array2<T>::operator[](int i) const
-{
-  assert(i>=0 && i<numel());
+  template<int N,typename R>
+  void regionStats(const int* labels,const Vec<3,int>& size,int numLabels,std::vector<R>* out_regions)
+  {
+    std::vector<Vec<N,long long> > sums(numLabels,zero<Vec<N,long long> >::value());
 
-  return d[i];
-}
+    out_regions->resize(numLabels);
+    for(int l=0;l<numLabels;l++)
+    {
+      R& r = (*out_regions)[l];
+      r.area = 0;
+      for(int k=0;k<N;k++) { r.p0(k) = std::numeric_limits<int>::max(); r.p1(k) = 0; }
+    }
 
-template<typename T>
-inline T& Array2<T>::operator()(int i,int j)
-{
-  assert(d!=0);
-  assert(i>=0 && i<s(0) &&
-         j>=0 && j<s(1));
+    int i = 0;
+    for(int z=0;z<size(2);z++)
+    for(int y=0;y<size(1);y++)
+    for(int x=0;x<size(0);x++,i++)
+    {
+      if (labels[i]==0) { continue; }
+      const Vec3i p(x,y,z);
+      R& r = (*out_regions)[labels[i]-1];
+      r.area++;
+      for(int k=0;k<N;k++)
+      {
+        r.p0(k) = std::min(r.p0(k),p(k));
+        r.p1(k) = std::max(r.p1(k),p(k)+1);
+        sums[labels[i]-1](k) += p(k);
+      }
+    }
 
-  return d[i+j*s(0)];
+    for(int l=0;l<numLabels;l++)
+    {
+      R& r = (*out_regions)[l];
+      for(int k=0;k<N;k++) { r.centroid(k) = float(double(sums[l](k))/double(r.area)); }
+    }
+  }
 }
 
+// Labels the 4- or 8-connected components of the non-zero elements of mask
+// with 1..N in raster order of their first element, 0 marks background.
+// Optionally returns the statistics of region l in (*out_regions)[l-1].
 template<typename T>
-inline const T& Array2<T>::operator()(int i,int j) const
+Array2<int> connectedComponents(const Array2<T>& mask,int connectivity,std::vector<Region2>* out_regions)
 {
-  assert(d!=0);
-  assert(i>=0 && i<s(0) &&
-         j>=0 && j<s(1));
+  JZQ_PROFILE_SCOPE("connectedComponents");
+  assert(numel(mask)>0);
+  assert(connectivity==4 || connectivity==8);
 
-  return d[i+j*s(0)];
-}
+  Array2<int> labels(mask.size());
+  const int numLabels = jzq_detail::labelComponents(mask.data(),mask.width(),mask.height(),1,connectivity,labels.data());
 
-template<typename T>
-inline T& Array2<T>::operator()(const Vec<2,int>& ij)
-{
-  assert(d!=0);
-  assert(ij(0)>=0 && ij(0)<s(0) &&
-         ij(1)>=0 && ij(1)<s(1));
+  if (out_regions) { jzq_detail::regionStats<2>(labels.data(),Vec3i(mask.width(),mask.height(),1),numLabels,out_regions); }
 
-  return d[ij(0)+ij(1)*s(0)];
+  return labels;
 }
 
+// Same as above with 6-, 18- or 26-connectivity.
 template<typename T>
-inline const T& Array2<T>::operator()(const Vec<2,int>& ij) const
+Array3<int> connectedComponents(const Array3<T>& mask,int connectivity,std::vector<Region3>* out_regions)
 {
-  assert(d!=0);
-  assert(ij(0)>=0 && ij(0)<s(0) &&
-         ij(1)>=0 && ij(1)<s(1));
+  JZQ_PROFILE_SCOPE("connectedComponents");
+  assert(numel(mask)>0);
+  assert(connectivity==6 || connectivity==18 || connectivity==26);
 
-  return d[ij(0)+ij(1)*s(0)];
-}
-
-template<typename T>
-Vec2i Array2<T>::size() const
-{
-  return s;
-}
+  Array3<int> labels(mask.size());
+  const int numLabels = jzq_detail::labelComponents(mask.data(),mask.width(),mask.height(),mask.depth(),connectivity,labels.data());
 
-template<typename T>
-int Array2<T>::size(int dim) const
-{
-  assert(dim==0 || dim==1);
-  return size()(dim);
-}
+  if (out_regions) { jzq_detail::regionStats<3>(labels.data(),mask.size(),numLabels,out_regions); }
 
-template<typename T>
-int Array2<T>::width() const
-{
-  return size(0);
+  return labels;
 }
 
-template<typename T>
-int Array2<T>::height() const
+namespace jzq_detail
 {
-  return size(1);
-}
+  // Perreault-Hebert constant-time rank filter. Every column of a strip keeps
+  // the histogram of its 2r+1 window rows, and the kernel histogram slides
+  // along the row by adding one column histogram and subtracting another.
+  // The histograms have two levels, coarse bins of the high bits and fine bins
+  // of the low bits; only the coarse level of the kernel slides with every
+  // pixel, the fine level is brought up to date lazily for the coarse bin the
+  // rank falls into.
+  template<typename T,int COARSE_BITS,int FINE_BITS>
+  void rankFilterHistogram(const Array2<T>& a,int radius,int rank,int border,Array2<T>* out)
+  {
+    const int numCoarse = 1<<COARSE_BITS;
+    const int numFine = 1<<FINE_BITS;
+    const int numBins = numCoarse*numFine;
+
+    const int w = a.width();
+    const int h = a.height();
+    const int diam = 2*radius+1;
+    assert(diam<=int(std::numeric_limits<unsigned short>::max()));
+
+    // strips are narrow enough for the column histograms of one strip to stay
+    // within a few megabytes
+    const int numThreads = std::max(int(std::thread::hardware_concurrency()),1);
+    const int maxCols = std::max(int((size_t(8)<<20)/(numBins*sizeof(unsigned short)))-2*radius,32);
+    const int stripWidth = std::min((w+numThreads-1)/numThreads,maxCols);
+    const int numStrips = (w+stripWidth-1)/stripWidth;
+
+    parallelFor(numStrips,[&](int strip)
+    {
+      const int x0 = strip*stripWidth;
+      const int x1 = std::min(x0+stripWidth,w);
+      const int numCols = x1-x0+2*radius;
 
-template<typename T>
-int Array2<T>::numel() const
-{
-  return size(0)*size(1);
-}
+      std::vector<int> srcX(numCols);
+      for(int c=0;c<numCols;c++) { srcX[c] = borderIndex(x0-radius+c,w,border); }
 
-template<typename T>
-bool Array2<T>::empty() const
-{
-  return (numel()==0);
-}
+      std::vector<unsigned short> colFine(size_t(numCols)*numBins,0);
+      std::vector<unsigned short> colCoarse(size_t(numCols)*numCoarse,0);
 
-template<typename T>
-T* Array2<T>::data()
-{
-  return d;
-}
+      const auto updateColumns = [&](int y,int delta)
+      {
+        const int sy = borderIndex(y,h,border);
+        for(int c=0;c<numCols;c++)
+        {
+          const int v = (sy<0 || srcX[c]<0) ? 0 : int(a(srcX[c],sy));
+          colFine[size_t(c)*numBins+v] += delta;
+          colCoarse[size_t(c)*numCoarse+(v>>FINE_BITS)] += delta;
+        }
+      };
+
+      for(int y=-radius;y<=radius;y++) { updateColumns(y,+1); }
+
+      std::vector<int> coarse(numCoarse);
+      std::vector<int> fine(numBins);
+      std::vector<int> fineCol(numCoarse);
+
+      for(int y=0;y<h;y++)
+      {
+        if (y>0) { updateColumns(y-radius-1,-1); updateColumns(y+radius,+1); }
+
+        std::fill(coarse.begin(),coarse.end(),0);
+        for(int c=0;c<diam;c++)
+        for(int b=0;b<numCoarse;b++) { coarse[b] += colCoarse[size_t(c)*numCoarse+b]; }
+
+        // column at which the fine level of each coarse bin was last valid
+        std::fill(fineCol.begin(),fineCol.end(),-diam);
+
+        for(int x=x0;x<x1;x++)
+        {
+          const int c0 = x-x0;
+          if (x>x0)
+          {
+            const unsigned short* add = &colCoarse[size_t(c0+diam-1)*numCoarse];
+            const unsigned short* sub = &colCoarse[size_t(c0-1)*numCoarse];
+            for(int b=0;b<numCoarse;b++) { coarse[b] += int(add[b])-int(sub[b]); }
+          }
+
+          int before = 0;
+          int bin = 0;
+          while(before+coarse[bin]<=rank) { before += coarse[bin]; bin++; }
+
+          int* f = &fine[size_t(bin)*numFine];
+          if (c0-fineCol[bin]>=diam)
+          {
+            std::fill(f,f+numFine,0);
+            for(int c=c0;c<c0+diam;c++)
+            {
+              const unsigned short* col = &colFine[size_t(c)*numBins+size_t(bin)*numFine];
+              for(int v=0;v<numFine;v++) { f[v] += col[v]; }
+            }
+          }
+          else
+          {
+            for(int c=fineCol[bin]+1;c<=c0;c++)
+            {
+              const unsigned short* add = &colFine[size_t(c+diam-1)*numBins+size_t(bin)*numFine];
+              const unsigned short* sub = &colFine[size_t(c-1)*numBins+size_t(bin)*numFine];
+              for(int v=0;v<numFine;v++) { f[v] += int(add[v])-int(sub[v]); }
+            }
+          }
+          fineCol[bin] = c0;
+
+          int v = 0;
+          while(before+f[v]<=rank) { before += f[v]; v++; }
+
+          (*out)(x,y) = T(bin*numFine+v);
+        }
+      }
+    });
+  }
 
-template<typename T>
-const T* Array2<T>::data() const
-{
-  return d;
-}
+  // Batcher's odd-even merge sort of n (a power of two) rows of count lanes
+  // each. The compare-exchanges are applied across all lanes at once, so the
+  // inner loop is a branch-free min/max over contiguous arrays that the
+  // compiler vectorizes.
+  template<typename T>
+  void sortLanes(T* v,int n,int count)
+  {
+    for(int p=1;p<n;p*=2)
+    for(int k=p;k>=1;k/=2)
+    for(int j=k%p;j+k<n;j+=2*k)
+    for(int i=0;i<std::min(k,n-j-k);i++)
+    {
+      if ((i+j)/(2*p)!=(i+j+k)/(2*p)) { continue; }
 
-template<typename T>
-void Array2<T>::clear()
-{
-  delete[] d;
-  s = Vec2i(0,0);
-  d = 0;
-}
+      T* lo = v+size_t(i+j)*count;
+      T* hi = v+size_t(i+j+k)*count;
+      for(int x=0;x<count;x++)
+      {
+        const T l = lo[x];
+        const T h = hi[x];
+        lo[x] = std::min(l,h);
+        hi[x] = std::max(l,h);
+      }
+    }
+  }
 
-template<typename T>
-void Array2<T>::swap(Array2<T>& b)
-{
-  Vec2i tmp_s = s;
-  s = b.s;
-  b.s = tmp_s;
+  // Rank filter for any ordered element type. Small windows go through a
+  // sorting network over a chunk of pixels at a time, larger ones select the
+  // rank per pixel with nth_element.
+  template<typename T>
+  void rankFilterGeneric(const Array2<T>& a,int radius,int rank,int border,Array2<T>* out)
+  {
+    static_assert(std::numeric_limits<T>::is_specialized,"rankFilter needs an ordered scalar or a Vec of ordered scalars");
 
-  T* tmp_d = d;
-  d = b.d;
-  b.d = tmp_d;
-}
+    const int w = a.width();
+    const int h = a.height();
+    const int diam = 2*radius+1;
+    const int n = diam*diam;
 
-template<typename T>
-Vec2i size(const Array2<T>& a)
-{
-  return a.size();
-}
+    int numRows = 1;
+    while(numRows<n) { numRows *= 2; }
+    const bool network = radius<=2;
 
-template<typename T>
-int size(const Array2<T>& a,int dim)
-{
-  return a.size(dim);
-}
+    // the network's extra rows must sort after every real value, +inf included
+    const T padding = std::numeric_limits<T>::has_infinity ? std::numeric_limits<T>::infinity() : std::numeric_limits<T>::max();
 
-template<typename T>
-int numel(const Array2<T>& a)
-{
-  return a.numel();
-}
+    const int numThreads = std::max(int(std::thread::hardware_concurrency()),1);
+    const int stripWidth = (w+numThreads-1)/numThreads;
+    const int numStrips = (w+stripWidth-1)/stripWidth;
+    const int chunk = 64;
 
-template<typename T>
-bool empty(const Array2<T>& a)
-{
-  return a.empty();
-}
+    parallelFor(numStrips,[&](int strip)
+    {
+      const int x0 = strip*stripWidth;
+      const int x1 = std::min(x0+stripWidth,w);
 
-template<typename T>
-void clear(Array2<T>* a)
-{
-  a->clear();
-}
+      std::vector<int> srcX(x1-x0+2*radius);
+      for(int c=0;c<int(srcX.size());c++) { srcX[c] = borderIndex(x0-radius+c,w,border); }
 
-template<typename T>
-void swap(Array2<T>& a,Array2<T>& b)
-{
-  a.swap(b);
-}
+      std::vector<T> lanes(network ? size_t(numRows)*chunk : 0);
+      std::vector<T> window(network ? 0 : n);
 
-template<typename T>
-T min(const Array2<T>& a)
-{
-  assert(numel(a)>0);
+      for(int y=0;y<h;y++)
+      {
+        if (network)
+        {
+          for(int cx=x0;cx<x1;cx+=chunk)
+          {
+            const int count = std::min(chunk,x1-cx);
+            T* v = &lanes[0];
+            for(int dy=-radius;dy<=radius;dy++)
+            {
+              const int sy = borderIndex(y+dy,h,border);
+              for(int dx=0;dx<diam;dx++,v+=count)
+              {
+                for(int x=0;x<count;x++)
+                {
+                  const int sx = srcX[cx-x0+x+dx];
+                  v[x] = (sy<0 || sx<0) ? T(0) : a(sx,sy);
+                }
+              }
+            }
+            for(int k=n;k<numRows;k++,v+=count) { std::fill(v,v+count,padding); }
+
+            sortLanes(&lanes[0],numRows,count);
+
+            for(int x=0;x<count;x++) { (*out)(cx+x,y) = lanes[size_t(rank)*count+x]; }
+          }
+        }
+        else
+        {
+          for(int x=x0;x<x1;x++)
+          {
+            int k = 0;
+            for(int dy=-radius;dy<=radius;dy++)
+            {
+              const int sy = borderIndex(y+dy,h,border);
+              for(int dx=0;dx<diam;dx++)
+              {
+                const int sx = srcX[x-x0+dx];
+                window[k++] = (sy<0 || sx<0) ? T(0) : a(sx,sy);
+              }
+            }
+            std::nth_element(window.begin(),window.begin()+rank,window.end());
+            (*out)(x,y) = window[rank];
+          }
+        }
+      }
+    });
+  }
 
-  const int n = numel(a);
+  template<typename T>
+  struct RankFilter
+  {
+    static void apply(const Array2<T>& a,int radius,int rank,int border,Array2<T>* out) { rankFilterGeneric(a,radius,rank,border,out); }
+  };
 
-  const T* d = a.data();
+  template<>
+  struct RankFilter<unsigned char>
+  {
+    static void apply(const Array2<unsigned char>& a,int radius,int rank,int border,Array2<unsigned char>* out) { rankFilterHistogram<unsigned char,4,4>(a,radius,rank,border,out); }
+  };
 
-  T minval = d[0];
+  // Vec elements are filtered channel by channel, so each channel takes the
+  // fastest path for its scalar type.
+  template<int N,typename T>
+  struct RankFilter<Vec<N,T>>
+  {
+    static void apply(const Array2<Vec<N,T>>& a,int radius,int rank,int border,Array2<Vec<N,T>>* out)
+    {
+      const int n = a.numel();
+      Array2<T> plane(size(a));
+      Array2<T> filtered(size(a));
 
-  for(int i=1;i<n;i++) minval = (d[i]<minval) ? d[i] : minval;
+      for(int c=0;c<N;c++)
+      {
+        for(int i=0;i<n;i++) { plane[i] = a[i](c); }
+        RankFilter<T>::apply(plane,radius,rank,border,&filtered);
+        for(int i=0;i<n;i++) { (*out)[i](c) = filtered[i]; }
+      }
+    }
+  };
 
-  return minval;
+  // With 256 coarse and 256 fine bins the per-pixel histogram work outweighs
+  // the sorting network for the smallest windows.
+  template<>
+  struct RankFilter<unsigned short>
+  {
+    static void apply(const Array2<unsigned short>& a,int radius,int rank,int border,Array2<unsigned short>* out)
+    {
+      if (radius<=2) { rankFilterGeneric(a,radius,rank,border,out); }
+      else           { rankFilterHistogram<unsigned short,8,8>(a,radius,rank,border,out); }
+    }
+  };
 }
 
+// Replaces every element by the p-th percentile (0..100) of its (2r+1)^2
+// neighborhood, using the same nearest-rank rule as percentile; Vec elements
+// are ranked per channel. 8- and 16-bit channels take constant time per pixel
+// regardless of the radius. Elements outside are resolved by the border
+// mode, zero border counts them as zeros.
 template<typename T>
-T max(const Array2<T>& a)
+Array2<T> rankFilter(const Array2<T>& a,int radius,float p,int border)
 {
+  JZQ_PROFILE_SCOPE("rankFilter");
   assert(numel(a)>0);
+  assert(radius>=0);
+  assert(p>=0.0f && p<=100.0f);
 
-  const int n = numel(a);
-
-  const T* d = a.data();
-
-  T maxval = d[0];
+  const int n = (2*radius+1)*(2*radius+1);
+  const int rank = int(std::floor(double(p)/100.0*(n-1)+0.5));
 
-  for(int i=1;i<n;i++) maxval = (maxval<d[i]) ? d[i] : maxval;
+  Array2<T> out(size(a));
+  jzq_detail::RankFilter<T>::apply(a,radius,rank,border,&out);
+  return out;
+}
 
-  return maxval;
+template<typename T>
+Array2<T> medianFilter(const Array2<T>& a,int radius,int border)
+{
+  return rankFilter(a,radius,50.0f,border);
 }
 
+// Joint bilateral filter of a with range distances measured on edge, via the
+// bilateral grid: a is splatted into a coarse (x,y,edge) grid with cells of
+// sigmaSpatial x sigmaSpatial x sigmaRange, the grid is blurred separably and
+// the result is read back with trilinear interpolation. Time is linear in the
+// number of pixels. The grid shrinks as the sigmas grow; when small sigmas
+// would need more cells than the image has pixels (or 2^20, if larger), both
+// sigmas are scaled up by a common factor until the grid fits. Elements whose
+// edge value is NaN or infinite are passed through unfiltered.
 template<typename T>
-Vec<2,T> minmax(const Array2<T>& a)
+Array2<T> bilateralFilter(const Array2<T>& a,const Array2<float>& edge,float sigmaSpatial,float sigmaRange)
 {
+  JZQ_PROFILE_SCOPE("bilateralFilter");
+  typedef typename jzq_detail::Filter<T>::type F;
+  typedef typename jzq_detail::Scalar<F>::type S;
+
   assert(numel(a)>0);
+  assert(all(size(edge)==size(a)));
+  assert(sigmaSpatial>0.0f && sigmaRange>0.0f);
 
-  const int n = numel(a);
+  const int w = a.width();
+  const int h = a.height();
 
-  const T* d = a.data();
+  float edgeMin = 0.0f;
+  float edgeMax = 0.0f;
+  bool anyFinite = false;
+  for(int i=0;i<numel(edge);i++)
+  {
+    const float e = edge[i];
+    if (!std::isfinite(e)) { continue; }
+    edgeMin = anyFinite ? std::min(edgeMin,e) : e;
+    edgeMax = anyFinite ? std::max(edgeMax,e) : e;
+    anyFinite = true;
+  }
 
-  T minval = d[0];
-  T maxval = d[0];
+  // two cells of padding keep the blur from reaching past the grid
+  const int pad = 2;
+  const auto extent = [&](double length,double sigma) { return (long long)(length/sigma)+1+2*pad; };
+  const auto numCells = [&](float ss,float sr)
+  {
+    return extent(w-1,ss)*extent(h-1,ss)*extent(double(edgeMax)-double(edgeMin),sr);
+  };
 
-  for(int i=1;i<n;i++)
+  const long long maxCells = std::max((long long)numel(a),1LL<<20);
+  float ss = sigmaSpatial;
+  float sr = sigmaRange;
+  if (numCells(ss,sr)>maxCells)
   {
-    minval = (d[i]<minval) ? d[i] : minval;
-    maxval = (maxval<d[i]) ? d[i] : maxval;
+    const float f = float(std::cbrt(double(numCells(ss,sr))/double(maxCells)));
+    ss *= f;
+    sr *= f;
+    while(numCells(ss,sr)>maxCells) { ss *= 1.05f; sr *= 1.05f; }
   }
 
-  return Vec<2,T>(minval,maxval);
-}
+  const int gw = int(extent(w-1,ss));
+  const int gh = int(extent(h-1,ss));
+  const int gd = int(extent(double(edgeMax)-double(edgeMin),sr));
 
-template<typename T>
-Vec2i argmin(const Array2<T>& a)
-{
-  assert(numel(a)>0);
+  Array3<F> values(gw,gh,gd);
+  Array3<float> weights(gw,gh,gd);
+  std::fill(values.data(),values.data()+numel(values),zero<F>::value());
+  std::fill(weights.data(),weights.data()+numel(weights),0.0f);
 
-  T minValue = a(0,0);
-  Vec2i minIndex = Vec2i(0,0);
+  // Nearest-cell splat. Every image row lands in exactly one grid row, so
+  // splitting the work by grid rows lets threads splat without conflicts.
+  const auto cellOf = [&](int i) { return int(float(i)/ss+0.5f)+pad; };
+  std::vector<int> firstRow(gh+1,h);
+  for(int y=h-1;y>=0;y--) { firstRow[cellOf(y)] = y; }
+  for(int gy=gh-1;gy>=0;gy--) { firstRow[gy] = std::min(firstRow[gy],firstRow[gy+1]); }
 
-  for(int j=0;j<a.height();j++)
+  parallelFor(gh,[&](int gy)
   {
-    for(int i=0;i<a.width();i++)
+    for(int y=firstRow[gy];y<firstRow[gy+1];y++)
+    for(int x=0;x<w;x++)
     {
-      if (a(i,j)<minValue)
-      {
-        minValue = a(i,j);
-        minIndex = Vec2i(i,j);
-      }
+      if (!std::isfinite(edge(x,y))) { continue; }
+      const int gx = cellOf(x);
+      const int gz = int((edge(x,y)-edgeMin)/sr+0.5f)+pad;
+      values(gx,gy,gz) += F(a(x,y));
+      weights(gx,gy,gz) += 1.0f;
     }
-  }
+  });
 
-  return minIndex;
-}
+  std::vector<float> kernel(5);
+  kernel[0] = kernel[4] = 1.0f/16.0f;
+  kernel[1] = kernel[3] = 4.0f/16.0f;
+  kernel[2] = 6.0f/16.0f;
 
-template<typename T>
-Vec2i argmax(const Array2<T>& a)
-{
-  assert(numel(a)>0);
+  values = convolve(values,kernel,kernel,kernel,JZQ_BORDER_ZERO);
+  weights = convolve(weights,kernel,kernel,kernel,JZQ_BORDER_ZERO);
 
-  T maxValue = a(0,0);
-  Vec2i maxIndex = Vec2i(0,0);
+  Array2<T> out(size(a));
 
-  for(int j=0;j<a.height();j++)
+  parallelFor(h,[&](int y)
   {
-    for(int i=0;i<a.width();i++)
+    const float fy = float(y)/ss+float(pad);
+    const int y0 = int(fy);
+    const float ty = fy-float(y0);
+
+    for(int x=0;x<w;x++)
     {
-      if (maxValue<a(i,j))
+      if (!std::isfinite(edge(x,y))) { out(x,y) = a(x,y); continue; }
+
+      const float fx = float(x)/ss+float(pad);
+      const float fz = (edge(x,y)-edgeMin)/sr+float(pad);
+      const int x0 = int(fx);
+      const int z0 = int(fz);
+      const float tx = fx-float(x0);
+      const float tz = fz-float(z0);
+
+      F v = zero<F>::value();
+      float wsum = 0.0f;
+      for(int k=0;k<8;k++)
       {
-        maxValue = a(i,j);
-        maxIndex = Vec2i(i,j);
+        const int dx = k&1;
+        const int dy = (k>>1)&1;
+        const int dz = (k>>2)&1;
+        const float c = (dx ? tx : 1.0f-tx)*(dy ? ty : 1.0f-ty)*(dz ? tz : 1.0f-tz);
+        v += values(x0+dx,y0+dy,z0+dz)*S(c);
+        wsum += weights(x0+dx,y0+dy,z0+dz)*c;
       }
+
+      out(x,y) = wsum>0.0f ? jzq_detail::Saturate<T>::cast(v/S(wsum)) : a(x,y);
     }
-  }
+  });
 
-  return maxIndex;
+  return out;
 }
 
+// Bilateral filter with the range distance taken on the value itself, or on
+// the mean of the channels for Vecs.
 template<typename T>
-T sum(const Array2<T>& a)
+Array2<T> bilateralFilter(const Array2<T>& a,float sigmaSpatial,float sigmaRange)
 {
-  assert(numel(a)>0);
-
-  const int n = numel(a);
-
-  const T* d = a.data();
-
-  T sumval = d[0];
+  typedef jzq_detail::Channels<T> C;
 
-  for(int i=1;i<n;i++) sumval += d[i];
+  Array2<float> edge(size(a));
+  parallelFor(a.height(),[&](int y)
+  {
+    for(int x=0;x<a.width();x++)
+    {
+      float e = 0.0f;
+      for(int c=0;c<C::count;c++) { e += float(C::at(a(x,y),c)); }
+      edge(x,y) = e/float(C::count);
+    }
+  });
 
-  return sumval;
+  return bilateralFilter(a,edge,sigmaSpatial,sigmaRange);
 }
 
+// Guided filter with a scalar guide: the output is locally an affine function
+// of the guide fitted to a in every (2r+1)^2 window. Built entirely from box
+// filters, so the cost does not depend on the radius. eps, in squared guide
+// units, regularizes the fit: edges with variance well below eps are smoothed.
 template<typename T>
-void fill(Array2<T>* a,const T& value)
+Array2<T> guidedFilter(const Array2<T>& a,const Array2<float>& guide,int radius,float eps)
 {
-  assert(a!=0);
-  assert(a->numel()>0);
+  JZQ_PROFILE_SCOPE("guidedFilter");
+  typedef typename jzq_detail::Filter<T>::type F;
+  typedef typename jzq_detail::Scalar<F>::type S;
 
-  const int n = a->numel();
-  T* d = a->data();
+  assert(numel(a)>0);
+  assert(all(size(guide)==size(a)));
+  assert(radius>=0);
 
-  for(int i=0;i<n;i++) d[i] = value;
-}
+  const int w = a.width();
+  const int h = a.height();
 
-template<typename T,typename F>
-Array2<T> apply(const Array2<T>& a,F fun)
-{
-  assert(numel(a) > 0);
+  Array2<F> p(w,h);
+  Array2<F> ip(w,h);
+  Array2<float> ii(w,h);
 
-  Array2<T> fun_a(size(a));
+  parallelFor(h,[&](int y)
+  {
+    for(int x=0;x<w;x++)
+    {
+      const float I = guide(x,y);
+      p(x,y) = F(a(x,y));
+      ip(x,y) = p(x,y)*S(I);
+      ii(x,y) = I*I;
+    }
+  });
 
-  const int n = numel(a);
+  const Array2<float> meanI = boxFilter(guide,radius);
+  const Array2<float> meanII = boxFilter(ii,radius);
+  const Array2<F> meanP = boxFilter(p,radius);
+  const Array2<F> meanIP = boxFilter(ip,radius);
 
-  for(int i=0;i<n;i++) fun_a.data()[i] = fun(a.data()[i]);
+  // the coefficients overwrite the buffers that are no longer needed
+  Array2<F>& coefA = p;
+  Array2<F>& coefB = ip;
 
-  return fun_a;
-}
+  parallelFor(h,[&](int y)
+  {
+    for(int x=0;x<w;x++)
+    {
+      const float mI = meanI(x,y);
+      const float varI = meanII(x,y)-mI*mI;
+      const F covIP = meanIP(x,y)-meanP(x,y)*S(mI);
+      coefA(x,y) = covIP/S(varI+eps);
+      coefB(x,y) = meanP(x,y)-coefA(x,y)*S(mI);
+    }
+  });
 
-template<typename T>
-Array2<T> a2read(const std::string& fileName)
-{
-  Array2<T> A;
-  if(!a2read(&A,fileName)) { return Array2<T>(); }
-  return A;
-}
+  const Array2<F> meanA = boxFilter(coefA,radius);
+  const Array2<F> meanB = boxFilter(coefB,radius);
 
-template<typename T>
-bool a2read(Array2<T>* out_A,const std::string& fileName)
-{
-  FILE* f = fopen(fileName.c_str(),"rb");
+  Array2<T> out(w,h);
 
-  if(!f) { return false; }
+  parallelFor(h,[&](int y)
+  {
+    for(int x=0;x<w;x++) { out(x,y) = jzq_detail::Saturate<T>::cast(meanA(x,y)*S(guide(x,y))+meanB(x,y)); }
+  });
 
-  int w,h,s;
+  return out;
+}
 
-  if(fread(&w,sizeof(w),1,f)!=1 ||
-     fread(&h,sizeof(h),1,f)!=1 ||
-     fread(&s,sizeof(s),1,f)!=1 ||
-     ((w*h)<1) || s!=sizeof(T))
+namespace jzq_detail
+{
+  // Bulk float <-> float16 conversion, using AVX-512 or F16C when the build
+  // targets them and the scalar conversion for the rest. The AVX-512 loops use
+  // the maskz forms because the unmasked ones trip -Wmaybe-uninitialized in gcc.
+  // Splits [0,n) into 64K-element blocks spread over the worker threads.
+  template<typename F>
+  void parallelForBlocks(size_t n,F fun)
   {
-    fclose(f);
-    return false;
+    const size_t block = size_t(1)<<16;
+    parallelForRange(int((n+block-1)/block),[&](int begin,int end)
+    {
+      fun(size_t(begin)*block,std::min(size_t(end)*block,n));
+    });
   }
 
-  Array2<T> A(w,h);
+  inline void convertRun(const float* src,half* dst,size_t n)
+  {
+    size_t i = 0;
+#if defined(__AVX512F__)
+    for(;i+16<=n;i+=16) { _mm256_storeu_si256((__m256i*)(dst+i),_mm512_maskz_cvtps_ph(0xFFFF,_mm512_loadu_ps(src+i),_MM_FROUND_TO_NEAREST_INT|_MM_FROUND_NO_EXC)); }
+#endif
+#if defined(JZQ_F16C)
+    for(;i+8<=n;i+=8) { _mm_storeu_si128((__m128i*)(dst+i),_mm256_cvtps_ph(_mm256_loadu_ps(src+i),_MM_FROUND_TO_NEAREST_INT|_MM_FROUND_NO_EXC)); }
+#endif
+    for(;i<n;i++) { dst[i] = half(src[i]); }
+  }
 
-  if(fread(A.data(),sizeof(T)*w*h,1,f)!=1)
+  inline void convertRun(const half* src,float* dst,size_t n)
   {
-    fclose(f);
-    return false;
+    size_t i = 0;
+#if defined(__AVX512F__)
+    for(;i+16<=n;i+=16) { _mm512_storeu_ps(dst+i,_mm512_maskz_cvtph_ps(0xFFFF,_mm256_loadu_si256((const __m256i*)(src+i)))); }
+#endif
+#if defined(JZQ_F16C)
+    for(;i+8<=n;i+=8) { _mm256_storeu_ps(dst+i,_mm256_cvtph_ps(_mm_loadu_si128((const __m128i*)(src+i)))); }
+#endif
+    for(;i<n;i++) { dst[i] = float(src[i]); }
   }
 
-  if(out_A!=0) { *out_A = A; }
+  // bfloat16 is plain bit manipulation, which the compiler vectorizes as is.
+  inline void convertRun(const float* src,bfloat16* dst,size_t n)
+  {
+    for(size_t i=0;i<n;i++) { dst[i] = bfloat16(src[i]); }
+  }
 
-  fclose(f);
-  return true;
-}
+  inline void convertRun(const bfloat16* src,float* dst,size_t n)
+  {
+    for(size_t i=0;i<n;i++) { dst[i] = float(src[i]); }
+  }
 
-template<typename T>
-bool a2write(const Array2<T>& A,const std::string& fileName)
-{
-  if(A.numel()==0) { return false; }
+  template<typename U,int D,typename T>
+  ArrayN<D,typename Rebind<T,U>::type> convertArray(const ArrayN<D,T>& a)
+  {
+    typedef typename Scalar<T>::type S;
 
-  FILE* f = fopen(fileName.c_str(),"wb");
+    assert(numel(a)>0);
 
-  if(!f) { return false; }
+    ArrayN<D,typename Rebind<T,U>::type> out(size(a));
 
-  const int w = A.width();
-  const int h = A.height();
-  const int s = sizeof(T);
+    const size_t n = size_t(a.numel())*Channels<T>::count;
+    const S* src = reinterpret_cast<const S*>(a.data());
+    U* dst = reinterpret_cast<U*>(out.data());
 
-  if(fwrite(&w,sizeof(w),1,f)!=1 ||
-     fwrite(&h,sizeof(h),1,f)!=1 ||
-     fwrite(&s,sizeof(s),1,f)!=1 ||
-     fwrite(A.data(),sizeof(T)*w*h,1,f)!=1)
-  {
-    fclose(f);
-    return false;
-  }
+    parallelForBlocks(n,[&](size_t first,size_t last) { convertRun(src+first,dst+first,last-first); });
 
-  fclose(f);
-  return true;
+    return out;
+  }
 }
 
-template<typename T>
-Array3<T>::Array3() : s(0,0,0),d(0) {}
+// Converts an array of float or Vec<N,float> to half precision.
+template<int D,typename T>
+ArrayN<D,typename jzq_detail::Rebind<T,half>::type> toHalf(const ArrayN<D,T>& a)
+{
+  return jzq_detail::convertArray<half>(a);
+}
 
-template<typename T>
-Array3<T>::Array3(int width,int height,int depth)
+template<int D,typename T>
+ArrayN<D,typename jzq_detail::Rebind<T,bfloat16>::type> toBfloat16(const ArrayN<D,T>& a)
 {
-  assert(width>0 && height>0 && depth>0);
-  s = Vec3i(width,height,depth);
-  d = new T[s(0)*s(1)*s(2)];
+  return jzq_detail::convertArray<bfloat16>(a);
 }
 
-template<typename T>
-Array3<T>::Array3(const Vec3i& size)
+// Converts an array of half or bfloat16, or of Vecs of them, back to float.
+template<int D,typename T>
+ArrayN<D,typename jzq_detail::Rebind<T,float>::type> toFloat(const ArrayN<D,T>& a)
 {
-  assert(size(0)>0 && size(1)>0 && size(2)>0);
-  s = size;
-  d = new T[s(0)*s(1)*s(2)];
+  return jzq_detail::convertArray<float>(a);
 }
 
-template<typename T>
-Array3<T>::Array3(const Array3<T>& a)
+namespace jzq_detail
 {
-  s = a.s;
+  // Tables for the 8-bit normalization and the sRGB transfer function.
+  // Decoding is a direct lookup.
+  // Encoding interpolates linearly between nodes placed at the float
+  // exponent and top 9 mantissa bits of [2^-9,1], which stays within 0.01 of
+  // a 16-bit code; below 0.0031308 the curve is linear and needs no table.
+  struct SrgbTables
+  {
+    float linear8[256];
+    float decode8[256];
+    std::vector<float> decode16;
+    float encode[9*512+2];
 
-  if (s(0)>0 && s(1)>0 && s(2)>0)
+    SrgbTables() : decode16(65536)
+    {
+      for(int i=0;i<256;i++) { linear8[i] = float(i)/255.0f; decode8[i] = float(toLinear(double(i)/255.0)); }
+      for(int i=0;i<65536;i++) { decode16[i] = float(toLinear(double(i)/65535.0)); }
+      for(int i=0;i<=9*512;i++)
+      {
+        const unsigned int bits = 0x3B000000u+(unsigned int)(i<<14);
+        float x; std::memcpy(&x,&bits,sizeof(x));
+        encode[i] = float(toSrgb(double(x)));
+      }
+      encode[9*512+1] = encode[9*512];
+    }
+
+    static double toLinear(double v) { return v<=0.04045 ? v/12.92 : std::pow((v+0.055)/1.055,2.4); }
+    static double toSrgb(double x) { return x<=0.0031308 ? x*12.92 : 1.055*std::pow(x,1.0/2.4)-0.055; }
+  };
+
+  inline const SrgbTables& srgbTables()
   {
-    d = new T[s(0)*s(1)*s(2)];
+    static const SrgbTables tables;
+    return tables;
+  }
 
-    for(int i=0;i<s(0)*s(1)*s(2);i++) d[i] = a.d[i];
+  // x must be in [0,1]. Written without branches so that the loops calling it
+  // can be vectorized with gathers.
+  inline float encodeSrgb(const float* table,float x)
+  {
+    unsigned int bits; std::memcpy(&bits,&x,sizeof(bits));
+    bits = std::max(bits,0x3B000000u);
+    const unsigned int i = (bits-0x3B000000u)>>14;
+    const float t = float(bits&0x3FFFu)*(1.0f/16384.0f);
+    const float y = table[i]+(table[i+1]-table[i])*t;
+    return x<0.0031308f ? x*12.92f : y;
   }
-  else
+
+  inline float clamp01(float x) { return std::min(1.0f,std::max(0.0f,x)); }
+
+  // The pixel loops work on the raw channels rather than through Vec, whose
+  // asserting accessors keep the compiler from vectorizing them.
+  template<typename T,typename F>
+  void unpackRun(const T* src,float* dst,size_t n,bool premultiply,F color)
   {
-    d = 0;
+    const float maxValue = float(std::numeric_limits<T>::max());
+    for(size_t i=0;i<n;i++)
+    {
+      const T* p = src+4*i;
+      float* q = dst+4*i;
+      const float alpha = float(p[3])/maxValue;
+      const float k = premultiply ? alpha : 1.0f;
+      q[0] = color(p[0])*k;
+      q[1] = color(p[1])*k;
+      q[2] = color(p[2])*k;
+      q[3] = alpha;
+    }
   }
-}
 
-template<typename T>
-Array3<T>& Array3<T>::operator=(const Array3<T>& a)
-{
-  if (this!=&a)
+  // The reciprocal of alpha is taken unconditionally and then selected, since
+  // a conditional division keeps the loop from being vectorized.
+  template<bool PREMULTIPLIED,typename T,typename F>
+  void packRun(const float* src,T* dst,size_t n,F color)
   {
-    if (s(0)==a.s(0) && s(1)==a.s(1) && s(2)==a.s(2))
+    const float maxValue = float(std::numeric_limits<T>::max());
+    for(size_t i=0;i<n;i++)
     {
-      for(int i=0;i<s(0)*s(1)*s(2);i++) d[i] = a.d[i];
+      const float* p = src+4*i;
+      T* q = dst+4*i;
+      const float invAlpha = 1.0f/p[3];
+      const float k = !PREMULTIPLIED ? 1.0f : p[3]>0.0f ? invAlpha : 0.0f;
+      q[0] = T(color(clamp01(p[0]*k))*maxValue+0.5f);
+      q[1] = T(color(clamp01(p[1]*k))*maxValue+0.5f);
+      q[2] = T(color(clamp01(p[2]*k))*maxValue+0.5f);
+      q[3] = T(clamp01(p[3])*maxValue+0.5f);
     }
-    else
+  }
+
+  template<typename T>
+  Array2< Vec<4,float> > unpackPixels(const Array2< Vec<4,T> >& a,int flags,const float* table)
+  {
+    assert(numel(a)>0);
+
+    Array2< Vec<4,float> > out(size(a));
+
+    const T* src = reinterpret_cast<const T*>(a.data());
+    float* dst = reinterpret_cast<float*>(out.data());
+    const bool premultiply = (flags & JZQ_PIXEL_PREMULTIPLIED)!=0;
+
+    parallelForBlocks(size_t(a.numel()),[&](size_t first,size_t last)
     {
-      delete[] d;
-      s = a.s;
+      const float maxValue = float(std::numeric_limits<T>::max());
+      if (table) { unpackRun(src+4*first,dst+4*first,last-first,premultiply,[&](T v) { return table[v]; }); }
+      else       { unpackRun(src+4*first,dst+4*first,last-first,premultiply,[&](T v) { return float(v)/maxValue; }); }
+    });
 
-      if (a.s(0)>0 && a.s(1)>0 && a.s(2)>0)
-      {
-        d = new T[s(0)*s(1)*s(2)];
-        for(int i=0;i<s(0)*s(1)*s(2);i++) d[i] = a.d[i];
-      }
-      else
+    return out;
+  }
+
+  template<typename T>
+  Array2< Vec<4,T> > packPixels(const Array2< Vec<4,float> >& a,int flags)
+  {
+    assert(numel(a)>0);
+
+    Array2< Vec<4,T> > out(size(a));
+
+    const float* src = reinterpret_cast<const float*>(a.data());
+    T* dst = reinterpret_cast<T*>(out.data());
+    const float* table = (flags & JZQ_PIXEL_SRGB) ? srgbTables().encode : 0;
+    const auto srgb = [table](float x) { return encodeSrgb(table,x); };
+    const auto linear = [](float x) { return x; };
+
+    parallelForBlocks(size_t(a.numel()),[&](size_t first,size_t last)
+    {
+      const size_t n = last-first;
+      switch(flags & (JZQ_PIXEL_SRGB|JZQ_PIXEL_PREMULTIPLIED))
       {
-        d = 0;
+        case 0:                                      packRun<false>(src+4*first,dst+4*first,n,linear); break;
+        case JZQ_PIXEL_SRGB:                         packRun<false>(src+4*first,dst+4*first,n,srgb);   break;
+        case JZQ_PIXEL_PREMULTIPLIED:                packRun<true>(src+4*first,dst+4*first,n,linear);  break;
+        case JZQ_PIXEL_SRGB|JZQ_PIXEL_PREMULTIPLIED: packRun<true>(src+4*first,dst+4*first,n,srgb);    break;
       }
-    }
-  }
+    });
 
-  return *this;
+    return out;
+  }
 }
 
-template<typename T>
-Array3<T>::~Array3()
+inline Array2< Vec<4,float> > toFloat(const Array2< Vec<4,unsigned char> >& a,int flags)
 {
-  delete[] d;
+  JZQ_PROFILE_SCOPE("toFloat");
+  const jzq_detail::SrgbTables& tables = jzq_detail::srgbTables();
+  return jzq_detail::unpackPixels(a,flags,(flags & JZQ_PIXEL_SRGB) ? tables.decode8 : tables.linear8);
 }
 
-template<typename T>
-inline T& Array3<T>::operator[](int i)
+inline Array2< Vec<4,float> > toFloat(const Array2< Vec<4,unsigned short> >& a,int flags)
 {
-  assert(i>=0 && i<numel());
-
-  return d[i];
+  JZQ_PROFILE_SCOPE("toFloat");
+  return jzq_detail::unpackPixels(a,flags,(flags & JZQ_PIXEL_SRGB) ? jzq_detail::srgbTables().decode16.data() : 0);
 }
 
-template<typename T>
-inline const T& Array3<T>::operator[](int i) const
+inline Array2< Vec<4,unsigned char> > toUchar(const Array2< Vec<4,float> >& a,int flags)
 {
-  assert(i>=0 && i<numel());
-
-  return d[i];
+  JZQ_PROFILE_SCOPE("toUchar");
+  return jzq_detail::packPixels<unsigned char>(a,flags);
 }
 
-template<typename T>
-inline T& Array3<T>::operator()(int i,int j,int k)
+inline Array2< Vec<4,unsigned short> > toUshort(const Array2< Vec<4,float> >& a,int flags)
 {
-  assert(d!=0);
-  assert(i>=0 && i<s(0) &&
-         j>=0 && j<s(1) &&
-         k>=0 && k<s(2));
-
-  return d[i+(j+k*s(1))*s(0)];
+  JZQ_PROFILE_SCOPE("toUshort");
+  return jzq_detail::packPixels<unsigned short>(a,flags);
 }
 
-template<typename T>
-inline const T& Array3<T>::operator()(int i,int j,int k) const
+inline Array2< Vec<4,unsigned char> > toUchar(const Array2< Vec<4,unsigned short> >& a)
 {
-  assert(d!=0);
-  assert(i>=0 && i<s(0) &&
-         j>=0 && j<s(1) &&
-         k>=0 && k<s(2));
+  JZQ_PROFILE_SCOPE("toUchar");
+  assert(numel(a)>0);
 
-  return d[i+(j+k*s(1))*s(0)];
-}
+  Array2< Vec<4,unsigned char> > out(size(a));
 
-template<typename T>
-inline T& Array3<T>::operator()(const Vec<3,int>& ijk)
-{
-  assert(d!=0);
-  assert(ijk(0)>=0 && ijk(0)<s(0) &&
-         ijk(1)>=0 && ijk(1)<s(1) &&
-         ijk(2)>=0 && ijk(2)<s(2));
+  const unsigned short* src = reinterpret_cast<const unsigned short*>(a.data());
+  unsigned char* dst = reinterpret_cast<unsigned char*>(out.data());
 
-  return d[ijk(0)+(ijk(1)+ijk(2)*s(1))*s(0)];
+  // round(v*255/65535) without a division
+  jzq_detail::parallelForBlocks(size_t(a.numel())*4,[&](size_t first,size_t last)
+  {
+    for(size_t i=first;i<last;i++) { dst[i] = (unsigned char)(((unsigned int)src[i]*255u+32895u)>>16); }
+  });
+
+  return out;
 }
 
-template<typename T>
-inline const T& Array3<T>::operator()(const Vec<3,int>& ijk) const
+inline Array2< Vec<4,unsigned short> > toUshort(const Array2< Vec<4,unsigned char> >& a)
 {
-  assert(d!=0);
-  assert(ijk(0)>=0 && ijk(0)<s(0) &&
-         ijk(1)>=0 && ijk(1)<s(1) &&
-         ijk(2)>=0 && ijk(2)<s(2));
+  JZQ_PROFILE_SCOPE("toUshort");
+  assert(numel(a)>0);
 
-  return d[ijk(0)+(ijk(1)+ijk(2)*s(1))*s(0)];
-}
+  Array2< Vec<4,unsigned short> > out(size(a));
 
-template<typename T>
-Vec3i Array3<T>::size() const
-{
-  return s;
-}
+  const unsigned char* src = reinterpret_cast<const unsigned char*>(a.data());
+  unsigned short* dst = reinterpret_cast<unsigned short*>(out.data());
 
-template<typename T>
-int Array3<T>::size(int dim) const
-{
-  assert(dim==0 || dim==1 || dim==2);
-  return size()(dim);
-}
+  jzq_detail::parallelForBlocks(size_t(a.numel())*4,[&](size_t first,size_t last)
+  {
+    for(size_t i=first;i<last;i++) { dst[i] = (unsigned short)(src[i]*257u); }
+  });
 
-template<typename T>
-int Array3<T>::width() const
-{
-  return size(0);
+  return out;
 }
 
-template<typename T>
-int Array3<T>::height() const
+namespace jzq_detail
 {
-  return size(1);
+  // Detaches a shared buffer before it gets written. The acquire fence orders
+  // the writes after the reads of owners that have just let go of it.
+  template<typename A>
+  A& detach(std::shared_ptr<A>* p)
+  {
+    if (p->use_count()>1) { *p = std::make_shared<A>(**p); }
+    else                  { std::atomic_thread_fence(std::memory_order_acquire); }
+    return **p;
+  }
 }
 
-template<typename T>
-int Array3<T>::depth() const
+template<int D,typename T>
+SharedArrayWriter<D,T>::SharedArrayWriter(SharedArrayN<D,T>* owner) : owner(owner)
 {
-  return size(2);
+  if (!owner->p) { owner->p = std::make_shared< ArrayN<D,T> >(); }
+  a = &jzq_detail::detach(&owner->p);
+  owner->numWriters++;
 }
 
-template<typename T>
-int Array3<T>::numel() const
+template<int D,typename T>
+SharedArrayWriter<D,T>::SharedArrayWriter(SharedArrayWriter<D,T>&& w) noexcept : owner(w.owner),a(w.a)
 {
-  return size(0)*size(1)*size(2);
+  w.owner = 0;
 }
 
-template<typename T>
-bool Array3<T>::empty() const
+template<int D,typename T>
+SharedArrayWriter<D,T>::~SharedArrayWriter()
 {
-  return (numel()==0);
+  if (owner) { owner->numWriters--; }
 }
 
-template<typename T>
-T* Array3<T>::data()
-{
-  return d;
-}
+template<int D,typename T>
+inline ArrayN<D,T>& SharedArrayWriter<D,T>::operator*() const { return *a; }
 
-template<typename T>
-const T* Array3<T>::data() const
-{
-  return d;
-}
+template<int D,typename T>
+inline ArrayN<D,T>* SharedArrayWriter<D,T>::operator->() const { return a; }
 
-template<typename T>
-void Array3<T>::clear()
-{
-  delete[] d;
-  s = Vec3i(0,0,0);
-  d = 0;
-}
+template<int D,typename T>
+inline T& SharedArrayWriter<D,T>::operator[](int i) const { return (*a)[i]; }
 
-template<typename T>
-void Array3<T>::swap(Array3<T>& b)
-{
-  Vec3i tmp_s = s;
-  s = b.s;
-  b.s = tmp_s;
+template<int D,typename T> template<typename... I>
+inline T& SharedArrayWriter<D,T>::operator()(int i,I... rest) const { return (*a)(i,rest...); }
 
-  T* tmp_d = d;
-  d = b.d;
-  b.d = tmp_d;
-}
+template<int D,typename T>
+inline T& SharedArrayWriter<D,T>::operator()(const Vec<D,int>& idx) const { return (*a)(idx); }
 
-template<typename T>
-Vec3i size(const Array3<T>& a)
-{
-  return a.size();
-}
+template<int D,typename T>
+SharedArrayN<D,T>::SharedArrayN() : numWriters(0) {}
 
-template<typename T>
-int size(const Array3<T>& a,int dim)
+template<int D,typename T> template<typename... I>
+SharedArrayN<D,T>::SharedArrayN(int width,I... rest) : p(std::make_shared< ArrayN<D,T> >(width,rest...)),numWriters(0) {}
+
+template<int D,typename T>
+SharedArrayN<D,T>::SharedArrayN(const Vec<D,int>& size) : p(std::make_shared< ArrayN<D,T> >(size)),numWriters(0) {}
+
+template<int D,typename T>
+SharedArrayN<D,T>::SharedArrayN(const ArrayN<D,T>& a) : p(std::make_shared< ArrayN<D,T> >(a)),numWriters(0) {}
+
+template<int D,typename T>
+SharedArrayN<D,T>::SharedArrayN(ArrayN<D,T>&& a) : p(std::make_shared< ArrayN<D,T> >(std::move(a))),numWriters(0) {}
+
+template<int D,typename T>
+SharedArrayN<D,T>::SharedArrayN(const SharedArrayN<D,T>& a) : p(a.shareOrCopy()),numWriters(0) {}
+
+template<int D,typename T>
+SharedArrayN<D,T>::SharedArrayN(SharedArrayN<D,T>&& a) noexcept : p(std::move(a.p)),numWriters(0)
 {
-  return a.size(dim);
+  assert(a.numWriters==0);
 }
 
-template<typename T>
-int numel(const Array3<T>& a)
+template<int D,typename T>
+SharedArrayN<D,T>::~SharedArrayN()
 {
-  return a.numel();
+  assert(numWriters==0);
 }
 
-template<typename T>
-bool empty(const Array3<T>& a)
+template<int D,typename T>
+SharedArrayN<D,T>& SharedArrayN<D,T>::operator=(const SharedArrayN<D,T>& a)
 {
-  return a.empty();
+  assert(numWriters==0);
+  if (this!=&a) { p = a.shareOrCopy(); }
+  return *this;
 }
 
-template<typename T>
-void clear(Array3<T>* a)
+template<int D,typename T>
+SharedArrayN<D,T>& SharedArrayN<D,T>::operator=(SharedArrayN<D,T>&& a) noexcept
 {
-  a->clear();
+  assert(numWriters==0 && a.numWriters==0);
+  p = std::move(a.p);
+  return *this;
 }
 
-template<typename T>
-void swap(Array3<T>& a,Array3<T>& b)
+// Shares the buffer, unless a writer may still be writing into it.
+template<int D,typename T>
+std::shared_ptr< ArrayN<D,T> > SharedArrayN<D,T>::shareOrCopy() const
 {
-  a.swap(b);
+  return numWriters>0 ? std::make_shared< ArrayN<D,T> >(*p) : p;
 }
 
-template<typename T>
-Array3<T> a3read(const std::string& fileName)
+template<int D,typename T>
+const ArrayN<D,T>& SharedArrayN<D,T>::get() const
 {
-  Array3<T> A;
-  if(!a3read(&A,fileName)) { return Array3<T>(); }
-  return A;
+  static const ArrayN<D,T> none;
+  return p ? *p : none;
 }
 
-template<typename T>
-bool a3read(Array3<T>* out_A,const std::string& fileName)
-{
-  FILE* f = fopen(fileName.c_str(),"rb");
+template<int D,typename T>
+inline const ArrayN<D,T>& SharedArrayN<D,T>::operator*() const { return get(); }
 
-  if(!f) { return false; }
+template<int D,typename T>
+inline const ArrayN<D,T>* SharedArrayN<D,T>::operator->() const { return &get(); }
 
-  int w,h,d,s;
+template<int D,typename T>
+inline const T& SharedArrayN<D,T>::operator[](int i) const { return get()[i]; }
 
-  if(fread(&w,sizeof(w),1,f)!=1 ||
-     fread(&h,sizeof(h),1,f)!=1 ||
-     fread(&d,sizeof(d),1,f)!=1 ||
-     fread(&s,sizeof(s),1,f)!=1 ||
-     ((w*h*d)<1) || s!=sizeof(T))
-  {
-    fclose(f);
-    return false;
-  }
+template<int D,typename T> template<typename... I>
+inline const T& SharedArrayN<D,T>::operator()(int i,I... rest) const { return get()(i,rest...); }
 
-  Array3<T> A(w,h,d);
+template<int D,typename T>
+inline const T& SharedArrayN<D,T>::operator()(const Vec<D,int>& idx) const { return get()(idx); }
 
-  if(fread(A.data(),sizeof(T)*w*h*d,1,f)!=1)
-  {
-    fclose(f);
-    return false;
-  }
+template<int D,typename T>
+Vec<D,int> SharedArrayN<D,T>::size() const { return get().size(); }
 
-  if(out_A!=0) { *out_A = A; }
+template<int D,typename T>
+int SharedArrayN<D,T>::width() const { return get().width(); }
 
-  fclose(f);
-  return true;
-}
+template<int D,typename T>
+int SharedArrayN<D,T>::height() const { return get().height(); }
 
-template<typename T>
-bool a3write(const Array3<T>& A,const std::string& fileName)
-{
-  if(A.numel()==0) { return false; }
+template<int D,typename T>
+int SharedArrayN<D,T>::depth() const { return get().depth(); }
 
-  FILE* f = fopen(fileName.c_str(),"wb");
+template<int D,typename T>
+int SharedArrayN<D,T>::numel() const { return get().numel(); }
 
-  if(!f) { return false; }
+template<int D,typename T>
+bool SharedArrayN<D,T>::empty() const { return get().empty(); }
 
-  const int w = A.width();
-  const int h = A.height();
-  const int d = A.depth();
-  const int s = sizeof(T);
+template<int D,typename T>
+const T* SharedArrayN<D,T>::data() const { return get().data(); }
 
-  if(fwrite(&w,sizeof(w),1,f)!=1 ||
-     fwrite(&h,sizeof(h),1,f)!=1 ||
-     fwrite(&d,sizeof(d),1,f)!=1 ||
-     fwrite(&s,sizeof(s),1,f)!=1 ||
-     fwrite(A.data(),sizeof(T)*w*h*d,1,f)!=1)
-  {
-    fclose(f);
-    return false;
-  }
+template<int D,typename T>
+bool SharedArrayN<D,T>::unique() const { return p.use_count()<=1; }
 
-  fclose(f);
-  return true;
+template<int D,typename T>
+SharedArrayWriter<D,T> SharedArrayN<D,T>::write()
+{
+  return SharedArrayWriter<D,T>(this);
+}
+
+inline void setArrayAllocation(int flags,size_t minBytes)
+{
+  jzq_detail::allocPolicy().minBytes.store(minBytes,std::memory_order_relaxed);
+  jzq_detail::allocPolicy().flags.store(flags,std::memory_order_relaxed);
 }
 
 #endif
@@ -0,0 +1,477 @@
+// This software is in the public domain. Where that dedication is not
+// recognized, you are granted a perpetual, irrevocable license to copy
+// and modify this file as you see fit.
+
+// Benchmarks of the jzq.h hot paths. Build and run with e.g.
+//
+//   g++ -std=c++11 -O2 -pthread jzq_bench.cpp -o jzq_bench
+//   ./jzq_bench [--json out.json] [--filter substring] [--samples n] [--min-time ms] [--dir tmpdir]
+//
+// Every case is run as a number of samples, each long enough to be timed
+// reliably. The table reports the mean ns per element with its standard
+// deviation over the samples, the fastest sample and the throughput of the
+// fastest sample in GB/s. The JSON output holds the same numbers plus the raw
+// samples, keyed by case name, type and size, so two runs can be diffed.
+
+#include "jzq.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstdarg>
+#include <cmath>
+#include <string>
+#include <vector>
+#include <chrono>
+
+namespace
+{
+
+struct Options
+{
+  std::string jsonFileName;
+  std::string filter;
+  std::string dir;
+  int         numSamples;
+  double      minSampleMs;
+};
+
+struct Result
+{
+  std::string         name;
+  std::string         type;
+  std::string         size;
+  double              elements;
+  double              bytes;
+  std::vector<double> samplesNs;
+};
+
+Options             g_options;
+std::vector<Result> g_results;
+
+volatile unsigned char g_sink;
+
+// Keeps the compiler from discarding a computation whose result is unused.
+template<typename T>
+void keep(const T& x)
+{
+  const unsigned char* p = reinterpret_cast<const unsigned char*>(&x);
+  unsigned char v = 0;
+  for(size_t i=0;i<sizeof(T);i++) { v ^= p[i]; }
+  g_sink = g_sink^v;
+}
+
+template<typename T> struct TypeName                  { static std::string get(); };
+template<> struct TypeName<unsigned char>             { static std::string get() { return "uc"; } };
+template<> struct TypeName<unsigned short>            { static std::string get() { return "us"; } };
+template<> struct TypeName<int>                       { static std::string get() { return "i"; } };
+template<> struct TypeName<float>                     { static std::string get() { return "f"; } };
+template<> struct TypeName<double>                    { static std::string get() { return "d"; } };
+template<int N,typename T> struct TypeName<Vec<N,T>>  { static std::string get() { return spf("Vec%d",N)+TypeName<T>::get(); } };
+template<int M,int N,typename T> struct TypeName<Mat<M,N,T>> { static std::string get() { return spf("Mat%dx%d",M,N)+TypeName<T>::get(); } };
+
+template<typename T> void randomize(T* x)                { *x = T(std::rand()%100); }
+template<int N,typename T> void randomize(Vec<N,T>* x)   { for(int i=0;i<N;i++) { randomize(&(*x)(i)); } }
+template<int M,int N,typename T> void randomize(Mat<M,N,T>* x) { for(int i=0;i<M;i++) for(int j=0;j<N;j++) { randomize(&(*x)(i,j)); } }
+
+template<typename T>
+void randomize(Array2<T>* a) { for(int i=0;i<a->numel();i++) { randomize(&(*a)[i]); } }
+
+template<typename T>
+void randomize(Array3<T>* a) { for(int i=0;i<a->numel();i++) { randomize(&(*a)[i]); } }
+
+double nowNs()
+{
+  return double(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count());
+}
+
+// Times fun() over numSamples samples. The number of calls per sample is
+// doubled until a sample takes at least minSampleMs; the recorded sample is
+// the time of a single call.
+template<typename F>
+void measure(const std::string& name,const std::string& type,const std::string& size,double elements,double bytes,F fun)
+{
+  const std::string key = name+" "+type+" "+size;
+  if (!g_options.filter.empty() && key.find(g_options.filter)==std::string::npos) { return; }
+
+  fun();
+
+  int calls = 1;
+  while(1)
+  {
+    const double t0 = nowNs();
+    for(int i=0;i<calls;i++) { fun(); }
+    const double t = nowNs()-t0;
+    if (t>=g_options.minSampleMs*1e6 || calls>=(1<<24)) { break; }
+    calls *= 2;
+  }
+
+  Result r;
+  r.name = name;
+  r.type = type;
+  r.size = size;
+  r.elements = elements;
+  r.bytes = bytes;
+
+  for(int s=0;s<g_options.numSamples;s++)
+  {
+    const double t0 = nowNs();
+    for(int i=0;i<calls;i++) { fun(); }
+    r.samplesNs.push_back((nowNs()-t0)/double(calls));
+  }
+
+  double mean = 0;
+  double best = r.samplesNs[0];
+  for(int s=0;s<int(r.samplesNs.size());s++) { mean += r.samplesNs[s]; best = std::min(best,r.samplesNs[s]); }
+  mean /= double(r.samplesNs.size());
+
+  double var = 0;
+  for(int s=0;s<int(r.samplesNs.size());s++) { var += (r.samplesNs[s]-mean)*(r.samplesNs[s]-mean); }
+  var /= double(std::max(int(r.samplesNs.size())-1,1));
+
+  printf("%-16s %-10s %-14s %10.3f ns/el  +-%8.3f  min %10.3f  %8.2f GB/s\n",
+         name.c_str(),type.c_str(),size.c_str(),
+         mean/elements,std::sqrt(var)/elements,best/elements,
+         bytes>0 ? bytes/best : 0.0);
+  fflush(stdout);
+
+  g_results.push_back(r);
+}
+
+std::string sizeName(const Vec2i& s) { return spf("%dx%d",s(0),s(1)); }
+std::string sizeName(const Vec3i& s) { return spf("%dx%dx%d",s(0),s(1),s(2)); }
+
+template<typename T>
+void benchArray2(const Vec2i& size)
+{
+  const std::string type = TypeName<T>::get();
+  const std::string sz = sizeName(size);
+  const double n = double(size(0))*double(size(1));
+  const double bytes = n*sizeof(T);
+
+  Array2<T> a(size);
+  randomize(&a);
+
+  measure("a2.construct",type,sz,n,0,[&]() { Array2<T> b(size); keep(b.data()); });
+  measure("a2.copy",type,sz,n,2*bytes,[&]() { Array2<T> b(a); keep(b[0]); });
+  const SharedArray2<T> shared(a);
+  measure("a2.shared.copy",type,sz,n,0,[&]() { SharedArray2<T> b(shared); keep(b[0]); });
+  measure("a2.fill",type,sz,n,bytes,[&]() { fill(&a,a[1]); keep(a[0]); });
+  randomize(&a);
+  measure("a2.sum",type,sz,n,bytes,[&]() { keep(sum(a)); });
+  measure("a2.apply",type,sz,n,2*bytes,[&]() { Array2<T> b = apply(a,[](const T& x) { return x+x; }); keep(b[0]); });
+}
+
+// min, max and argmin need an ordered element type.
+template<typename T>
+void benchOrdered(const Vec2i& size)
+{
+  const std::string type = TypeName<T>::get();
+  const std::string sz = sizeName(size);
+  const double n = double(size(0))*double(size(1));
+  const double bytes = n*sizeof(T);
+
+  Array2<T> a(size);
+  randomize(&a);
+
+  measure("a2.min",type,sz,n,bytes,[&]() { keep(min(a)); });
+  measure("a2.max",type,sz,n,bytes,[&]() { keep(max(a)); });
+  measure("a2.argmin",type,sz,n,bytes,[&]() { keep(argmin(a)); });
+}
+
+template<typename T>
+void benchArray3(const Vec3i& size)
+{
+  const std::string type = TypeName<T>::get();
+  const std::string sz = sizeName(size);
+  const double n = double(size(0))*double(size(1))*double(size(2));
+  const double bytes = n*sizeof(T);
+
+  Array3<T> a(size);
+  randomize(&a);
+
+  measure("a3.construct",type,sz,n,0,[&]() { Array3<T> b(size); keep(b.data()); });
+  measure("a3.copy",type,sz,n,2*bytes,[&]() { Array3<T> b(a); keep(b[0]); });
+}
+
+// c = a*s+b and dot(a,b) over an array of vectors.
+template<typename V>
+void benchVec()
+{
+  typedef typename jzq_detail::Scalar<V>::type S;
+
+  const int n = 4096;
+  std::vector<V> a(n),b(n),c(n);
+  for(int i=0;i<n;i++) { randomize(&a[i]); randomize(&b[i]); }
+
+  const std::string type = TypeName<V>::get();
+  measure("vec.axpy",type,spf("%d",n),n,3.0*n*sizeof(V),[&]()
+  {
+    for(int i=0;i<n;i++) { c[i] = a[i]*S(3)+b[i]; }
+    keep(c[n-1]);
+  });
+  measure("vec.dot",type,spf("%d",n),n,2.0*n*sizeof(V),[&]()
+  {
+    S d = S(0);
+    for(int i=0;i<n;i++) { d += dot(a[i],b[i]); }
+    keep(d);
+  });
+}
+
+// Matrix-matrix and matrix-vector products over an array of matrices.
+template<int N,typename T>
+void benchMat()
+{
+  typedef Mat<N,N,T> M;
+  typedef Vec<N,T> V;
+
+  const int n = 1024;
+  std::vector<M> a(n),b(n),c(n);
+  std::vector<V> u(n),v(n);
+  for(int i=0;i<n;i++) { randomize(&a[i]); randomize(&b[i]); randomize(&u[i]); }
+
+  const std::string type = TypeName<M>::get();
+  measure("mat.mul",type,spf("%d",n),n,3.0*n*sizeof(M),[&]()
+  {
+    for(int i=0;i<n;i++) { c[i] = a[i]*b[i]; }
+    keep(c[n-1]);
+  });
+  measure("mat.mulvec",type,spf("%d",n),n,n*(sizeof(M)+2*sizeof(V)),[&]()
+  {
+    for(int i=0;i<n;i++) { v[i] = a[i]*u[i]; }
+    keep(v[n-1]);
+  });
+}
+
+// The original spf, which allocated a 1 KiB vector and then copied it into
+// the returned string on every call; kept as the baseline for the variants.
+std::string spfLegacy(const std::string fmt,...)
+{
+  int size = 1024;
+  std::vector<char> buf;
+  va_list ap;
+
+  while(1)
+  {
+    if (size>16*1024*1024) { return std::string(""); }
+
+    buf.resize(size);
+
+    va_start(ap,fmt);
+    const int n = vsnprintf(&buf[0],size-1,fmt.c_str(),ap);
+    va_end(ap);
+
+    if      (n>-1 && n<size) { break; }
+    else if (n>-1)           { size = n + 1; }
+    else                     { size = 2*size; }
+  }
+
+  return std::string(&buf[0]);
+}
+
+void benchSpf()
+{
+  const char* shortFmt = "%s_%04d.png";
+  const char* longFmt = "%s/%s/%s_%08d_%f_%f.a2";
+  std::string out;
+
+  measure("spf.legacy","-","short",1,0,[&]() { keep(spfLegacy(shortFmt,"frame",42).size()); });
+  measure("spf","-","short",1,0,[&]() { keep(spf(shortFmt,"frame",42).size()); });
+  measure("spf.reuse","-","short",1,0,[&]() { keep(spf(&out,shortFmt,"frame",42).size()); });
+  measure("spfv","-","short",1,0,[&]() { keep(spfv(shortFmt,"frame",42)[0]); });
+
+  measure("spf.legacy","-","long",1,0,[&]() { keep(spfLegacy(longFmt,"some/long/directory","subdir","sequence_name",123456,3.14159,2.71828).size()); });
+  measure("spf","-","long",1,0,[&]() { keep(spf(longFmt,"some/long/directory","subdir","sequence_name",123456,3.14159,2.71828).size()); });
+  measure("spf.reuse","-","long",1,0,[&]() { keep(spf(&out,longFmt,"some/long/directory","subdir","sequence_name",123456,3.14159,2.71828).size()); });
+  measure("spfv","-","long",1,0,[&]() { keep(spfv(longFmt,"some/long/directory","subdir","sequence_name",123456,3.14159,2.71828)[0]); });
+}
+
+void benchPixels(const Vec2i& size)
+{
+  const std::string sz = sizeName(size);
+  const double n = double(size(0))*double(size(1));
+
+  Array2<Vec4uc> a(size);
+  randomize(&a);
+  const Array2<Vec4f> f = toFloat(a);
+
+  const int flags[] = { 0, JZQ_PIXEL_SRGB, JZQ_PIXEL_SRGB|JZQ_PIXEL_PREMULTIPLIED };
+  const char* flagNames[] = { "", ".srgb", ".srgb.premul" };
+
+  measure("pixels.cast","Vec4uc->Vec4f",sz,n,n*(4+16),[&]()
+  {
+    Array2<Vec4f> b(size);
+    for(int i=0;i<a.numel();i++) { b[i] = Vec4f(a[i])/255.0f; }
+    keep(b[0]);
+  });
+  for(int i=0;i<3;i++)
+  {
+    measure(std::string("pixels.toFloat")+flagNames[i],"Vec4uc->Vec4f",sz,n,n*(4+16),[&]() { Array2<Vec4f> b = toFloat(a,flags[i]); keep(b[0]); });
+    measure(std::string("pixels.toUchar")+flagNames[i],"Vec4f->Vec4uc",sz,n,n*(16+4),[&]() { Array2<Vec4uc> b = toUchar(f,flags[i]); keep(b[0]); });
+    measure(std::string("pixels.toUshort")+flagNames[i],"Vec4f->Vec4us",sz,n,n*(16+8),[&]() { Array2<Vec4us> b = toUshort(f,flags[i]); keep(b[0]); });
+  }
+}
+
+template<typename T>
+void benchIO2(const Vec2i& size)
+{
+  const std::string type = TypeName<T>::get();
+  const std::string sz = sizeName(size);
+  const double n = double(size(0))*double(size(1));
+  const double bytes = n*sizeof(T);
+  const std::string fileName = g_options.dir+"/jzq_bench.a2";
+
+  Array2<T> a(size);
+  randomize(&a);
+
+  measure("a2write",type,sz,n,bytes,[&]() { keep(a2write(a,fileName)); });
+  measure("a2read",type,sz,n,bytes,[&]() { Array2<T> b = a2read<T>(fileName); keep(b.numel()); });
+  Array2<T> b(size);
+  measure("a2read.inplace",type,sz,n,bytes,[&]() { keep(a2read(&b,fileName)); });
+
+  std::remove(fileName.c_str());
+}
+
+template<typename T>
+void benchIO3(const Vec3i& size)
+{
+  const std::string type = TypeName<T>::get();
+  const std::string sz = sizeName(size);
+  const double n = double(size(0))*double(size(1))*double(size(2));
+  const double bytes = n*sizeof(T);
+  const std::string fileName = g_options.dir+"/jzq_bench.a3";
+
+  Array3<T> a(size);
+  randomize(&a);
+
+  measure("a3write",type,sz,n,bytes,[&]() { keep(a3write(a,fileName)); });
+  measure("a3read",type,sz,n,bytes,[&]() { Array3<T> b = a3read<T>(fileName); keep(b.numel()); });
+  Array3<T> b(size);
+  measure("a3read.inplace",type,sz,n,bytes,[&]() { keep(a3read(&b,fileName)); });
+
+  std::remove(fileName.c_str());
+}
+
+const Vec2i g_sizes2[] = { Vec2i(64,64), Vec2i(512,512), Vec2i(2048,2048) };
+const Vec3i g_sizes3[] = { Vec3i(16,16,16), Vec3i(128,128,64) };
+
+template<typename T>
+void benchArrays()
+{
+  for(int i=0;i<3;i++) { benchArray2<T>(g_sizes2[i]); }
+  for(int i=0;i<2;i++) { benchArray3<T>(g_sizes3[i]); }
+}
+
+template<typename T>
+void benchScalarArrays()
+{
+  benchArrays<T>();
+  for(int i=0;i<3;i++) { benchOrdered<T>(g_sizes2[i]); }
+}
+
+template<typename T>
+void benchIO()
+{
+  const Vec2i sizes2[] = { Vec2i(256,256), Vec2i(2048,2048) };
+  const Vec3i sizes3[] = { Vec3i(128,128,64) };
+
+  for(int i=0;i<2;i++) { benchIO2<T>(sizes2[i]); }
+  for(int i=0;i<1;i++) { benchIO3<T>(sizes3[i]); }
+}
+
+std::string jsonEscape(const std::string& s)
+{
+  std::string out;
+  for(size_t i=0;i<s.size();i++)
+  {
+    if (s[i]=='"' || s[i]=='\\') { out += '\\'; }
+    out += s[i];
+  }
+  return out;
+}
+
+bool writeJson(const std::string& fileName)
+{
+  FILE* f = fopen(fileName.c_str(),"w");
+  if (!f) { return false; }
+
+  fprintf(f,"{\n  \"results\": [\n");
+  for(int i=0;i<int(g_results.size());i++)
+  {
+    const Result& r = g_results[i];
+
+    double mean = 0;
+    double best = r.samplesNs[0];
+    for(int s=0;s<int(r.samplesNs.size());s++) { mean += r.samplesNs[s]; best = std::min(best,r.samplesNs[s]); }
+    mean /= double(r.samplesNs.size());
+    double var = 0;
+    for(int s=0;s<int(r.samplesNs.size());s++) { var += (r.samplesNs[s]-mean)*(r.samplesNs[s]-mean); }
+    var /= double(std::max(int(r.samplesNs.size())-1,1));
+
+    fprintf(f,"    {\"name\": \"%s\", \"type\": \"%s\", \"size\": \"%s\", \"elements\": %.0f, "
+              "\"ns_per_element\": %.6g, \"ns_per_element_stddev\": %.6g, \"ns_per_element_min\": %.6g, "
+              "\"variance_ns2\": %.6g, \"gb_per_s\": %.6g, \"samples_ns\": [",
+            jsonEscape(r.name).c_str(),jsonEscape(r.type).c_str(),jsonEscape(r.size).c_str(),r.elements,
+            mean/r.elements,std::sqrt(var)/r.elements,best/r.elements,
+            var,r.bytes>0 ? r.bytes/best : 0.0);
+    for(int s=0;s<int(r.samplesNs.size());s++) { fprintf(f,"%s%.6g",s>0 ? ", " : "",r.samplesNs[s]); }
+    fprintf(f,"]}%s\n",i+1<int(g_results.size()) ? "," : "");
+  }
+  fprintf(f,"  ]\n}\n");
+
+  return fclose(f)==0;
+}
+
+}
+
+int main(int argc,char** argv)
+{
+  g_options.numSamples = 10;
+  g_options.minSampleMs = 20.0;
+  g_options.dir = ".";
+
+  for(int i=1;i<argc;i++)
+  {
+    const std::string arg = argv[i];
+    const bool hasValue = i+1<argc;
+
+    if      (arg=="--json"     && hasValue) { g_options.jsonFileName = argv[++i]; }
+    else if (arg=="--filter"   && hasValue) { g_options.filter = argv[++i]; }
+    else if (arg=="--dir"      && hasValue) { g_options.dir = argv[++i]; }
+    else if (arg=="--samples"  && hasValue) { g_options.numSamples = std::max(std::atoi(argv[++i]),1); }
+    else if (arg=="--min-time" && hasValue) { g_options.minSampleMs = std::atof(argv[++i]); }
+    else
+    {
+      fprintf(stderr,"usage: %s [--json out.json] [--filter substring] [--samples n] [--min-time ms] [--dir tmpdir]\n",argv[0]);
+      return 1;
+    }
+  }
+
+  benchScalarArrays<unsigned char>();
+  benchScalarArrays<float>();
+  benchScalarArrays<double>();
+  benchArrays<Vec3f>();
+  benchArrays<Vec4uc>();
+
+  benchVec<Vec2f>(); benchVec<Vec3f>(); benchVec<Vec4f>(); benchVec<Vec5f>(); benchVec<Vec6f>();
+  benchVec<Vec2d>(); benchVec<Vec3d>(); benchVec<Vec4d>(); benchVec<Vec5d>(); benchVec<Vec6d>();
+  benchVec<Vec2i>(); benchVec<Vec3i>(); benchVec<Vec4i>(); benchVec<Vec5i>(); benchVec<Vec6i>();
+
+  benchMat<2,float>(); benchMat<3,float>(); benchMat<4,float>(); benchMat<5,float>(); benchMat<6,float>();
+  benchMat<2,double>(); benchMat<3,double>(); benchMat<4,double>(); benchMat<5,double>(); benchMat<6,double>();
+
+  benchSpf();
+
+  for(int i=0;i<3;i++) { benchPixels(g_sizes2[i]); }
+
+  benchIO<unsigned char>();
+  benchIO<float>();
+  benchIO<Vec3f>();
+
+  if (!g_options.jsonFileName.empty() && !writeJson(g_options.jsonFileName))
+  {
+    fprintf(stderr,"failed to write %s\n",g_options.jsonFileName.c_str());
+    return 1;
+  }
+
+  return 0;
+}
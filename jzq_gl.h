@@ -328,6 +328,11 @@ GLenum GLTextureBase<TARGET,GLTexture>::formatFor(GLint internalFormat)
     case GL_RGB32UI:            return GL_RGB;
     case GL_RGBA32UI:           return GL_RGBA;
 
+    case GL_R16F:               return GL_RED;
+    case GL_RG16F:              return GL_RG;
+    case GL_RGB16F:             return GL_RGB;
+    case GL_RGBA16F:            return GL_RGBA;
+
     case GL_R32F:               return GL_RED;
     case GL_RG32F:              return GL_RG;
     case GL_RGB32F:             return GL_RGB;
@@ -385,6 +390,11 @@ GLenum GLTextureBase<TARGET,GLTexture>::typeFor(GLint internalFormat)
     case GL_RGB32UI:            return GL_UNSIGNED_INT;
     case GL_RGBA32UI:           return GL_UNSIGNED_INT;
 
+    case GL_R16F:               return GL_HALF_FLOAT;
+    case GL_RG16F:              return GL_HALF_FLOAT;
+    case GL_RGB16F:             return GL_HALF_FLOAT;
+    case GL_RGBA16F:            return GL_HALF_FLOAT;
+
     case GL_R32F:               return GL_FLOAT;
     case GL_RG32F:              return GL_FLOAT;
     case GL_RGB32F:             return GL_FLOAT;
@@ -415,6 +425,11 @@ template<> struct GLInternalFormatFor<Vec2i>         { static const GLint value
 template<> struct GLInternalFormatFor<Vec3i>         { static const GLint value = GL_RGB32I;  };
 template<> struct GLInternalFormatFor<Vec4i>         { static const GLint value = GL_RGBA32I; };
 
+template<> struct GLInternalFormatFor<half>          { static const GLint value = GL_R16F;    };
+template<> struct GLInternalFormatFor<Vec2h>         { static const GLint value = GL_RG16F;   };
+template<> struct GLInternalFormatFor<Vec3h>         { static const GLint value = GL_RGB16F;  };
+template<> struct GLInternalFormatFor<Vec4h>         { static const GLint value = GL_RGBA16F; };
+
 template<> struct GLInternalFormatFor<float>         { static const GLint value = GL_R32F;    };
 template<> struct GLInternalFormatFor<Vec2f>         { static const GLint value = GL_RG32F;   };
 template<> struct GLInternalFormatFor<Vec3f>         { static const GLint value = GL_RGB32F;  };